@@ -7,9 +7,13 @@
 #ifndef _BINDING_MAP_H
 #define _BINDING_MAP_H
 
+#include <algorithm>
+#include <functional>
 #include <memory>
+#include <optional>
 #include "Common.h"
 #include "ElunaUtility.h"
+#include "Hooks.h"
 #include <type_traits>
 
 extern "C"
@@ -22,10 +26,60 @@ class BaseBindingMap
 {
 public:
     virtual ~BaseBindingMap() = default;
+
+    // Removes every binding whose function reference matches `predicate`, returns the amount of removed bindings
+    virtual uint32 RemoveIf(const std::function<bool(int)>& predicate) = 0;
+};
+
+/*
+ * A bitmap of the values a binding is called for, such as packet opcodes.
+ *
+ * Bindings without a filter are called for every value.
+ */
+class BindingFilter
+{
+public:
+    void Add(uint32 value)
+    {
+        size_t word = value / 64;
+        if (word >= bits.size())
+            bits.resize(word + 1, 0);
+        bits[word] |= uint64(1) << (value % 64);
+    }
+
+    void AddRange(uint32 first, uint32 last)
+    {
+        for (uint64 value = first; value <= last; ++value)
+            Add(static_cast<uint32>(value));
+    }
+
+    void Merge(const BindingFilter& other)
+    {
+        if (other.bits.size() > bits.size())
+            bits.resize(other.bits.size(), 0);
+        for (size_t i = 0; i < other.bits.size(); ++i)
+            bits[i] |= other.bits[i];
+    }
+
+    void Clear() { bits.clear(); }
+
+    bool Contains(uint32 value) const
+    {
+        size_t word = value / 64;
+        return word < bits.size() && (bits[word] >> (value % 64)) & 1;
+    }
+
+private:
+    std::vector<uint64> bits;
 };
 
 /*
  * A set of bindings from keys of type `K` to Lua references.
+ *
+ * Keys are stored in an open addressing (linear probing) table that indexes
+ *   into a dense array of buckets. Each bucket keeps its handlers as parallel
+ *   arrays of IDs, function references and remaining shots, so dispatching
+ *   a hook reads contiguous memory instead of chasing a pointer per handler.
  */
 template<typename K>
 class BindingMap : public BaseBindingMap
@@ -34,61 +88,280 @@ private:
     lua_State* L;
     uint64 maxBindingID;
 
-    struct Binding
+    // Owned by Eluna, has a bit set for every event ID that has at least one binding in this map
+    Hooks::EventBindingMask& eventMask;
+    // Number of bindings per event ID, used to know when to clear a bit in `eventMask`
+    std::vector<uint32> eventBindingCounts;
+
+    struct BindingList
     {
-        uint64 id;
-        lua_State* L;
-        uint32 remainingShots;
-        int functionReference;
+        std::vector<uint64> ids;
+        std::vector<int> functionReferences;
+        std::vector<uint32> remainingShots;
+        // Empty unless a binding was inserted with a filter, null entries are unfiltered bindings
+        std::vector<std::shared_ptr<const BindingFilter>> filters;
+
+        // Union of `filters`, so a value no binding wants is rejected with one bit test
+        BindingFilter filterMask;
+        uint32 unfilteredCount = 0;
+
+        bool empty() const { return ids.empty(); }
+        size_t size() const { return ids.size(); }
+
+        bool Wants(size_t i, uint32 value) const
+        {
+            return filters.empty() || !filters[i] || filters[i]->Contains(value);
+        }
 
-        Binding(lua_State* L, uint64 id, int functionReference, uint32 remainingShots) :
-            id(id),
-            L(L),
-            remainingShots(remainingShots),
-            functionReference(functionReference)
-        { }
+        bool WantsAny(uint32 value) const
+        {
+            return unfilteredCount > 0 || filterMask.Contains(value);
+        }
+
+        void push_back(uint64 id, int ref, uint32 shots, std::shared_ptr<const BindingFilter> filter)
+        {
+            ids.push_back(id);
+            functionReferences.push_back(ref);
+            remainingShots.push_back(shots);
+
+            if (filter && filters.empty())
+                filters.resize(ids.size() - 1);
+            if (!filters.empty())
+                filters.push_back(filter);
+
+            if (filter)
+                filterMask.Merge(*filter);
+            else
+                ++unfilteredCount;
+        }
+
+        void erase(size_t i)
+        {
+            ids.erase(ids.begin() + i);
+            functionReferences.erase(functionReferences.begin() + i);
+            remainingShots.erase(remainingShots.begin() + i);
+            if (!filters.empty())
+            {
+                filters.erase(filters.begin() + i);
+                RebuildFilterMask();
+            }
+            else
+                --unfilteredCount;
+        }
+
+        void resize(size_t n)
+        {
+            ids.resize(n);
+            functionReferences.resize(n);
+            remainingShots.resize(n);
+            if (!filters.empty())
+            {
+                filters.resize(n);
+                RebuildFilterMask();
+            }
+            else
+                unfilteredCount = static_cast<uint32>(n);
+        }
 
-        ~Binding()
+        void RebuildFilterMask()
         {
-            luaL_unref(L, LUA_REGISTRYINDEX, functionReference);
+            filterMask.Clear();
+            unfilteredCount = 0;
+            for (auto& filter : filters)
+            {
+                if (filter)
+                    filterMask.Merge(*filter);
+                else
+                    ++unfilteredCount;
+            }
         }
     };
 
-    typedef std::vector< std::unique_ptr<Binding> > BindingList;
+    struct Bucket
+    {
+        K key;
+        BindingList list;
+
+        Bucket(const K& key) : key(key) { }
+    };
+
+    // Slot value meaning "no bucket", other values are bucket index + 1
+    static constexpr uint32 EMPTY_SLOT = 0;
+    static constexpr size_t MIN_TABLE_SIZE = 16;
+
+    std::vector<Bucket> buckets;
+    std::vector<uint32> slots;
 
-    std::unordered_map<K, BindingList> bindings;
     /*
      * This table is for fast removal of bindings by ID.
      *
-     * Instead of having to look through (potentially) every BindingList to find
-     *   the Binding with the right ID, this allows you to go directly to the
-     *   BindingList that might have the Binding with that ID.
+     * It maps a binding ID to the key it was inserted under, so `Remove`
+     *   only has to look at the handlers of that one key.
+     */
+    std::unordered_map<uint64, K> id_lookup_table;
+
+    size_t SlotMask() const { return slots.size() - 1; }
+
+    static size_t HashKey(const K& key)
+    {
+        // Fibonacci hashing spreads the often sequential event/entry hashes over the table
+        return static_cast<size_t>(static_cast<uint64>(std::hash<K>()(key)) * 0x9E3779B97F4A7C15ULL >> 16);
+    }
+
+    /*
+     * Returns the slot holding `key`, or the empty slot where it would be inserted.
+     */
+    size_t FindSlot(const K& key) const
+    {
+        std::equal_to<K> equal;
+        size_t mask = SlotMask();
+        size_t pos = HashKey(key) & mask;
+        while (slots[pos] != EMPTY_SLOT && !equal(buckets[slots[pos] - 1].key, key))
+            pos = (pos + 1) & mask;
+        return pos;
+    }
+
+    BindingList* Find(const K& key)
+    {
+        if (buckets.empty())
+            return nullptr;
+
+        size_t pos = FindSlot(key);
+        if (slots[pos] == EMPTY_SLOT)
+            return nullptr;
+
+        return &buckets[slots[pos] - 1].list;
+    }
+
+    void Rehash(size_t newSize)
+    {
+        slots.assign(newSize, EMPTY_SLOT);
+        for (size_t i = 0; i < buckets.size(); ++i)
+            slots[FindSlot(buckets[i].key)] = static_cast<uint32>(i + 1);
+    }
+
+    BindingList& FindOrInsert(const K& key)
+    {
+        // keep the load factor at or below 1/2
+        if ((buckets.size() + 1) * 2 > slots.size())
+            Rehash(std::max(MIN_TABLE_SIZE, slots.size() * 2));
+
+        size_t pos = FindSlot(key);
+        if (slots[pos] == EMPTY_SLOT)
+        {
+            buckets.emplace_back(key);
+            slots[pos] = static_cast<uint32>(buckets.size());
+        }
+        return buckets[slots[pos] - 1].list;
+    }
+
+    /*
+     * Removes the bucket for `key` from the table.
      *
-     * However, you must be careful not to store pointers to BindingLists
-     *   that no longer exist (see `void Clear(const K& key)` implementation).
+     * The last bucket is moved into the freed bucket index and following slots in the
+     *   probe sequence are shifted back, so no tombstones are needed.
      */
-    std::unordered_map<uint64, BindingList*> id_lookup_table;
+    void EraseBucket(const K& key)
+    {
+        size_t pos = FindSlot(key);
+        if (slots[pos] == EMPTY_SLOT)
+            return;
+
+        uint32 bucketIndex = slots[pos] - 1;
+
+        // backward shift deletion
+        size_t mask = SlotMask();
+        size_t hole = pos;
+        size_t next = (hole + 1) & mask;
+        while (slots[next] != EMPTY_SLOT)
+        {
+            size_t ideal = HashKey(buckets[slots[next] - 1].key) & mask;
+            // move the entry into the hole if its ideal slot is not in (hole, next]
+            if (((next - ideal) & mask) >= ((next - hole) & mask))
+            {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+            next = (next + 1) & mask;
+        }
+        slots[hole] = EMPTY_SLOT;
+
+        // keep buckets dense by moving the last bucket into the erased one
+        uint32 lastIndex = static_cast<uint32>(buckets.size() - 1);
+        if (bucketIndex != lastIndex)
+        {
+            slots[FindSlot(buckets[lastIndex].key)] = bucketIndex + 1;
+            buckets[bucketIndex] = std::move(buckets[lastIndex]);
+        }
+        buckets.pop_back();
+    }
+
+    void Unref(int ref)
+    {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    }
+
+    void UnrefAll(BindingList& list)
+    {
+        for (size_t i = 0; i < list.size(); ++i)
+        {
+            Unref(list.functionReferences[i]);
+            id_lookup_table.erase(list.ids[i]);
+        }
+    }
+
+    void AddEventBinding(const K& key)
+    {
+        size_t eventId = static_cast<size_t>(key.event_id);
+        if (eventId >= eventBindingCounts.size())
+            eventBindingCounts.resize(eventId + 1, 0);
+
+        if (eventBindingCounts[eventId]++ == 0)
+            eventMask[eventId] = true;
+    }
+
+    void RemoveEventBindings(const K& key, size_t count)
+    {
+        size_t eventId = static_cast<size_t>(key.event_id);
+        ASSERT(eventId < eventBindingCounts.size() && eventBindingCounts[eventId] >= count);
+
+        eventBindingCounts[eventId] -= static_cast<uint32>(count);
+        if (eventBindingCounts[eventId] == 0)
+            eventMask[eventId] = false;
+    }
 
 public:
-    BindingMap(lua_State* L) :
+    BindingMap(lua_State* L, Hooks::EventBindingMask& eventMask) :
         L(L),
-        maxBindingID(0)
-    { }
+        maxBindingID(0),
+        eventMask(eventMask)
+    {
+        eventMask.reset();
+    }
+
+    ~BindingMap() noexcept override
+    {
+        for (Bucket& bucket : buckets)
+            for (int ref : bucket.list.functionReferences)
+                Unref(ref);
 
-    ~BindingMap() noexcept override = default;
+        eventMask.reset();
+    }
 
     /*
      * Insert a new binding from `key` to `ref`, which lasts for `shots`-many pushes.
      *
      * If `shots` is 0, it will never automatically expire, but can still be
      *   removed with `Clear` or `Remove`.
+     *
+     * A binding with a `filter` is only pushed by `PushRefsFor` for values in the filter.
      */
-    uint64 Insert(const K& key, int ref, uint32 shots)
+    uint64 Insert(const K& key, int ref, uint32 shots, std::shared_ptr<const BindingFilter> filter = nullptr)
     {
         uint64 id = (++maxBindingID);
-        BindingList& list = bindings[key];
-        list.push_back(std::unique_ptr<Binding>(new Binding(L, id, ref, shots)));
-        id_lookup_table[id] = &list;
+        FindOrInsert(key).push_back(id, ref, shots, std::move(filter));
+        id_lookup_table.emplace(id, key);
+        AddEventBinding(key);
         return id;
     }
 
@@ -97,23 +370,13 @@ public:
      */
     void Clear(const K& key)
     {
-        if (bindings.empty())
+        BindingList* list = Find(key);
+        if (!list)
             return;
 
-        auto iter = bindings.find(key);
-        if (iter == bindings.end())
-            return;
-
-        BindingList& list = iter->second;
-
-        // Remove all pointers to `list` from `id_lookup_table`.
-        for (auto i = list.begin(); i != list.end(); ++i)
-        {
-            std::unique_ptr<Binding>& binding = *i;
-            id_lookup_table.erase(binding->id);
-        }
-
-        bindings.erase(key);
+        RemoveEventBindings(key, list->size());
+        UnrefAll(*list);
+        EraseBucket(key);
     }
 
     /*
@@ -121,11 +384,18 @@ public:
      */
     void Clear()
     {
-        if (bindings.empty())
+        if (buckets.empty())
             return;
 
+        for (Bucket& bucket : buckets)
+            for (int ref : bucket.list.functionReferences)
+                Unref(ref);
+
         id_lookup_table.clear();
-        bindings.clear();
+        buckets.clear();
+        slots.clear();
+        eventBindingCounts.clear();
+        eventMask.reset();
     }
 
     /*
@@ -139,22 +409,86 @@ public:
         if (iter == id_lookup_table.end())
             return;
 
-        BindingList* list = iter->second;
-        auto i = list->begin();
+        K key = iter->second;
+
+        // Unconditionally erase the ID in the lookup table because
+        //   it was either already invalid, or it's no longer valid.
+        id_lookup_table.erase(iter);
+
+        BindingList* list = Find(key);
+        if (!list)
+            return;
 
-        for (; i != list->end(); ++i)
+        for (size_t i = 0; i < list->size(); ++i)
         {
-            std::unique_ptr<Binding>& binding = *i;
-            if (binding->id == id)
-                break;
-        }
+            if (list->ids[i] != id)
+                continue;
 
-        if (i != list->end())
+            Unref(list->functionReferences[i]);
             list->erase(i);
+            RemoveEventBindings(key, 1);
+            break;
+        }
 
-        // Unconditionally erase the ID in the lookup table because
-        //   it was either already invalid, or it's no longer valid.
-        id_lookup_table.erase(id);
+        if (list->empty())
+            EraseBucket(key);
+    }
+
+    /*
+     * Remove all bindings whose function reference matches `predicate`.
+     *
+     * Used to replace the bindings of a single script when it is reloaded.
+     */
+    uint32 RemoveIf(const std::function<bool(int)>& predicate) override
+    {
+        uint32 removed = 0;
+        for (size_t b = 0; b < buckets.size();)
+        {
+            BindingList& list = buckets[b].list;
+
+            size_t kept = 0;
+            size_t count = list.size();
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (predicate(list.functionReferences[i]))
+                {
+                    Unref(list.functionReferences[i]);
+                    id_lookup_table.erase(list.ids[i]);
+                    continue;
+                }
+
+                if (kept != i)
+                {
+                    list.ids[kept] = list.ids[i];
+                    list.functionReferences[kept] = list.functionReferences[i];
+                    list.remainingShots[kept] = list.remainingShots[i];
+                    if (!list.filters.empty())
+                        list.filters[kept] = std::move(list.filters[i]);
+                }
+                ++kept;
+            }
+
+            if (kept == count)
+            {
+                ++b;
+                continue;
+            }
+
+            removed += static_cast<uint32>(count - kept);
+            RemoveEventBindings(buckets[b].key, count - kept);
+
+            if (kept == 0)
+            {
+                // the last bucket is moved into this index, so it is checked next
+                K key = buckets[b].key;
+                EraseBucket(key);
+                continue;
+            }
+
+            list.resize(kept);
+            ++b;
+        }
+        return removed;
     }
 
     /*
@@ -162,52 +496,74 @@ public:
      */
     bool HasBindingsFor(const K& key)
     {
-        if (bindings.empty())
-            return false;
-
-        auto result = bindings.find(key);
-        if (result == bindings.end())
-            return false;
+        BindingList* list = Find(key);
+        return list && !list->empty();
+    }
 
-        BindingList& list = result->second;
-        return !list.empty();
+    /*
+     * Check whether `key` has any bindings that want `value`, see `BindingFilter`.
+     */
+    bool HasBindingsFor(const K& key, uint32 value)
+    {
+        BindingList* list = Find(key);
+        return list && list->WantsAny(value);
     }
 
     /*
      * Push all Lua references for `key` onto the stack.
+     *
+     * If `value` is given, bindings whose filter does not contain it are skipped
+     *   and keep their remaining shots.
      */
-    void PushRefsFor(const K& key)
+    void PushRefsFor(const K& key, std::optional<uint32> value = std::nullopt)
     {
-        if (bindings.empty())
-            return;
-
-        auto result = bindings.find(key);
-        if (result == bindings.end())
+        BindingList* list = Find(key);
+        if (!list)
             return;
 
-        BindingList& list = result->second;
-        for (auto i = list.begin(); i != list.end();)
+        // compact the arrays in place while removing bindings that ran out of shots
+        size_t kept = 0;
+        size_t count = list->size();
+        for (size_t i = 0; i < count; ++i)
         {
-            std::unique_ptr<Binding>& binding = (*i);
-            auto i_prev = (i++);
-
-            lua_rawgeti(L, LUA_REGISTRYINDEX, binding->functionReference);
+            int ref = list->functionReferences[i];
+            uint32 shots = list->remainingShots[i];
 
-            if (binding->remainingShots > 0)
+            if (!value || list->Wants(i, *value))
             {
-                binding->remainingShots -= 1;
+                lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
 
-                if (binding->remainingShots == 0)
+                if (shots > 0 && --shots == 0)
                 {
-                    id_lookup_table.erase(binding->id);
-                    list.erase(i_prev);
+                    Unref(ref);
+                    id_lookup_table.erase(list->ids[i]);
+                    continue;
                 }
             }
+
+            if (kept != i)
+            {
+                list->ids[kept] = list->ids[i];
+                list->functionReferences[kept] = ref;
+                if (!list->filters.empty())
+                    list->filters[kept] = std::move(list->filters[i]);
+            }
+            list->remainingShots[kept] = shots;
+            ++kept;
         }
+
+        if (kept == count)
+            return;
+
+        RemoveEventBindings(key, count - kept);
+
+        if (kept == 0)
+            EraseBucket(key);
+        else
+            list->resize(kept);
     }
 };
 
-
 /*
  * A `BindingMap` key type for simple event ID bindings
  *   (ServerEvents, GuildEvents, etc.).
@@ -0,0 +1,242 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaAllocator.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+static int ElunaPanic(lua_State* L)
+{
+    const char* msg = lua_tostring(L, -1);
+    ELUNA_LOG_ERROR("[Eluna]: PANIC: unprotected error in call to Lua API (%s)", msg ? msg : "error object is not a string");
+    return 0; // return to Lua to abort
+}
+
+#if LUA_VERSION_NUM >= 504
+// Same scheme as the lauxlib warning functions: warnings start off, "@on" and "@off" switch them
+// and the pieces of a message are joined until the last one, warn() passes all of them in one call
+static void ElunaWarnOff(void* ud, const char* message, int tocont);
+static void ElunaWarnOn(void* ud, const char* message, int tocont);
+
+static bool ElunaWarnControl(lua_State* L, const char* message, int tocont)
+{
+    if (tocont || *message != '@')
+        return false;
+
+    if (strcmp(message, "@off") == 0)
+        lua_setwarnf(L, &ElunaWarnOff, L);
+    else if (strcmp(message, "@on") == 0)
+        lua_setwarnf(L, &ElunaWarnOn, L);
+    return true;
+}
+
+static void ElunaWarnOff(void* ud, const char* message, int tocont)
+{
+    ElunaWarnControl(static_cast<lua_State*>(ud), message, tocont);
+}
+
+static void ElunaWarnOn(void* ud, const char* message, int tocont)
+{
+    static thread_local std::string pending;
+    if (pending.empty() && ElunaWarnControl(static_cast<lua_State*>(ud), message, tocont))
+        return;
+
+    pending += message;
+    if (tocont)
+        return;
+
+    ELUNA_LOG_ERROR("[Eluna]: Lua warning: %s", pending.c_str());
+    pending.clear();
+}
+#endif
+
+ElunaAllocator::~ElunaAllocator()
+{
+    // Every Lua state using the allocator must be closed by now, the chunks go away with it
+    ASSERT(used == 0);
+}
+
+lua_State* ElunaAllocator::NewState()
+{
+    lua_State* L = lua_newstate(&ElunaAllocator::Alloc, this);
+
+    // 64-bit LuaJIT without GC64 refuses custom allocators
+    if (!L)
+    {
+        static std::once_flag reported;
+        std::call_once(reported, []()
+        {
+            ELUNA_LOG_INFO("[Eluna]: Lua does not support custom allocators (LuaJIT without GC64), states use its own allocator without memory limits or statistics");
+        });
+        return luaL_newstate();
+    }
+
+    lua_atpanic(L, &ElunaPanic);
+#if LUA_VERSION_NUM >= 504
+    // luaL_newstate installs the warning function of warn(), lua_newstate leaves it unset
+    lua_setwarnf(L, &ElunaWarnOff, L);
+#endif
+    return L;
+}
+
+ElunaAllocator* ElunaAllocator::GetAllocator(lua_State* L)
+{
+    void* ud = nullptr;
+    if (lua_getallocf(L, &ud) != &ElunaAllocator::Alloc)
+        return nullptr;
+    return static_cast<ElunaAllocator*>(ud);
+}
+
+ElunaAllocator::Stats ElunaAllocator::GetStats() const
+{
+    Stats stats;
+    stats.used = used;
+    stats.peak = peak;
+    stats.limit = limit;
+    stats.pooled = chunks.size() * CHUNK_SIZE;
+    stats.allocated = allocated;
+    stats.limitHits = limitHits;
+    return stats;
+}
+
+void* ElunaAllocator::Alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    ElunaAllocator* allocator = static_cast<ElunaAllocator*>(ud);
+
+    // Lua 5.2+ passes the object type in osize for new blocks
+    if (!ptr)
+        osize = 0;
+
+    if (nsize == 0)
+    {
+        if (ptr)
+        {
+            allocator->Free(ptr, osize);
+            allocator->used -= osize;
+
+            if (allocator->limitReported && allocator->used < allocator->limit / 4 * 3)
+                allocator->limitReported = false;
+        }
+        return nullptr;
+    }
+
+    // Only growing can fail, Lua expects shrinking a block to always succeed
+    if (nsize > osize && allocator->limit && allocator->enforced && allocator->used - osize + nsize > allocator->limit)
+    {
+        ++allocator->limitHits;
+        if (!allocator->limitReported)
+        {
+            ELUNA_LOG_ERROR("[Eluna]: Lua state reached its memory limit of %u KB, allocations fail until memory is freed", uint32(allocator->limit / 1024));
+            allocator->limitReported = true;
+        }
+        return nullptr;
+    }
+
+    void* block = ptr ? allocator->Reallocate(ptr, osize, nsize) : allocator->Allocate(nsize);
+    if (!block)
+        return nullptr;
+
+    allocator->used = allocator->used - osize + nsize;
+    if (nsize > osize)
+        allocator->allocated += nsize - osize;
+    if (allocator->used > allocator->peak)
+        allocator->peak = allocator->used;
+
+    return block;
+}
+
+void* ElunaAllocator::Allocate(size_t size)
+{
+    if (size > MAX_POOLED_SIZE)
+        return malloc(size);
+
+    size_t sizeClass = GetSizeClass(size);
+    if (!freeLists[sizeClass] && !RefillSizeClass(sizeClass))
+        return nullptr;
+
+    FreeBlock* block = freeLists[sizeClass];
+    freeLists[sizeClass] = block->next;
+    return block;
+}
+
+void* ElunaAllocator::Reallocate(void* ptr, size_t osize, size_t nsize)
+{
+    if (osize > MAX_POOLED_SIZE && nsize > MAX_POOLED_SIZE)
+        return realloc(ptr, nsize);
+
+    if (osize <= MAX_POOLED_SIZE && nsize <= MAX_POOLED_SIZE && GetSizeClass(osize) == GetSizeClass(nsize))
+        return ptr;
+
+    void* block = Allocate(nsize);
+    if (!block)
+    {
+        // Shrinking must not fail, keep the old block. It is large enough for the new size, a pooled one may later
+        // be freed into the smaller size class, where it simply wastes the difference
+        if (nsize >= osize)
+            return nullptr;
+        if (osize <= MAX_POOLED_SIZE)
+            return ptr;
+
+        // a malloc'd block now has a pooled size, Free has to give it back to malloc instead of a free list
+        try
+        {
+            mallocBlocks.insert(ptr);
+        }
+        catch (const std::bad_alloc&)
+        {
+            return nullptr;
+        }
+        return ptr;
+    }
+
+    memcpy(block, ptr, osize < nsize ? osize : nsize);
+    Free(ptr, osize);
+    return block;
+}
+
+void ElunaAllocator::Free(void* ptr, size_t size)
+{
+    if (size > MAX_POOLED_SIZE || (!mallocBlocks.empty() && mallocBlocks.erase(ptr)))
+    {
+        free(ptr);
+        return;
+    }
+
+    size_t sizeClass = GetSizeClass(size);
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    block->next = freeLists[sizeClass];
+    freeLists[sizeClass] = block;
+}
+
+bool ElunaAllocator::RefillSizeClass(size_t sizeClass)
+{
+    size_t blockSize = (sizeClass + 1) * SIZE_CLASS_STEP;
+
+    // operator new[] returns memory aligned for any fundamental type, block sizes keep that alignment
+    std::unique_ptr<char[]> chunk(new (std::nothrow) char[CHUNK_SIZE]);
+    if (!chunk)
+        return false;
+
+    for (size_t offset = 0; offset + blockSize <= CHUNK_SIZE; offset += blockSize)
+    {
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk.get() + offset);
+        block->next = freeLists[sizeClass];
+        freeLists[sizeClass] = block;
+    }
+
+    chunks.push_back(std::move(chunk));
+    return true;
+}
@@ -0,0 +1,103 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_ALLOCATOR_H
+#define _ELUNA_ALLOCATOR_H
+
+#include "ElunaUtility.h"
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+struct lua_State;
+
+/*
+ * Size class pool allocator used as the lua_Alloc of Eluna's Lua states.
+ *
+ * Blocks up to MAX_POOLED_SIZE come from per size class free lists carved out of larger chunks,
+ * bigger blocks go to malloc. Chunks are only released when the allocator is destroyed,
+ * so a reloaded state reuses the memory of the state it replaces.
+ * An allocator belongs to a single Lua state and is not thread safe.
+ * 64-bit LuaJIT without GC64 does not accept it, states then use LuaJIT's allocator and report no statistics.
+ */
+class ElunaAllocator
+{
+public:
+    struct Stats
+    {
+        size_t used;        // Bytes currently allocated by Lua
+        size_t peak;        // Highest value of `used` since the state was opened
+        size_t limit;       // 0 when there is no limit
+        size_t pooled;      // Bytes reserved in chunks for small blocks
+        uint64 allocated;   // Bytes handed out in total, only ever grows
+        uint32 limitHits;   // Allocations refused because of the limit
+    };
+
+    ElunaAllocator() { }
+    ~ElunaAllocator();
+
+    ElunaAllocator(const ElunaAllocator&) = delete;
+    ElunaAllocator& operator=(const ElunaAllocator&) = delete;
+
+    // Opens a new Lua state using this allocator, falls back to luaL_newstate where custom allocators are not supported
+    lua_State* NewState();
+
+    // Returns the allocator of a state opened with NewState, nullptr if it uses another allocator
+    static ElunaAllocator* GetAllocator(lua_State* L);
+
+    // 0 disables the limit
+    void SetLimit(size_t bytes) { limit = bytes; }
+    // Allocations only fail against the limit while enforced, an error outside of a protected call would abort the server.
+    // Returns the previous value so nested calls can restore it.
+    bool SetLimitEnforced(bool enforce)
+    {
+        bool old = enforced;
+        enforced = enforce;
+        return old;
+    }
+    void ResetPeak() { peak = used; }
+
+    Stats GetStats() const;
+    uint64 GetTotalAllocated() const { return allocated; }
+
+private:
+    enum PoolSettings
+    {
+        SIZE_CLASS_STEP  = 16, // Also the alignment of every pooled block
+        SIZE_CLASS_COUNT = 16,
+        MAX_POOLED_SIZE  = SIZE_CLASS_STEP * SIZE_CLASS_COUNT,
+        CHUNK_SIZE       = 16 * 1024
+    };
+
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+    static size_t GetSizeClass(size_t size) { return (size - 1) / SIZE_CLASS_STEP; }
+
+    void* Allocate(size_t size);
+    void* Reallocate(void* ptr, size_t osize, size_t nsize);
+    void Free(void* ptr, size_t size);
+    bool RefillSizeClass(size_t sizeClass);
+
+    FreeBlock* freeLists[SIZE_CLASS_COUNT] = { };
+    std::vector<std::unique_ptr<char[]>> chunks;
+    // Blocks from malloc that were shrunk to a pooled size while the pools could not grow
+    std::unordered_set<void*> mallocBlocks;
+
+    size_t used = 0;
+    size_t peak = 0;
+    size_t limit = 0;
+    uint64 allocated = 0;
+    uint32 limitHits = 0;
+    bool enforced = false;
+    bool limitReported = false;
+};
+
+#endif
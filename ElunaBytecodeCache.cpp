@@ -0,0 +1,275 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaBytecodeCache.h"
+#include "LuaEngine.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+
+#if defined USING_BOOST
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+typedef boost::system::error_code fs_error_code;
+#else
+#include <filesystem>
+namespace fs = std::filesystem;
+typedef std::error_code fs_error_code;
+#endif
+
+// Bumped whenever the layout of the index or the bytecode files changes, or what the hash covers.
+// Version 1 hashed the extension instead of the path, its files with the same content shared bytecode named after one of them
+static const char* const BYTECODE_CACHE_INDEX_HEADER = "eluna-bytecode-cache 2";
+
+// Bytecode is only valid for the Lua build that produced it
+#if defined LUAJIT_VERSION
+static const char* const BYTECODE_CACHE_LUA_TAG = LUAJIT_VERSION;
+#else
+static const char* const BYTECODE_CACHE_LUA_TAG = LUA_RELEASE;
+#endif
+
+static int64 GetModifiedTime(const fs::path& path, fs_error_code& ec)
+{
+#if defined USING_BOOST
+    return int64(fs::last_write_time(path, ec));
+#else
+    return int64(fs::last_write_time(path, ec).time_since_epoch().count());
+#endif
+}
+
+ElunaBytecodeCache::ElunaBytecodeCache(const std::string& directory) : directory(directory), hits(0), misses(0)
+{
+    if (!IsEnabled())
+        return;
+
+    fs_error_code ec;
+    fs::create_directories(this->directory, ec);
+    if (ec || !fs::is_directory(this->directory, ec))
+    {
+        ELUNA_LOG_ERROR("[Eluna]: Could not create the bytecode cache directory `%s`, scripts are compiled without the cache", this->directory.c_str());
+        this->directory.clear();
+        return;
+    }
+
+    LoadIndex();
+}
+
+uint64 ElunaBytecodeCache::Hash(const std::string& filepath, const std::string& source)
+{
+    // 64-bit FNV-1a
+    uint64 hash = 14695981039346656037ULL;
+    auto append = [&hash](const char* data, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= uint8(data[i]);
+            hash *= 1099511628211ULL;
+        }
+    };
+
+    const size_t pointerSize = sizeof(void*);
+    const size_t numberSize = sizeof(lua_Number);
+    append(BYTECODE_CACHE_LUA_TAG, strlen(BYTECODE_CACHE_LUA_TAG));
+    append(reinterpret_cast<const char*>(&pointerSize), sizeof(pointerSize));
+    append(reinterpret_cast<const char*>(&numberSize), sizeof(numberSize));
+    append(filepath.c_str(), filepath.size() + 1);
+    append(source.data(), source.size());
+    return hash;
+}
+
+bool ElunaBytecodeCache::ReadFile(const std::string& path, std::string& out)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    out = contents.str();
+    return !file.bad();
+}
+
+bool ElunaBytecodeCache::ReadFile(const std::string& path, BytecodeBuffer& out)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+
+    std::streamoff size = file.tellg();
+    if (size <= 0)
+        return false;
+
+    // Read in one go
+    out.resize(size_t(size));
+    file.seekg(0);
+    return bool(file.read(reinterpret_cast<char*>(out.data()), size));
+}
+
+std::string ElunaBytecodeCache::GetBytecodePath(uint64 hash) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.luac", (unsigned long long)hash);
+    return directory + "/" + name;
+}
+
+void ElunaBytecodeCache::LoadIndex()
+{
+    std::ifstream file(directory + "/index");
+    if (!file)
+        return;
+
+    std::string line;
+    if (!std::getline(file, line) || line != BYTECODE_CACHE_INDEX_HEADER)
+        return;
+
+    // hash modified size filepath
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        Entry entry;
+        std::string filepath;
+        if (!(fields >> std::hex >> entry.hash >> std::dec >> entry.modified >> entry.size))
+            continue;
+        fields.get();
+        if (!std::getline(fields, filepath) || filepath.empty())
+            continue;
+
+        index[filepath] = entry;
+    }
+}
+
+bool ElunaBytecodeCache::Load(LuaScript& script)
+{
+    if (!IsEnabled())
+        return false;
+
+    fs_error_code ec;
+    Entry entry;
+    entry.size = uint64(fs::file_size(script.filepath, ec));
+    if (!ec)
+        entry.modified = GetModifiedTime(script.filepath, ec);
+    if (ec)
+    {
+        ++misses;
+        return false;
+    }
+
+    // Only read and hash the source when the file was touched since it was cached
+    auto it = index.find(script.filepath);
+    if (it != index.end() && it->second.modified == entry.modified && it->second.size == entry.size)
+        entry.hash = it->second.hash;
+    else
+    {
+        std::string source;
+        if (!ReadFile(script.filepath, source))
+        {
+            ++misses;
+            return false;
+        }
+        entry.hash = Hash(script.filepath, source);
+    }
+
+    BytecodeBuffer bytecode;
+    if (!ReadFile(GetBytecodePath(entry.hash), bytecode))
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending[script.filepath] = entry;
+        ++misses;
+        return false;
+    }
+
+    script.bytecode = std::make_shared<const BytecodeBuffer>(std::move(bytecode));
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stored[script.filepath] = entry;
+    }
+    ++hits;
+    ELUNA_LOG_DEBUG("[Eluna]: Loaded bytecode of `%s` from the bytecode cache", script.filepath.c_str());
+    return true;
+}
+
+void ElunaBytecodeCache::Store(const LuaScript& script)
+{
+    Entry entry;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = pending.find(script.filepath);
+        if (it == pending.end())
+            return;
+        entry = it->second;
+    }
+
+    // Write to a temporary file first, a crash must not leave truncated bytecode behind
+    std::string path = GetBytecodePath(entry.hash);
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        if (!file || !file.write(reinterpret_cast<const char*>(script.bytecode->data()), script.bytecode->size()))
+        {
+            ELUNA_LOG_ERROR("[Eluna]: Could not write the bytecode of `%s` to `%s`", script.filepath.c_str(), temporary.c_str());
+            return;
+        }
+    }
+
+    fs_error_code ec;
+    fs::rename(temporary, path, ec);
+    if (ec)
+    {
+        ELUNA_LOG_ERROR("[Eluna]: Could not write the bytecode of `%s` to `%s`", script.filepath.c_str(), path.c_str());
+        fs::remove(temporary, ec);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    stored[script.filepath] = entry;
+}
+
+void ElunaBytecodeCache::Save()
+{
+    if (!IsEnabled())
+        return;
+
+    std::string path = directory + "/index";
+    {
+        std::ofstream file(path + ".tmp", std::ios::trunc);
+        if (!file)
+        {
+            ELUNA_LOG_ERROR("[Eluna]: Could not write the bytecode cache index `%s`", path.c_str());
+            return;
+        }
+
+        file << BYTECODE_CACHE_INDEX_HEADER << '\n';
+        for (auto& [filepath, entry] : stored)
+            file << std::hex << entry.hash << std::dec << ' ' << entry.modified << ' ' << entry.size << ' ' << filepath << '\n';
+    }
+
+    fs_error_code ec;
+    fs::rename(path + ".tmp", path, ec);
+    if (ec)
+    {
+        ELUNA_LOG_ERROR("[Eluna]: Could not write the bytecode cache index `%s`", path.c_str());
+        return;
+    }
+
+    // Drop bytecode of deleted and changed scripts so the directory does not grow forever
+    std::unordered_set<std::string> used;
+    for (auto& [filepath, entry] : stored)
+        used.insert(fs::path(GetBytecodePath(entry.hash)).filename().generic_string());
+
+    for (fs::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec))
+    {
+        const fs::path& file = it->path();
+        // temporary files are left behind only if writing was interrupted
+        if (file.extension() == ".tmp" || (file.extension() == ".luac" && used.find(file.filename().generic_string()) == used.end()))
+        {
+            fs_error_code removeError;
+            fs::remove(file, removeError);
+        }
+    }
+}
@@ -0,0 +1,74 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_BYTECODE_CACHE_H
+#define _ELUNA_BYTECODE_CACHE_H
+
+#include "ElunaUtility.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct LuaScript;
+
+/*
+ * On-disk cache of compiled scripts used by ElunaLoader.
+ *
+ * Bytecode is stored as `<hash>.luac`, where the hash covers the source of the script, its path
+ * and the Lua version it was compiled with. The path is part of the bytecode as the chunk name.
+ * An index file remembers the modification time, size and hash of every script,
+ * so unchanged files are not even read. Touched files with the same content still hit the cache.
+ */
+class ElunaBytecodeCache
+{
+public:
+    // An empty directory disables the cache
+    explicit ElunaBytecodeCache(const std::string& directory);
+
+    ElunaBytecodeCache(const ElunaBytecodeCache&) = delete;
+    ElunaBytecodeCache& operator=(const ElunaBytecodeCache&) = delete;
+
+    bool IsEnabled() const { return !directory.empty(); }
+
+    // Fills the script's bytecode when the cache has it, otherwise the script has to be compiled and passed to Store
+    bool Load(LuaScript& script);
+    void Store(const LuaScript& script);
+    // Writes the index and removes bytecode of scripts that were not loaded this time
+    void Save();
+
+    uint32 GetHits() const { return hits; }
+    uint32 GetMisses() const { return misses; }
+
+private:
+    struct Entry
+    {
+        int64 modified;
+        uint64 size;
+        uint64 hash;
+    };
+
+    static uint64 Hash(const std::string& filepath, const std::string& source);
+    static bool ReadFile(const std::string& path, std::string& out);
+    static bool ReadFile(const std::string& path, BytecodeBuffer& out);
+    std::string GetBytecodePath(uint64 hash) const;
+    void LoadIndex();
+
+    std::string directory;
+    // Index read from disk, filepath -> entry, read only after construction
+    std::unordered_map<std::string, Entry> index;
+    // Guards pending and stored, file IO happens outside of it
+    std::mutex lock;
+    // Scripts seen this time, compiled or not, filepath -> entry
+    std::unordered_map<std::string, Entry> pending;
+    // Scripts with bytecode in the cache, written as the new index
+    std::unordered_map<std::string, Entry> stored;
+    std::atomic<uint32> hits;
+    std::atomic<uint32> misses;
+};
+
+#endif
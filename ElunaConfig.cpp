@@ -38,15 +38,34 @@ void ElunaConfig::Initialize()
     SetConfig(CONFIG_ELUNA_ENABLE_UNSAFE, "Eluna.UseUnsafeMethods", true);
     SetConfig(CONFIG_ELUNA_ENABLE_DEPRECATED, "Eluna.UseDeprecatedMethods", true);
     SetConfig(CONFIG_ELUNA_ENABLE_RELOAD_COMMAND, "Eluna.ReloadCommand", true);
+    SetConfig(CONFIG_ELUNA_PROFILER, "Eluna.Profiler", false);
+    SetConfig(CONFIG_ELUNA_OBJECT_CACHE, "Eluna.ObjectCache", false);
+    SetConfig(CONFIG_ELUNA_INCREMENTAL_RELOAD, "Eluna.IncrementalReload", false);
+    SetConfig(CONFIG_ELUNA_COMPACT_INTEGERS, "Eluna.CompactIntegers", false);
+    SetConfig(CONFIG_ELUNA_GC_GENERATIONAL, "Eluna.GCGenerational", false); // Lua 5.4 only
+    SetConfig(CONFIG_ELUNA_COALESCE_WRITES, "Eluna.CoalesceWrites", false); // *DBExecute writes of a state update are committed as one transaction per database, *DBQuery and *DBQueryAsync calls only see them once committed after the update
 
     // Load strings
     SetConfig(CONFIG_ELUNA_SCRIPT_PATH, "Eluna.ScriptPath", "lua_scripts");
     SetConfig(CONFIG_ELUNA_ONLY_ON_MAPS, "Eluna.OnlyOnMaps", "");
     SetConfig(CONFIG_ELUNA_REQUIRE_PATH_EXTRA, "Eluna.RequirePaths", "");
     SetConfig(CONFIG_ELUNA_REQUIRE_CPATH_EXTRA, "Eluna.RequireCPaths", "");
+    SetConfig(CONFIG_ELUNA_BYTECODE_CACHE_PATH, "Eluna.BytecodeCachePath", ""); // empty disables the bytecode cache
 
     // Load ints
     SetConfig(CONFIG_ELUNA_RELOAD_SECURITY_LEVEL, "Eluna.ReloadSecurityLevel", 3);
+    SetConfig(CONFIG_ELUNA_STATE_MEMORY_LIMIT, "Eluna.StateMemoryLimit", 0); // KB per Lua state, 0 for no limit
+    SetConfig(CONFIG_ELUNA_COMPILE_THREADS, "Eluna.CompileThreads", 0); // 0 uses one thread per core
+    SetConfig(CONFIG_ELUNA_RELOAD_BUDGET, "Eluna.ReloadBudget", 50); // ms of state reloads per world tick, 0 reloads all states at once
+    SetConfig(CONFIG_ELUNA_STATE_POOL_SIZE, "Eluna.StatePoolSize", 0); // pre-built states kept per instanced map, 0 disables the pool
+    SetConfig(CONFIG_ELUNA_MESSAGE_QUEUE_SIZE, "Eluna.MessageQueueSize", 1024); // messages queued per Lua state with a message handler, 0 disables PublishToMap and PublishToWorld
+    SetConfig(CONFIG_ELUNA_GC_STEP_BUDGET, "Eluna.GCStepBudget", 0); // us of incremental collection at the end of each state update, 0 leaves pacing to Lua
+    SetConfig(CONFIG_ELUNA_GC_ERROR_INTERVAL, "Eluna.GCErrorCollectInterval", 1000); // ms between full collections after script errors, 0 collects after every error
+    SetConfig(CONFIG_ELUNA_WATCHDOG_SOFT_LIMIT, "Eluna.WatchdogSoftLimit", 0); // ms a single handler may run before it is logged as slow, 0 disables
+    SetConfig(CONFIG_ELUNA_WATCHDOG_HARD_LIMIT, "Eluna.WatchdogHardLimit", 0); // ms a single handler may run before it is aborted with an error, 0 disables. Turns the JIT compiler off on LuaJIT
+    SetConfig(CONFIG_ELUNA_WATCHDOG_INTERVAL, "Eluna.WatchdogInstructionInterval", 10000); // Lua instructions between watchdog checks
+    SetConfig(CONFIG_ELUNA_ASYNC_QUERY_THREADS, "Eluna.AsyncQueryThreads", 2); // threads running *DBQueryAsync on cores without async queries
+    SetConfig(CONFIG_ELUNA_ASYNC_QUERY_QUEUE_SIZE, "Eluna.AsyncQueryQueueSize", 1024); // queued async queries before new ones are rejected, 0 disables them on those cores
 
     // Call extra functions
     TokenizeAllowedMaps();
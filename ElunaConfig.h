@@ -17,6 +17,12 @@ enum ElunaConfigBoolValues
     CONFIG_ELUNA_ENABLE_UNSAFE,
     CONFIG_ELUNA_ENABLE_DEPRECATED,
     CONFIG_ELUNA_ENABLE_RELOAD_COMMAND,
+    CONFIG_ELUNA_PROFILER,
+    CONFIG_ELUNA_OBJECT_CACHE,
+    CONFIG_ELUNA_INCREMENTAL_RELOAD,
+    CONFIG_ELUNA_COMPACT_INTEGERS,
+    CONFIG_ELUNA_GC_GENERATIONAL,
+    CONFIG_ELUNA_COALESCE_WRITES,
     CONFIG_ELUNA_BOOL_COUNT
 };
 
@@ -26,12 +32,25 @@ enum ElunaConfigStringValues
     CONFIG_ELUNA_ONLY_ON_MAPS,
     CONFIG_ELUNA_REQUIRE_PATH_EXTRA,
     CONFIG_ELUNA_REQUIRE_CPATH_EXTRA,
+    CONFIG_ELUNA_BYTECODE_CACHE_PATH,
     CONFIG_ELUNA_STRING_COUNT
 };
 
 enum ElunaConfigUInt32Values
 {
     CONFIG_ELUNA_RELOAD_SECURITY_LEVEL,
+    CONFIG_ELUNA_STATE_MEMORY_LIMIT,
+    CONFIG_ELUNA_COMPILE_THREADS,
+    CONFIG_ELUNA_RELOAD_BUDGET,
+    CONFIG_ELUNA_STATE_POOL_SIZE,
+    CONFIG_ELUNA_MESSAGE_QUEUE_SIZE,
+    CONFIG_ELUNA_GC_STEP_BUDGET,
+    CONFIG_ELUNA_GC_ERROR_INTERVAL,
+    CONFIG_ELUNA_WATCHDOG_SOFT_LIMIT,
+    CONFIG_ELUNA_WATCHDOG_HARD_LIMIT,
+    CONFIG_ELUNA_WATCHDOG_INTERVAL,
+    CONFIG_ELUNA_ASYNC_QUERY_THREADS,
+    CONFIG_ELUNA_ASYNC_QUERY_QUEUE_SIZE,
     CONFIG_ELUNA_INT_COUNT
 };
 
@@ -56,7 +75,25 @@ public:
     bool UnsafeMethodsEnabled() { return GetConfig(CONFIG_ELUNA_ENABLE_UNSAFE); }
     bool DeprecatedMethodsEnabled() { return GetConfig(CONFIG_ELUNA_ENABLE_DEPRECATED); }
     bool IsReloadCommandEnabled() { return GetConfig(CONFIG_ELUNA_ENABLE_RELOAD_COMMAND); }
+    bool IsProfilerEnabled() { return GetConfig(CONFIG_ELUNA_PROFILER); }
+    bool IsObjectCacheEnabled() { return GetConfig(CONFIG_ELUNA_OBJECT_CACHE); }
+    bool IsIncrementalReloadEnabled() { return GetConfig(CONFIG_ELUNA_INCREMENTAL_RELOAD); }
+    bool AreCompactIntegersEnabled() { return GetConfig(CONFIG_ELUNA_COMPACT_INTEGERS); }
+    bool IsGenerationalGCEnabled() { return GetConfig(CONFIG_ELUNA_GC_GENERATIONAL); }
+    bool AreWritesCoalesced() { return GetConfig(CONFIG_ELUNA_COALESCE_WRITES); }
     AccountTypes GetReloadSecurityLevel() { return static_cast<AccountTypes>(GetConfig(CONFIG_ELUNA_RELOAD_SECURITY_LEVEL)); }
+    size_t GetStateMemoryLimit() { return size_t(GetConfig(CONFIG_ELUNA_STATE_MEMORY_LIMIT)) * 1024; }
+    uint32 GetCompileThreads() { return GetConfig(CONFIG_ELUNA_COMPILE_THREADS); }
+    uint32 GetReloadBudget() { return GetConfig(CONFIG_ELUNA_RELOAD_BUDGET); }
+    uint32 GetStatePoolSize() { return GetConfig(CONFIG_ELUNA_STATE_POOL_SIZE); }
+    uint32 GetMessageQueueSize() { return GetConfig(CONFIG_ELUNA_MESSAGE_QUEUE_SIZE); }
+    uint32 GetGCStepBudget() { return GetConfig(CONFIG_ELUNA_GC_STEP_BUDGET); }
+    uint32 GetGCErrorInterval() { return GetConfig(CONFIG_ELUNA_GC_ERROR_INTERVAL); }
+    uint32 GetWatchdogSoftLimit() { return GetConfig(CONFIG_ELUNA_WATCHDOG_SOFT_LIMIT); }
+    uint32 GetWatchdogHardLimit() { return GetConfig(CONFIG_ELUNA_WATCHDOG_HARD_LIMIT); }
+    uint32 GetWatchdogInterval() { return GetConfig(CONFIG_ELUNA_WATCHDOG_INTERVAL); }
+    uint32 GetAsyncQueryThreads() { return GetConfig(CONFIG_ELUNA_ASYNC_QUERY_THREADS); }
+    uint32 GetAsyncQueryQueueSize() { return GetConfig(CONFIG_ELUNA_ASYNC_QUERY_QUEUE_SIZE); }
     bool ShouldMapLoadEluna(uint32 mapId);
 
 private:
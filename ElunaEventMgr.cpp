@@ -6,6 +6,7 @@
 
 #include "ElunaEventMgr.h"
 #include "LuaEngine.h"
+#include <algorithm>
 #if !defined ELUNA_CMANGOS
 #include "Object.h"
 #else
@@ -25,14 +26,49 @@ ElunaEventProcessor::~ElunaEventProcessor()
 
 void ElunaEventProcessor::Update(uint32 diff)
 {
-    isUpdating = true;
+    // Everything that changes the wheel is deferred while updating, so a nested update would walk it mid change.
+    // Its time is caught up on once the running update is done
+    if (isUpdating)
+    {
+        pendingDiff += diff;
+        return;
+    }
 
-    m_time += diff;
-    while (!eventList.empty() && eventList.begin()->first <= m_time)
+    do
     {
-        auto it = eventList.begin();
-        LuaEvent* luaEvent = it->second;
-        eventList.erase(it);
+        isUpdating = true;
+
+        uint64 until = m_time + diff;
+        if (wheel)
+        {
+            RunEvents(DetachSlot(WHEEL_EXPIRED, 0));
+
+            while (scheduledCount && m_time < until)
+            {
+                m_time = NextWheelTime(until);
+                if ((m_time & WHEEL_MASK) == 0)
+                    Cascade();
+
+                RunEvents(DetachSlot(0, uint8(m_time & WHEEL_MASK)));
+            }
+        }
+        m_time = until;
+
+        isUpdating = false;
+        ProcessDeferredOps();
+
+        diff = pendingDiff;
+        pendingDiff = 0;
+    } while (diff);
+}
+
+void ElunaEventProcessor::RunEvents(LuaEvent* luaEvents)
+{
+    while (luaEvents)
+    {
+        LuaEvent* luaEvent = luaEvents;
+        luaEvents = luaEvent->next;
+        luaEvent->next = nullptr;
 
         if (luaEvent->state != LUAEVENT_STATE_ERASE)
             eventMap.erase(luaEvent->funcRef);
@@ -42,7 +78,7 @@ void ElunaEventProcessor::Update(uint32 diff)
             uint32 delay = luaEvent->delay;
             bool remove = luaEvent->repeats == 1;
             if (!remove)
-                AddEvent(luaEvent); // may be deferred if we recurse into Update
+                AddEvent(luaEvent); // deferred until the update is done
 
             // Call the timed event
             if (!obj || (obj && obj->IsInWorld()))
@@ -55,9 +91,6 @@ void ElunaEventProcessor::Update(uint32 diff)
         // Event should be deleted (executed last time or set to be aborted)
         RemoveEvent(luaEvent);
     }
-
-    isUpdating = false;
-    ProcessDeferredOps();
 }
 
 void ElunaEventProcessor::SetStates(LuaEventState state)
@@ -68,11 +101,8 @@ void ElunaEventProcessor::SetStates(LuaEventState state)
         return;
     }
 
-    for (auto& [time, event] : eventList)
-        event->SetState(state);
-
-    if (state == LUAEVENT_STATE_ERASE)
-        eventMap.clear();
+    if (state != LUAEVENT_STATE_RUN)
+        RemoveAllEvents(state);
 }
 
 void ElunaEventProcessor::ClearAllEvents()
@@ -83,12 +113,30 @@ void ElunaEventProcessor::ClearAllEvents()
         return;
     }
 
-    for (auto& [time, event] : eventList)
-        RemoveEvent(event);
-
+    RemoveAllEvents(LUAEVENT_STATE_ABORT);
     deferredOps.clear();
-    eventList.clear();
+}
+
+void ElunaEventProcessor::RemoveAllEvents(LuaEventState state)
+{
     eventMap.clear();
+    if (!wheel)
+        return;
+
+    for (uint8 level = 0; level <= WHEEL_EXPIRED; ++level)
+    {
+        for (uint8 slot = 0; slot < (level == WHEEL_EXPIRED ? 1 : WHEEL_SLOTS); ++slot)
+        {
+            LuaEvent* luaEvents = DetachSlot(level, slot);
+            while (luaEvents)
+            {
+                LuaEvent* luaEvent = luaEvents;
+                luaEvents = luaEvent->next;
+                luaEvent->SetState(state);
+                RemoveEvent(luaEvent);
+            }
+        }
+    }
 }
 
 void ElunaEventProcessor::SetState(int eventId, LuaEventState state)
@@ -99,12 +147,34 @@ void ElunaEventProcessor::SetState(int eventId, LuaEventState state)
         return;
     }
 
+    if (state == LUAEVENT_STATE_RUN)
+        return;
+
     auto itr = eventMap.find(eventId);
-    if (itr != eventMap.end())
-        itr->second->SetState(state);
+    if (itr == eventMap.end())
+        return;
 
-    if (state == LUAEVENT_STATE_ERASE)
-        eventMap.erase(eventId);
+    // Scheduled events always have the run state, so any other state removes the event right away
+    LuaEvent* luaEvent = itr->second;
+    eventMap.erase(itr);
+    Unschedule(luaEvent);
+    luaEvent->SetState(state);
+    RemoveEvent(luaEvent);
+}
+
+uint32 ElunaEventProcessor::RemoveEventsIf(const std::function<bool(int)>& predicate)
+{
+    ASSERT(!isUpdating);
+
+    std::vector<int> eventIds;
+    for (auto& [eventId, luaEvent] : eventMap)
+        if (predicate(luaEvent->funcRef))
+            eventIds.push_back(eventId);
+
+    for (int eventId : eventIds)
+        SetState(eventId, LUAEVENT_STATE_ABORT);
+
+    return uint32(eventIds.size());
 }
 
 void ElunaEventProcessor::AddEvent(LuaEvent* luaEvent)
@@ -116,13 +186,18 @@ void ElunaEventProcessor::AddEvent(LuaEvent* luaEvent)
     }
 
     luaEvent->GenerateDelay();
-    eventList.emplace(m_time + luaEvent->delay, luaEvent);
+    luaEvent->due = m_time + luaEvent->delay;
+    Schedule(luaEvent);
     eventMap[luaEvent->funcRef] = luaEvent;
 }
 
 void ElunaEventProcessor::AddEvent(int funcRef, uint32 min, uint32 max, uint32 repeats)
 {
-    AddEvent(new LuaEvent(funcRef, min, max, repeats));
+    mgr->E->SetRefOwner(funcRef);
+
+    LuaEvent* luaEvent = AllocateEvent();
+    *luaEvent = LuaEvent(funcRef, min, max, repeats);
+    AddEvent(luaEvent);
 }
 
 void ElunaEventProcessor::RemoveEvent(LuaEvent* luaEvent)
@@ -133,7 +208,152 @@ void ElunaEventProcessor::RemoveEvent(LuaEvent* luaEvent)
         // Free lua function ref
         luaL_unref(mgr->E->L, LUA_REGISTRYINDEX, luaEvent->funcRef);
     }
-    delete luaEvent;
+    FreeEvent(luaEvent);
+}
+
+void ElunaEventProcessor::Schedule(LuaEvent* luaEvent)
+{
+    if (!wheel)
+        wheel = std::make_unique<TimerWheel>();
+
+    // The current wheel slot was already run, so events due right away wait in the expired list for the next update
+    if (luaEvent->due > m_time)
+    {
+        PlaceInWheel(luaEvent);
+        return;
+    }
+
+    LuaEvent*& head = SlotHead(WHEEL_EXPIRED, 0);
+    luaEvent->prev = nullptr;
+    luaEvent->next = head;
+    if (head)
+        head->prev = luaEvent;
+    head = luaEvent;
+    luaEvent->wheelLevel = WHEEL_EXPIRED;
+    luaEvent->wheelSlot = 0;
+    ++scheduledCount;
+}
+
+void ElunaEventProcessor::PlaceInWheel(LuaEvent* luaEvent)
+{
+    // Pick the lowest level whose range still covers the time left
+    uint64 delta = luaEvent->due - m_time;
+    uint8 level = 0;
+    while (level < WHEEL_LEVELS - 1 && (delta >> (WHEEL_BITS * (level + 1))) != 0)
+        ++level;
+
+    uint8 slot = uint8((luaEvent->due >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+    // Slots are filled at the front, DetachSlot restores the insertion order
+    LuaEvent*& head = SlotHead(level, slot);
+    luaEvent->prev = nullptr;
+    luaEvent->next = head;
+    if (head)
+        head->prev = luaEvent;
+    head = luaEvent;
+    luaEvent->wheelLevel = level;
+    luaEvent->wheelSlot = slot;
+    ++scheduledCount;
+}
+
+void ElunaEventProcessor::Unschedule(LuaEvent* luaEvent)
+{
+    if (luaEvent->prev)
+        luaEvent->prev->next = luaEvent->next;
+    else
+        SlotHead(luaEvent->wheelLevel, luaEvent->wheelSlot) = luaEvent->next;
+
+    if (luaEvent->next)
+        luaEvent->next->prev = luaEvent->prev;
+
+    luaEvent->prev = nullptr;
+    luaEvent->next = nullptr;
+    --scheduledCount;
+}
+
+LuaEvent*& ElunaEventProcessor::SlotHead(uint8 level, uint8 slot)
+{
+    if (level == WHEEL_EXPIRED)
+        return wheel->expired;
+    return wheel->slots[level][slot];
+}
+
+LuaEvent* ElunaEventProcessor::DetachSlot(uint8 level, uint8 slot)
+{
+    LuaEvent*& head = SlotHead(level, slot);
+    LuaEvent* luaEvents = head;
+    head = nullptr;
+
+    // Reverse the list so events come out in the order they were scheduled
+    LuaEvent* ordered = nullptr;
+    while (luaEvents)
+    {
+        LuaEvent* luaEvent = luaEvents;
+        luaEvents = luaEvent->next;
+        luaEvent->prev = nullptr;
+        luaEvent->next = ordered;
+        ordered = luaEvent;
+        --scheduledCount;
+    }
+    return ordered;
+}
+
+void ElunaEventProcessor::Cascade()
+{
+    // Higher levels first so their events can be cascaded again by the level below
+    for (uint8 level = WHEEL_LEVELS - 1; level > 0; --level)
+    {
+        uint32 shift = WHEEL_BITS * level;
+        if ((m_time & ((uint64(1) << shift) - 1)) != 0)
+            continue;
+
+        LuaEvent* luaEvents = DetachSlot(level, uint8((m_time >> shift) & WHEEL_MASK));
+        while (luaEvents)
+        {
+            LuaEvent* luaEvent = luaEvents;
+            luaEvents = luaEvent->next;
+            PlaceInWheel(luaEvent);
+        }
+    }
+}
+
+uint64 ElunaEventProcessor::NextWheelTime(uint64 until) const
+{
+    // Next occupied slot on level 0 before it wraps, otherwise the wrap itself as higher levels cascade there
+    uint64 index = m_time & WHEEL_MASK;
+    for (uint64 slot = index + 1; slot < WHEEL_SLOTS; ++slot)
+        if (wheel->slots[0][slot])
+            return std::min(m_time + slot - index, until);
+
+    return std::min((m_time | WHEEL_MASK) + 1, until);
+}
+
+LuaEvent* ElunaEventProcessor::AllocateEvent()
+{
+    if (!freeEvents)
+    {
+        std::unique_ptr<LuaEvent[]> slab(new LuaEvent[nextSlabSize]);
+        for (uint32 i = 0; i < nextSlabSize; ++i)
+        {
+            slab[i].next = freeEvents;
+            freeEvents = &slab[i];
+        }
+
+        slabs.push_back(std::move(slab));
+        nextSlabSize = std::min<uint32>(nextSlabSize * 2, SLAB_MAX_SIZE);
+    }
+
+    LuaEvent* luaEvent = freeEvents;
+    freeEvents = luaEvent->next;
+    luaEvent->next = nullptr;
+    return luaEvent;
+}
+
+void ElunaEventProcessor::FreeEvent(LuaEvent* luaEvent)
+{
+    luaEvent->prev = nullptr;
+    luaEvent->next = freeEvents;
+    freeEvents = luaEvent;
 }
 
 void ElunaEventProcessor::QueueDeferredOp(DeferredOpType type, LuaEvent* event, int eventId, LuaEventState state)
@@ -217,6 +437,15 @@ void EventMgr::SetEventState(int eventId, LuaEventState state)
         processor->SetState(eventId, state);
 }
 
+uint32 EventMgr::RemoveEventsIf(const std::function<bool(int)>& predicate)
+{
+    uint32 removed = 0;
+    for (auto* processor : processors)
+        if (!processor->pendingDeletion)
+            removed += processor->RemoveEventsIf(predicate);
+    return removed;
+}
+
 ElunaEventProcessor* EventMgr::GetGlobalProcessor(GlobalEventSpace space)
 {
     auto it = globalProcessors.find(space);
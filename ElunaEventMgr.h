@@ -19,7 +19,9 @@
 #include "Util.h"
 #endif
 
+#include <functional>
 #include <map>
+#include <memory>
 
 #if defined ELUNA_TRINITY || defined ELUNA_AZEROTHCORE
 #include "Define.h"
@@ -54,7 +56,8 @@ enum GlobalEventSpace : uint8
 
 struct LuaEvent
 {
-    LuaEvent(int _funcRef, uint32 _min, uint32 _max, uint32 _repeats) : min(_min), max(_max), delay(0), repeats(_repeats), funcRef(_funcRef), state(LUAEVENT_STATE_RUN) { }
+    LuaEvent() : LuaEvent(0, 0, 0, 0) { }
+    LuaEvent(int _funcRef, uint32 _min, uint32 _max, uint32 _repeats) : min(_min), max(_max), delay(0), repeats(_repeats), funcRef(_funcRef), state(LUAEVENT_STATE_RUN), due(0), prev(nullptr), next(nullptr), wheelLevel(0), wheelSlot(0) { }
 
     void SetState(LuaEventState _state)
     {
@@ -73,6 +76,13 @@ struct LuaEvent
     uint32 repeats; // Amount of repeats to make, 0 for infinite
     int funcRef;    // Lua function reference ID, also used as event ID
     LuaEventState state;    // State for next call
+
+    // Scheduling data owned by ElunaEventProcessor
+    uint64 due;      // Processor time the event is due at
+    LuaEvent* prev;  // Links in a timer wheel slot, `next` also links the processor free list
+    LuaEvent* next;
+    uint8 wheelLevel;
+    uint8 wheelSlot;
 };
 
 class ElunaEventProcessor
@@ -80,7 +90,6 @@ class ElunaEventProcessor
     friend class EventMgr;
 
 public:
-    typedef std::multimap<uint64, LuaEvent*> EventList;
     typedef std::unordered_map<int, LuaEvent*> EventMap;
 
     ElunaEventProcessor(EventMgr* mgr, WorldObject* obj) : m_time(0), obj(obj), mgr(mgr) { }
@@ -92,6 +101,8 @@ public:
     // set the event to be removed when executing
     void SetState(int eventId, LuaEventState state);
     void AddEvent(int funcRef, uint32 min, uint32 max, uint32 repeats);
+    // aborts the events whose function reference matches `predicate`, must not be called while updating
+    uint32 RemoveEventsIf(const std::function<bool(int)>& predicate);
 
 private:
     struct DeferredOp
@@ -102,16 +113,63 @@ private:
         LuaEvent* event = nullptr;
     };
 
+    // Hierarchical timer wheel with millisecond ticks.
+    // Every level has 64 slots, a slot on level N spans a full rotation of level N - 1,
+    // so 6 levels cover 2^36 ms which is more than any uint32 delay.
+    // Events are moved down a level when the processor time reaches the start of their slot.
+    enum WheelSettings
+    {
+        WHEEL_LEVELS    = 6,
+        WHEEL_BITS      = 6,
+        WHEEL_SLOTS     = 1 << WHEEL_BITS,
+        WHEEL_MASK      = WHEEL_SLOTS - 1,
+        WHEEL_EXPIRED   = WHEEL_LEVELS // wheelLevel of events in the expired list
+    };
+
+    // Events are allocated from slabs owned by the processor and recycled through a free list
+    enum SlabSettings
+    {
+        SLAB_MIN_SIZE = 4,
+        SLAB_MAX_SIZE = 256
+    };
+
+    struct TimerWheel
+    {
+        LuaEvent* slots[WHEEL_LEVELS][WHEEL_SLOTS] = { };
+        LuaEvent* expired = nullptr; // Events that were already due when scheduled
+    };
+
     void ClearAllEvents();
+    void RemoveAllEvents(LuaEventState state);
     void AddEvent(LuaEvent* luaEvent);
     void RemoveEvent(LuaEvent* luaEvent);
+    void RunEvents(LuaEvent* luaEvents);
+
+    void Schedule(LuaEvent* luaEvent);
+    void PlaceInWheel(LuaEvent* luaEvent);
+    void Unschedule(LuaEvent* luaEvent);
+    LuaEvent*& SlotHead(uint8 level, uint8 slot);
+    LuaEvent* DetachSlot(uint8 level, uint8 slot);
+    void Cascade();
+    uint64 NextWheelTime(uint64 until) const;
+
+    LuaEvent* AllocateEvent();
+    void FreeEvent(LuaEvent* luaEvent);
 
     void QueueDeferredOp(DeferredOpType type, LuaEvent* event = nullptr, int eventId = 0, LuaEventState state = LUAEVENT_STATE_RUN);
     void ProcessDeferredOps();
     bool isUpdating = false;
+    // Time of updates nested in a running one, see Update
+    uint32 pendingDiff = 0;
     std::vector<DeferredOp> deferredOps;
 
-    EventList eventList;
+    std::unique_ptr<TimerWheel> wheel; // Allocated when the first event is scheduled
+    uint32 scheduledCount = 0;
+
+    std::vector<std::unique_ptr<LuaEvent[]>> slabs;
+    uint32 nextSlabSize = SLAB_MIN_SIZE;
+    LuaEvent* freeEvents = nullptr;
+
     EventMap eventMap;
     uint64 m_time;
 
@@ -143,6 +201,7 @@ public:
     void UpdateProcessors(uint32 diff);
     void SetAllEventStates(LuaEventState state);
     void SetEventState(int eventId, LuaEventState state);
+    uint32 RemoveEventsIf(const std::function<bool(int)>& predicate);
 
     // Global (per state) processors
     ElunaEventProcessor* GetGlobalProcessor(GlobalEventSpace space);
@@ -0,0 +1,171 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaGarbageCollector.h"
+
+#include <algorithm>
+
+extern "C"
+{
+#include "lua.h"
+};
+
+ElunaGarbageCollector::ElunaGarbageCollector() :
+    stepBudget(0),
+    generational(false),
+    errorInterval(0),
+    inCycle(false),
+    nextCycleHeap(0),
+    backstopHeap(0),
+    memoryLimit(0),
+    collectedOnError(false),
+    lastPause(0),
+    maxPause(0),
+    totalPause(0),
+    cycles(0),
+    errorCollects(0)
+{
+}
+
+void ElunaGarbageCollector::OnStateOpened(lua_State* L, uint32 stepBudget, bool generational, uint32 errorInterval, size_t memoryLimit)
+{
+    this->stepBudget = stepBudget;
+    this->errorInterval = errorInterval;
+    this->memoryLimit = int64(memoryLimit);
+    inCycle = false;
+    nextCycleHeap = 0;
+    backstopHeap = 0;
+    collectedOnError = false;
+    lastPause = maxPause = totalPause = 0;
+    cycles = errorCollects = 0;
+
+#if LUA_VERSION_NUM >= 504
+    this->generational = generational;
+    if (generational)
+        lua_gc(L, LUA_GCGEN, 0, 0);
+    else
+        lua_gc(L, LUA_GCINC, 0, 0, 0);
+#else
+    if (generational)
+        ELUNA_LOG_ERROR("[Eluna]: Generational garbage collection needs Lua 5.4, using incremental collection");
+    this->generational = false;
+#endif
+
+    if (IsPacing())
+        lua_gc(L, LUA_GCSTOP, 0);
+}
+
+int64 ElunaGarbageCollector::GetHeapSize(lua_State* L)
+{
+    return int64(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+void ElunaGarbageCollector::RecordPause(std::chrono::steady_clock::time_point start)
+{
+    lastPause = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    maxPause = std::max(maxPause, lastPause);
+    totalPause += lastPause;
+}
+
+void ElunaGarbageCollector::ScheduleCycle(int64 liveHeap)
+{
+    nextCycleHeap = liveHeap * 2;
+    backstopHeap = nextCycleHeap * 2;
+
+    // Lua 5.1 and LuaJIT do not collect when an allocation fails, so the stopped collector
+    // must get to the garbage before it fills the limit
+    if (memoryLimit)
+    {
+        nextCycleHeap = std::min(nextCycleHeap, std::max(liveHeap, memoryLimit / 2));
+        backstopHeap = std::min(backstopHeap, nextCycleHeap + (memoryLimit - nextCycleHeap) / 2);
+    }
+}
+
+void ElunaGarbageCollector::FullCollect(lua_State* L)
+{
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    if (IsPacing())
+    {
+#if LUA_VERSION_NUM == 501
+        lua_gc(L, LUA_GCSTOP, 0);
+#endif
+        inCycle = false;
+        ScheduleCycle(GetHeapSize(L));
+    }
+}
+
+void ElunaGarbageCollector::Update(lua_State* L)
+{
+    if (!IsPacing())
+        return;
+
+    int64 heap = GetHeapSize(L);
+
+    // the steps do not keep up with the garbage the scripts make, the stopped collector would never catch up on its own
+    if (backstopHeap && heap >= backstopHeap)
+    {
+        auto start = std::chrono::steady_clock::now();
+        FullCollect(L);
+        ++cycles;
+        RecordPause(start);
+        return;
+    }
+
+    if (!inCycle)
+    {
+        if (heap < nextCycleHeap)
+            return;
+        inCycle = true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::microseconds(stepBudget);
+    do
+    {
+        // returns 1 when the step finished a cycle
+        if (lua_gc(L, LUA_GCSTEP, 0))
+        {
+            inCycle = false;
+            ScheduleCycle(GetHeapSize(L));
+            ++cycles;
+            break;
+        }
+    } while (std::chrono::steady_clock::now() < deadline);
+
+#if LUA_VERSION_NUM == 501
+    // stepping lets the collector of Lua 5.1 and LuaJIT run on its own again
+    lua_gc(L, LUA_GCSTOP, 0);
+#endif
+
+    RecordPause(start);
+}
+
+void ElunaGarbageCollector::OnError(lua_State* L)
+{
+    auto start = std::chrono::steady_clock::now();
+    if (errorInterval && collectedOnError && start - lastErrorCollect < std::chrono::milliseconds(errorInterval))
+        return;
+
+    lastErrorCollect = start;
+    collectedOnError = true;
+    FullCollect(L);
+
+    ++errorCollects;
+    RecordPause(start);
+}
+
+void ElunaGarbageCollector::Collect(lua_State* L)
+{
+    // with Lua's own collector running the garbage is collected on later allocations anyway
+    if (!IsPacing())
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+    FullCollect(L);
+    ++cycles;
+    RecordPause(start);
+}
@@ -0,0 +1,77 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_GARBAGE_COLLECTOR_H
+#define _ELUNA_GARBAGE_COLLECTOR_H
+
+#include "ElunaUtility.h"
+
+#include <chrono>
+
+struct lua_State;
+
+/*
+ * Paces the garbage collector of a single Lua state.
+ *
+ * With a step budget the collector does not run on its own. Instead the state runs incremental steps
+ * at the end of every update until the budget is used. A new cycle starts once the heap has doubled
+ * since the previous one finished, like Lua's default pause of 200%. Should the budget fall behind and
+ * the heap grow past twice that threshold, the whole cycle is finished at once as a backstop.
+ * With a memory limit both thresholds are kept below it, as Lua 5.1 and LuaJIT do not collect on a failed allocation.
+ * Generational mode (Lua 5.4) runs on its own, its young collections are short already.
+ */
+class ElunaGarbageCollector
+{
+public:
+    ElunaGarbageCollector();
+
+    // `stepBudget` is in microseconds, 0 leaves pacing to Lua. `errorInterval` is in milliseconds, `memoryLimit` in bytes or 0
+    void OnStateOpened(lua_State* L, uint32 stepBudget, bool generational, uint32 errorInterval, size_t memoryLimit);
+    // Called at the end of every update
+    void Update(lua_State* L);
+    // Collects everything after a script error, at most once per error interval
+    void OnError(lua_State* L);
+    // Collects everything when pacing, for states that are not updated such as pooled ones
+    void Collect(lua_State* L);
+
+    bool IsGenerational() const { return generational; }
+    static int64 GetHeapSize(lua_State* L);
+
+    // Microseconds spent collecting in the last update or error collection
+    uint64 GetLastPause() const { return lastPause; }
+    uint64 GetMaxPause() const { return maxPause; }
+    uint64 GetTotalPause() const { return totalPause; }
+    // Cycles finished by Update, backstop collections included
+    uint32 GetCycles() const { return cycles; }
+    uint32 GetErrorCollects() const { return errorCollects; }
+
+private:
+    bool IsPacing() const { return stepBudget && !generational; }
+    // Sets the heap sizes starting the next paced cycle and the backstop from the heap left by the last one
+    void ScheduleCycle(int64 liveHeap);
+    // Runs a full collection and schedules the next paced cycle
+    void FullCollect(lua_State* L);
+    void RecordPause(std::chrono::steady_clock::time_point start);
+
+    uint32 stepBudget;
+    bool generational;
+    uint32 errorInterval;
+
+    bool inCycle;
+    int64 nextCycleHeap;
+    int64 backstopHeap;
+    int64 memoryLimit;
+    bool collectedOnError;
+    std::chrono::steady_clock::time_point lastErrorCollect;
+
+    uint64 lastPause;
+    uint64 maxPause;
+    uint64 totalPause;
+    uint32 cycles;
+    uint32 errorCollects;
+};
+
+#endif
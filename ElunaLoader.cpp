@@ -8,7 +8,10 @@
 #include "ElunaCompat.h"
 #include "ElunaConfig.h"
 #include "ElunaLoader.h"
+#include "ElunaMgr.h"
 #include "ElunaUtility.h"
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <sstream>
 #include <thread>
@@ -17,9 +20,11 @@
 #if defined USING_BOOST
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
+typedef boost::system::error_code fs_error_code;
 #else
 #include <filesystem>
 namespace fs = std::filesystem;
+typedef std::error_code fs_error_code;
 #endif
 
 #if defined ELUNA_WINDOWS
@@ -51,11 +56,15 @@ void ElunaUpdateListener::handleFileAction(efsw::WatchID /*watchid*/, std::strin
     if (ext != ".lua" && ext != ".ext")
         return;
 
-    sElunaLoader->ReloadElunaForMap(RELOAD_ALL_STATES);
+    if (sElunaConfig->IsIncrementalReloadEnabled())
+        sElunaLoader->ReloadScriptFile(path.generic_string());
+    else
+        sElunaLoader->ReloadElunaForMap(RELOAD_ALL_STATES);
 }
 #endif
 
-ElunaLoader::ElunaLoader() : m_cacheState(SCRIPT_CACHE_NONE)
+ElunaLoader::ElunaLoader() : m_cacheState(SCRIPT_CACHE_NONE), m_pendingReloads(0), m_pendingPriorityReloads(0), m_reloadInProgress(false),
+    m_reloadTickStart(0), m_reloadTickSpent(0), m_reloadsThisTick(0), m_lastPendingReport(0), m_scriptGeneration(0)
 {
 #if defined ELUNA_TRINITY
     lua_scriptWatcher = -1;
@@ -83,10 +92,22 @@ ElunaLoader::~ElunaLoader()
 #endif
 }
 
+std::string ElunaLoader::ExpandHomePath(std::string path)
+{
+#if !defined ELUNA_WINDOWS
+    if (!path.empty() && path[0] == '~')
+        if (const char* home = getenv("HOME"))
+            path.replace(0, 1, home);
+#endif
+    return path;
+}
+
 void ElunaLoader::ReloadScriptCache()
 {
-    // if the internal cache state is anything other than ready, we return
-    if (m_cacheState != SCRIPT_CACHE_READY)
+    // if the internal cache state is anything other than ready, we return.
+    // the file watcher recompiles scripts on its own thread, the exchange keeps it from running at the same time
+    uint8 cacheState = SCRIPT_CACHE_READY;
+    if (!m_cacheState.compare_exchange_strong(cacheState, SCRIPT_CACHE_REINIT))
     {
         ELUNA_LOG_DEBUG("[Eluna]: Script cache not ready, skipping reload");
         return;
@@ -96,9 +117,6 @@ void ElunaLoader::ReloadScriptCache()
     if (m_reloadThread.joinable())
         m_reloadThread.join();
 
-    // set the internal cache state to reinit
-    m_cacheState = SCRIPT_CACHE_REINIT;
-
     // create new thread to load scripts asynchronously
     m_reloadThread = std::thread(&ElunaLoader::LoadScripts, this);
     ELUNA_LOG_DEBUG("[Eluna]: Script cache reload thread started");
@@ -115,31 +133,27 @@ void ElunaLoader::LoadScripts()
 
     uint32 oldMSTime = ElunaUtil::GetCurrTime();
 
-    std::string lua_folderpath = sElunaConfig->GetConfig(CONFIG_ELUNA_SCRIPT_PATH);
+    std::string lua_folderpath = ExpandHomePath(sElunaConfig->GetConfig(CONFIG_ELUNA_SCRIPT_PATH));
     const std::string& lua_path_extra = sElunaConfig->GetConfig(CONFIG_ELUNA_REQUIRE_PATH_EXTRA);
     const std::string& lua_cpath_extra = sElunaConfig->GetConfig(CONFIG_ELUNA_REQUIRE_CPATH_EXTRA);
 
-#if !defined ELUNA_WINDOWS
-    if (lua_folderpath[0] == '~')
-        if (const char* home = getenv("HOME"))
-            lua_folderpath.replace(0, 1, home);
-#endif
-
     ELUNA_LOG_INFO("[Eluna]: Searching for scripts in `%s`", lua_folderpath.c_str());
 
-    // open a new temporary Lua state to compile bytecode in
-    lua_State* L = luaL_newstate();
-    luaL_openlibs(L);
+    m_bytecodeCache = std::make_unique<ElunaBytecodeCache>(ExpandHomePath(sElunaConfig->GetConfig(CONFIG_ELUNA_BYTECODE_CACHE_PATH)));
 
     // clear all cache variables
     m_requirePath.clear();
     m_requirecPath.clear();
 
-    // read and compile all scripts
-    ReadFiles(L, lua_folderpath);
+    // states reload everything for a new cache, the scripts changed in the old one do not matter anymore
+    {
+        std::lock_guard<std::mutex> guard(m_changedScriptsLock);
+        m_changedScripts.clear();
+    }
 
-    // close temporary Lua state
-    lua_close(L);
+    // find all scripts, then compile them on the worker threads
+    ReadFiles(lua_folderpath);
+    CompileScripts();
 
     // combine lists of Lua scripts and extensions
     CombineLists();
@@ -158,7 +172,14 @@ void ElunaLoader::LoadScripts()
     if (!m_requirecPath.empty())
         m_requirecPath.erase(m_requirecPath.end() - 1);
 
-    ELUNA_LOG_INFO("[Eluna]: Loaded and precompiled %u scripts in %u ms", uint32(m_scriptCache.size()), ElunaUtil::GetTimeDiff(oldMSTime));
+    if (m_bytecodeCache->IsEnabled())
+    {
+        m_bytecodeCache->Save();
+        ELUNA_LOG_INFO("[Eluna]: Loaded and precompiled %u scripts in %u ms (bytecode cache: %u hits, %u misses)", uint32(m_scriptCache.size()), ElunaUtil::GetTimeDiff(oldMSTime), m_bytecodeCache->GetHits(), m_bytecodeCache->GetMisses());
+    }
+    else
+        ELUNA_LOG_INFO("[Eluna]: Loaded and precompiled %u scripts in %u ms", uint32(m_scriptCache.size()), ElunaUtil::GetTimeDiff(oldMSTime));
+    m_bytecodeCache.reset();
 
     // set the cache state to ready
     m_cacheState = SCRIPT_CACHE_READY;
@@ -170,10 +191,10 @@ int ElunaLoader::LoadBytecodeChunk(lua_State* /*L*/, uint8* bytes, size_t len, B
     return 0;
 }
 
-// Finds lua script files from given path (including subdirectories) and pushes them to scripts
-void ElunaLoader::ReadFiles(lua_State* L, std::string path)
+// Finds lua script files from given path (including subdirectories) and pushes them to the files to compile
+void ElunaLoader::ReadFiles(std::string path)
 {
-    std::string lua_folderpath = sElunaConfig->GetConfig(CONFIG_ELUNA_SCRIPT_PATH);
+    std::string lua_folderpath = ExpandHomePath(sElunaConfig->GetConfig(CONFIG_ELUNA_SCRIPT_PATH));
 
     ELUNA_LOG_DEBUG("[Eluna]: ReadFiles from path `%s`", path.c_str());
 
@@ -208,7 +229,7 @@ void ElunaLoader::ReadFiles(lua_State* L, std::string path)
             // load subfolder
             if (fs::is_directory(dir_iter->status()))
             {
-                ReadFiles(L, fullpath);
+                ReadFiles(fullpath);
                 continue;
             }
 
@@ -231,13 +252,13 @@ void ElunaLoader::ReadFiles(lua_State* L, std::string path)
                 // was file, try add
                 std::string filename = dir_iter->path().filename().generic_string();
                 size_t filesize = fs::file_size(dir_iter->path());
-                ProcessScript(L, filename, filesize, fullpath, mapId);
+                m_scriptFiles.push_back({ filename, filesize, fullpath, mapId });
             }
         }
     }
 }
 
-bool ElunaLoader::CompileScript(lua_State* L, LuaScript& script)
+bool ElunaLoader::CompileScript(lua_State* L, LuaScript& script, size_t sizeHint)
 {
     // Attempt to load the file
     int err = 0;
@@ -258,60 +279,109 @@ bool ElunaLoader::CompileScript(lua_State* L, LuaScript& script)
     ELUNA_LOG_DEBUG("[Eluna]: CompileScript loaded Lua script `%s`", script.filename.c_str());
 
     // Everything's OK so far, the script has been loaded, now we need to start dumping it to bytecode.
-    err = lua_dump(L, (lua_Writer)LoadBytecodeChunk, &script.bytecode);
-    if (err || script.bytecode.empty())
+    BytecodeBuffer bytecode;
+    bytecode.reserve(sizeHint);
+    err = lua_dump(L, (lua_Writer)LoadBytecodeChunk, &bytecode);
+    if (err || bytecode.empty())
     {
         ELUNA_LOG_ERROR("[Eluna]: CompileScript failed to dump the Lua script `%s` to bytecode.", script.filename.c_str());
         Eluna::Report(L);
         return false;
     }
     ELUNA_LOG_DEBUG("[Eluna]: CompileScript dumped Lua script `%s` to bytecode.", script.filename.c_str());
+    script.bytecode = std::make_shared<const BytecodeBuffer>(std::move(bytecode));
 
     // pop the loaded function from the stack
     lua_pop(L, 1);
     return true;
 }
 
-void ElunaLoader::ProcessScript(lua_State* L, std::string filename, const size_t& filesize, const std::string& fullpath, int32 mapId)
+bool ElunaLoader::ProcessScript(lua_State* L, const ScriptFile& file, LuaScript& script)
 {
-    ELUNA_LOG_DEBUG("[Eluna]: ProcessScript checking file `%s`", fullpath.c_str());
+    ELUNA_LOG_DEBUG("[Eluna]: ProcessScript checking file `%s`", file.fullpath.c_str());
 
     // split file name
-    std::size_t extDot = filename.find_last_of('.');
+    std::size_t extDot = file.filename.find_last_of('.');
     if (extDot == std::string::npos)
-        return;
-    std::string ext = filename.substr(extDot);
-    filename = filename.substr(0, extDot);
+        return false;
+    std::string ext = file.filename.substr(extDot);
+    std::string filename = file.filename.substr(0, extDot);
 
     // check extension and add path to scripts to load
     if (ext != ".lua" && ext != ".ext" && ext != ".moon")
-        return;
-    bool extension = ext == ".ext";
+        return false;
 
-    LuaScript script;
     script.fileext = ext;
     script.filename = filename;
-    script.filepath = fullpath;
-    script.modulepath = fullpath.substr(0, fullpath.length() - filename.length() - ext.length());
-    script.bytecode.reserve(filesize);
-    script.mapId = mapId;
+    script.filepath = file.fullpath;
+    script.modulepath = file.fullpath.substr(0, file.fullpath.length() - filename.length() - ext.length());
+    script.mapId = file.mapId;
 
-    // if compilation fails, we don't add the script
-    if (!CompileScript(L, script))
-        return;
+    // unchanged scripts are taken from the bytecode cache, if compilation fails, we don't add the script
+    if (!m_bytecodeCache->Load(script))
+    {
+        if (!CompileScript(L, script, file.filesize))
+            return false;
+        m_bytecodeCache->Store(script);
+    }
 
-    if (extension)
-        m_extensions.push_back(script);
-    else
-        m_scripts.push_back(script);
+    ELUNA_LOG_DEBUG("[Eluna]: ProcessScript processed `%s` successfully", file.fullpath.c_str());
+    return true;
+}
 
-    ELUNA_LOG_DEBUG("[Eluna]: ProcessScript processed `%s` successfully", fullpath.c_str());
+void ElunaLoader::CompileScripts()
+{
+    std::vector<LuaScript> compiled(m_scriptFiles.size());
+    std::vector<uint8> processed(m_scriptFiles.size(), 0);
+    std::atomic<size_t> nextFile(0);
+
+    auto worker = [&]()
+    {
+        // open a new temporary Lua state to compile bytecode in, Lua states must not be shared between threads
+        ElunaAllocator allocator;
+        lua_State* L = allocator.NewState();
+        luaL_openlibs(L);
+
+        for (size_t i = nextFile++; i < m_scriptFiles.size(); i = nextFile++)
+            processed[i] = ProcessScript(L, m_scriptFiles[i], compiled[i]);
+
+        // close temporary Lua state
+        lua_close(L);
+    };
+
+    uint32 threadCount = sElunaConfig->GetCompileThreads();
+    if (!threadCount)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    if (threadCount > m_scriptFiles.size())
+        threadCount = std::max<uint32>(1, uint32(m_scriptFiles.size()));
+
+    // the loading thread works through the files as well
+    std::vector<std::thread> workers;
+    for (uint32 i = 1; i < threadCount; ++i)
+        workers.emplace_back(worker);
+    worker();
+    for (std::thread& thread : workers)
+        thread.join();
+
+    // the order compiled scripts end up in does not matter, CombineLists sorts them
+    for (size_t i = 0; i < compiled.size(); ++i)
+    {
+        if (!processed[i])
+            continue;
+
+        if (compiled[i].fileext == ".ext")
+            m_extensions.push_back(std::move(compiled[i]));
+        else
+            m_scripts.push_back(std::move(compiled[i]));
+    }
+
+    m_scriptFiles.clear();
 }
 
 #if defined ELUNA_TRINITY
 void ElunaLoader::InitializeFileWatcher()
 {
-    std::string lua_folderpath = sElunaConfig->GetConfig(CONFIG_ELUNA_SCRIPT_PATH);
+    std::string lua_folderpath = ExpandHomePath(sElunaConfig->GetConfig(CONFIG_ELUNA_SCRIPT_PATH));
 
     lua_scriptWatcher = lua_fileWatcher.addWatch(lua_folderpath, &elunaUpdateListener, true);
     if (lua_scriptWatcher >= 0)
@@ -337,16 +407,240 @@ void ElunaLoader::CombineLists()
     m_extensions.sort(ScriptPathComparator);
     m_scripts.sort(ScriptPathComparator);
 
+    m_scriptIndex.clear();
     m_scriptCache.clear();
     m_scriptCache.reserve(m_extensions.size() + m_scripts.size());
 
     std::move(m_extensions.begin(), m_extensions.end(), std::back_inserter(m_scriptCache));
     std::move(m_scripts.begin(), m_scripts.end(), std::back_inserter(m_scriptCache));
 
+    // the cache is not modified until the next reload, so the index can point into it.
+    // emplace keeps the first script with a name, like the lookup by scanning the cache did
+    m_scriptIndex.reserve(m_scriptCache.size());
+    for (const LuaScript& script : m_scriptCache)
+        m_scriptIndex.emplace(script.filename, &script);
+
     m_extensions.clear();
     m_scripts.clear();
 }
 
+void ElunaLoader::ReloadScriptFile(const std::string& filepath)
+{
+    // the cache must not change while it is being loaded or while another script is recompiled
+    uint8 cacheState = SCRIPT_CACHE_READY;
+    if (!m_cacheState.compare_exchange_strong(cacheState, SCRIPT_CACHE_LOADING))
+    {
+        ReloadElunaForMap(RELOAD_ALL_STATES);
+        return;
+    }
+
+    uint32 oldMSTime = ElunaUtil::GetCurrTime();
+
+    // the watcher reports absolute paths, the cache uses paths relative to the script folder
+    auto it = std::find_if(m_scriptCache.begin(), m_scriptCache.end(), [&filepath](const LuaScript& script)
+    {
+        fs_error_code ec;
+        return fs::equivalent(script.filepath, filepath, ec);
+    });
+
+    // new and deleted scripts change the load order, extensions are loaded before every other script
+    fs_error_code ec;
+    if (it == m_scriptCache.end() || it->fileext == ".ext" || !fs::is_regular_file(filepath, ec))
+    {
+        m_cacheState = SCRIPT_CACHE_READY;
+        ReloadElunaForMap(RELOAD_ALL_STATES);
+        return;
+    }
+
+    LuaScript script;
+    ScriptFile file = { it->filename + it->fileext, size_t(fs::file_size(it->filepath, ec)), it->filepath, it->mapId };
+
+    ElunaAllocator allocator;
+    lua_State* L = allocator.NewState();
+    luaL_openlibs(L);
+
+    m_bytecodeCache = std::make_unique<ElunaBytecodeCache>(ExpandHomePath(sElunaConfig->GetConfig(CONFIG_ELUNA_BYTECODE_CACHE_PATH)));
+    bool compiled = ProcessScript(L, file, script);
+    m_bytecodeCache.reset();
+
+    lua_close(L);
+
+    // states keep running the old bytecode if the new one does not compile.
+    // map threads may be loading the old bytecode right now, it is swapped and not modified so they keep their copy
+    if (compiled)
+    {
+        std::atomic_store(&it->bytecode, std::move(script.bytecode));
+
+        std::lock_guard<std::mutex> guard(m_changedScriptsLock);
+        m_changedScripts.push_back({ ++m_scriptGeneration, it->filename, it->filepath });
+        ELUNA_LOG_INFO("[Eluna]: Recompiled `%s` in %u ms", it->filepath.c_str(), ElunaUtil::GetTimeDiff(oldMSTime));
+    }
+
+    m_cacheState = SCRIPT_CACHE_READY;
+}
+
+std::vector<std::pair<std::string, std::string>> ElunaLoader::GetChangedScripts(uint32& generation)
+{
+    std::vector<std::pair<std::string, std::string>> changed;
+
+    std::lock_guard<std::mutex> guard(m_changedScriptsLock);
+    for (const ChangedScript& script : m_changedScripts)
+    {
+        if (script.generation <= generation)
+            continue;
+
+        // a script saved several times is reloaded once
+        std::pair<std::string, std::string> entry(script.filename, script.filepath);
+        if (std::find(changed.begin(), changed.end(), entry) == changed.end())
+            changed.push_back(std::move(entry));
+    }
+
+    auto it = m_stateGenerations.find(generation);
+    if (it != m_stateGenerations.end() && !--it->second)
+        m_stateGenerations.erase(it);
+
+    generation = m_scriptGeneration;
+    ++m_stateGenerations[generation];
+    PruneChangedScripts();
+    return changed;
+}
+
+void ElunaLoader::EnterScriptGeneration(uint32& generation)
+{
+    std::lock_guard<std::mutex> guard(m_changedScriptsLock);
+    generation = m_scriptGeneration;
+    ++m_stateGenerations[generation];
+    PruneChangedScripts();
+}
+
+void ElunaLoader::LeaveScriptGeneration(uint32 generation)
+{
+    std::lock_guard<std::mutex> guard(m_changedScriptsLock);
+    auto it = m_stateGenerations.find(generation);
+    if (it != m_stateGenerations.end() && !--it->second)
+        m_stateGenerations.erase(it);
+    PruneChangedScripts();
+}
+
+void ElunaLoader::PruneChangedScripts()
+{
+    // without states every change is applied, new states run the current cache
+    uint32 oldest = m_stateGenerations.empty() ? uint32(m_scriptGeneration) : m_stateGenerations.begin()->first;
+    m_changedScripts.erase(std::remove_if(m_changedScripts.begin(), m_changedScripts.end(), [oldest](const ChangedScript& script)
+    {
+        return script.generation <= oldest;
+    }), m_changedScripts.end());
+}
+
+void ElunaLoader::QueueStateReload(bool priority)
+{
+    std::lock_guard<std::mutex> guard(m_stateReloadLock);
+    if (!m_pendingReloads)
+        m_lastPendingReport = ElunaUtil::GetCurrTime();
+
+    ++m_pendingReloads;
+    if (priority)
+        ++m_pendingPriorityReloads;
+}
+
+void ElunaLoader::CancelStateReload(bool priority)
+{
+    std::lock_guard<std::mutex> guard(m_stateReloadLock);
+    --m_pendingReloads;
+    if (priority)
+        --m_pendingPriorityReloads;
+}
+
+bool ElunaLoader::AcquireStateReload(bool priority)
+{
+    uint32 budget = sElunaConfig->GetReloadBudget();
+    if (!budget)
+        return true;
+
+    std::lock_guard<std::mutex> guard(m_stateReloadLock);
+    CheckReloadTick();
+
+    if (m_reloadInProgress)
+        return false;
+
+    if (!priority && m_pendingPriorityReloads)
+        return false;
+
+    // the first reload of a tick always runs, so a single slow state can not stall the rest forever
+    if (m_reloadsThisTick && m_reloadTickSpent >= budget)
+        return false;
+
+    m_reloadInProgress = true;
+    ++m_reloadsThisTick;
+    return true;
+}
+
+void ElunaLoader::ReleaseStateReload(bool priority, uint32 elapsed)
+{
+    std::lock_guard<std::mutex> guard(m_stateReloadLock);
+    m_reloadInProgress = false;
+    m_reloadTickSpent += elapsed;
+
+    --m_pendingReloads;
+    if (priority)
+        --m_pendingPriorityReloads;
+
+    if (!m_pendingReloads)
+        ELUNA_LOG_INFO("[Eluna]: All Lua states reloaded");
+}
+
+bool ElunaLoader::AcquirePoolRefill()
+{
+    uint32 budget = sElunaConfig->GetReloadBudget();
+
+    std::lock_guard<std::mutex> guard(m_stateReloadLock);
+    CheckReloadTick();
+
+    // states waiting to reload go first
+    if (m_reloadInProgress || m_pendingReloads)
+        return false;
+
+    // unlike state reloads, a refill never goes over the budget
+    if (budget ? m_reloadTickSpent >= budget : m_reloadsThisTick > 0)
+        return false;
+
+    m_reloadInProgress = true;
+    ++m_reloadsThisTick;
+    return true;
+}
+
+void ElunaLoader::ReleasePoolRefill(uint32 elapsed)
+{
+    std::lock_guard<std::mutex> guard(m_stateReloadLock);
+    m_reloadInProgress = false;
+    m_reloadTickSpent += elapsed;
+}
+
+void ElunaLoader::CheckReloadTick()
+{
+    // without a world state nothing starts new ticks, fall back to a window of a second
+    if (ElunaUtil::GetTimeDiff(m_reloadTickStart) >= 1000)
+    {
+        m_reloadTickStart = ElunaUtil::GetCurrTime();
+        m_reloadTickSpent = 0;
+        m_reloadsThisTick = 0;
+    }
+}
+
+void ElunaLoader::OnWorldUpdate()
+{
+    std::lock_guard<std::mutex> guard(m_stateReloadLock);
+    m_reloadTickStart = ElunaUtil::GetCurrTime();
+    m_reloadTickSpent = 0;
+    m_reloadsThisTick = 0;
+
+    if (m_pendingReloads && ElunaUtil::GetTimeDiff(m_lastPendingReport) >= 5000)
+    {
+        ELUNA_LOG_INFO("[Eluna]: %u Lua states waiting to reload, %u of them for maps with players", m_pendingReloads, m_pendingPriorityReloads);
+        m_lastPendingReport = ElunaUtil::GetCurrTime();
+    }
+}
+
 void ElunaLoader::ReloadElunaForMap(int mapId)
 {
     // reload the script cache asynchronously
@@ -374,5 +668,7 @@ void ElunaLoader::ReloadElunaForMap(int mapId)
                         e->ReloadEluna();
             }
         );
+
+        sElunaMgr->ReloadPooledStates(mapId);
     }
 }
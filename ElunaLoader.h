@@ -9,6 +9,10 @@
 #define _ELUNALOADER_H
 
 #include "LuaEngine.h"
+#include "ElunaBytecodeCache.h"
+
+#include <map>
+#include <string_view>
 
 #if defined ELUNA_TRINITY
 #include <efsw/efsw.hpp>
@@ -52,9 +56,39 @@ public:
 
     void LoadScripts();
     void ReloadElunaForMap(int mapId);
+    // Recompiles a single changed script and lets every state reload just that script, see Eluna::ReloadScript.
+    // Falls back to reloading all states for new, deleted and extension files.
+    void ReloadScriptFile(const std::string& filepath);
 
     uint8 GetCacheState() const { return m_cacheState; }
     const std::vector<LuaScript>& GetLuaScripts() const { return m_scriptCache; }
+    // Returns the first script in load order with the given file name, nullptr if there is none
+    const LuaScript* GetLuaScript(std::string_view filename) const
+    {
+        auto it = m_scriptIndex.find(filename);
+        return it != m_scriptIndex.end() ? it->second : nullptr;
+    }
+    // Full state reloads are spread over world ticks, every tick may spend Eluna.ReloadBudget ms on them.
+    // States of maps with players go first, only one state reloads at a time.
+    void QueueStateReload(bool priority);
+    void CancelStateReload(bool priority);
+    bool AcquireStateReload(bool priority);
+    void ReleaseStateReload(bool priority, uint32 elapsed);
+    // Building pooled states is optional work, it only runs while no state waits to reload and only spends
+    // what is left of the tick's budget. Without a budget one pooled state is built per tick.
+    bool AcquirePoolRefill();
+    void ReleasePoolRefill(uint32 elapsed);
+    // Starts the budget of a new tick, called by the world state
+    void OnWorldUpdate();
+
+    // Incremented whenever ReloadScriptFile replaces the bytecode of a script
+    uint32 GetScriptGeneration() const { return m_scriptGeneration; }
+    // Returns the scripts replaced after `generation` and updates it to the current generation
+    std::vector<std::pair<std::string, std::string>> GetChangedScripts(uint32& generation);
+    // States report the generation they run, changes every state has applied are forgotten.
+    // Enter sets `generation` to the current one, a state leaves its generation before entering another.
+    void EnterScriptGeneration(uint32& generation);
+    void LeaveScriptGeneration(uint32 generation);
     const std::string& GetRequirePath() const { return m_requirePath; }
     const std::string& GetRequireCPath() const { return m_requirecPath; }
 
@@ -66,20 +100,63 @@ public:
 #endif
 
 private:
+    // A file found by ReadFiles, compiled by CompileScripts
+    struct ScriptFile
+    {
+        std::string filename;
+        size_t filesize;
+        std::string fullpath;
+        int32 mapId;
+    };
+
     void ReloadScriptCache();
-    void ReadFiles(lua_State* L, std::string path);
+    // Starts a new budget window when no world tick did for a second, m_stateReloadLock must be held
+    void CheckReloadTick();
+    // Scripts and the bytecode cache path may start with ~ for the home directory
+    static std::string ExpandHomePath(std::string path);
+    // Drops the changes every state has applied, m_changedScriptsLock must be held
+    void PruneChangedScripts();
+    void ReadFiles(std::string path);
+    void CompileScripts();
     void CombineLists();
-    void ProcessScript(lua_State* L, std::string filename, const size_t& filesize, const std::string& fullpath, int32 mapId);
-    bool CompileScript(lua_State* L, LuaScript& script);
+    bool ProcessScript(lua_State* L, const ScriptFile& file, LuaScript& script);
+    bool CompileScript(lua_State* L, LuaScript& script, size_t sizeHint);
     static int LoadBytecodeChunk(lua_State* L, uint8* bytes, size_t len, BytecodeBuffer* buffer);
 
     std::atomic<uint8> m_cacheState;
     std::vector<LuaScript> m_scriptCache;
+    // File name -> script, built with m_scriptCache and pointing into it
+    std::unordered_map<std::string_view, const LuaScript*> m_scriptIndex;
     std::string m_requirePath;
     std::string m_requirecPath;
     std::list<LuaScript> m_scripts;
     std::list<LuaScript> m_extensions;
+    std::vector<ScriptFile> m_scriptFiles;
+
+    struct ChangedScript
+    {
+        uint32 generation;
+        std::string filename;
+        std::string filepath;
+    };
+
+    std::mutex m_stateReloadLock;
+    uint32 m_pendingReloads;
+    uint32 m_pendingPriorityReloads;
+    bool m_reloadInProgress;
+    uint32 m_reloadTickStart;
+    uint32 m_reloadTickSpent;
+    uint32 m_reloadsThisTick;
+    uint32 m_lastPendingReport;
+
+    std::atomic<uint32> m_scriptGeneration;
+    std::mutex m_changedScriptsLock;
+    std::vector<ChangedScript> m_changedScripts;
+    // Generation -> number of states running it
+    std::map<uint32, uint32> m_stateGenerations;
     std::thread m_reloadThread;
+    // Only exists while LoadScripts runs
+    std::unique_ptr<ElunaBytecodeCache> m_bytecodeCache;
 };
 
 #if defined ELUNA_TRINITY
@@ -0,0 +1,148 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaMessageBus.h"
+#include "ElunaConfig.h"
+
+#include <algorithm>
+
+ElunaMailbox::ElunaMailbox(int32 mapId, uint32 instanceId, uint32 capacity) :
+    mapId(mapId),
+    instanceId(instanceId),
+    enqueuePos(0),
+    dequeuePos(0),
+    dropped(0),
+    delivered(0),
+    totalLatency(0),
+    maxLatency(0)
+{
+    // the position is masked into the cells, so the capacity is rounded up to a power of two
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+
+    cells.reset(new Cell[size]);
+    mask = size - 1;
+    for (size_t i = 0; i < size; ++i)
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+bool ElunaMailbox::Push(const ElunaMessage& message)
+{
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Cell& cell = cells[pos & mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+
+        if (diff == 0)
+        {
+            // the cell is free, claim it
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell.message = message;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            // the consumer has not popped this cell yet, the queue is full
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else
+            pos = enqueuePos.load(std::memory_order_relaxed);
+    }
+}
+
+bool ElunaMailbox::Pop(ElunaMessage& message)
+{
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    Cell& cell = cells[pos & mask];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+
+    // claimed but not written yet, or empty
+    if (intptr_t(sequence) - intptr_t(pos + 1) < 0)
+        return false;
+
+    message = std::move(cell.message);
+    dequeuePos.store(pos + 1, std::memory_order_relaxed);
+    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+}
+
+uint32 ElunaMailbox::GetDepth() const
+{
+    size_t enqueued = enqueuePos.load(std::memory_order_relaxed);
+    size_t dequeued = dequeuePos.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? uint32(enqueued - dequeued) : 0;
+}
+
+void ElunaMailbox::OnDelivered(const ElunaMessage& message)
+{
+    uint64 latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - message.sent).count();
+    ++delivered;
+    totalLatency += latency;
+    maxLatency = std::max(maxLatency, latency);
+}
+
+ElunaMessageBus* ElunaMessageBus::instance()
+{
+    static ElunaMessageBus instance;
+    return &instance;
+}
+
+std::shared_ptr<ElunaMailbox> ElunaMessageBus::Subscribe(int32 mapId, uint32 instanceId)
+{
+    uint32 capacity = sElunaConfig->GetMessageQueueSize();
+    if (!capacity)
+        return nullptr;
+
+    auto mailbox = std::make_shared<ElunaMailbox>(mapId, instanceId, capacity);
+    std::lock_guard<std::mutex> guard(lock);
+    mailboxes[mapId].push_back(mailbox);
+    return mailbox;
+}
+
+void ElunaMessageBus::Unsubscribe(const std::shared_ptr<ElunaMailbox>& mailbox)
+{
+    if (!mailbox)
+        return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = mailboxes.find(mailbox->GetMapId());
+    if (it == mailboxes.end())
+        return;
+
+    auto& list = it->second;
+    list.erase(std::remove(list.begin(), list.end(), mailbox), list.end());
+    if (list.empty())
+        mailboxes.erase(it);
+}
+
+uint32 ElunaMessageBus::Publish(int32 mapId, uint32 instanceId, const ElunaMessage& message)
+{
+    // copy the receivers so pushing does not hold up other publishers or (un)subscribing states
+    std::vector<std::shared_ptr<ElunaMailbox>> receivers;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = mailboxes.find(mapId);
+        if (it == mailboxes.end())
+            return 0;
+
+        for (auto& mailbox : it->second)
+            if (!instanceId || mailbox->GetInstanceId() == instanceId)
+                receivers.push_back(mailbox);
+    }
+
+    uint32 queued = 0;
+    for (auto& mailbox : receivers)
+        if (mailbox->Push(message))
+            ++queued;
+    return queued;
+}
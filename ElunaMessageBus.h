@@ -0,0 +1,119 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_MESSAGE_BUS_H
+#define _ELUNA_MESSAGE_BUS_H
+
+#include "ElunaUtility.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct ElunaMessage
+{
+    std::string topic;
+    std::string payload;    // Encoded with mar_encode
+    int32 sourceMapId;      // -1 for the world state
+    uint32 sourceInstanceId;
+    std::chrono::steady_clock::time_point sent;
+};
+
+/*
+ * Bounded queue of the messages sent to a single Lua state.
+ *
+ * Any thread can push, only the thread updating the state pops.
+ * Every cell has a sequence number telling whose turn it is to use it (Dmitry Vyukov's bounded queue),
+ * so producers only race on one atomic increment and nobody takes a lock.
+ */
+class ElunaMailbox
+{
+public:
+    ElunaMailbox(int32 mapId, uint32 instanceId, uint32 capacity);
+
+    ElunaMailbox(const ElunaMailbox&) = delete;
+    ElunaMailbox& operator=(const ElunaMailbox&) = delete;
+
+    int32 GetMapId() const { return mapId; }
+    uint32 GetInstanceId() const { return instanceId; }
+
+    // Returns false and drops the message when the queue is full
+    bool Push(const ElunaMessage& message);
+    // Consumer only
+    bool Pop(ElunaMessage& message);
+    uint32 GetDepth() const;
+
+    // Consumer only, records the time the message spent in the queue
+    void OnDelivered(const ElunaMessage& message);
+
+    uint64 GetDelivered() const { return delivered; }
+    uint64 GetDropped() const { return dropped; }
+    // Microseconds
+    uint64 GetAverageLatency() const { return delivered ? totalLatency / delivered : 0; }
+    uint64 GetMaxLatency() const { return maxLatency; }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        ElunaMessage message;
+    };
+
+    const int32 mapId;
+    const uint32 instanceId;
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    // Producers and the consumer write different ends, keep them off each other's cache line
+    alignas(64) std::atomic<size_t> enqueuePos;
+    alignas(64) std::atomic<size_t> dequeuePos;
+
+    std::atomic<uint64> dropped;
+    uint64 delivered;
+    uint64 totalLatency;
+    uint64 maxLatency;
+};
+
+/*
+ * Routes messages between Lua states, see PublishToMap and PublishToWorld.
+ *
+ * Every running state with a message handler has a mailbox here, keyed by its map ID. Messages are delivered
+ * by the receiving state on its own update, so handlers run on the thread that owns the state.
+ */
+class ElunaMessageBus
+{
+private:
+    ElunaMessageBus() = default;
+    ~ElunaMessageBus() = default;
+    ElunaMessageBus(ElunaMessageBus const&) = delete;
+    ElunaMessageBus& operator=(ElunaMessageBus const&) = delete;
+
+public:
+    static ElunaMessageBus* instance();
+
+    // Returns null when the bus is disabled
+    std::shared_ptr<ElunaMailbox> Subscribe(int32 mapId, uint32 instanceId);
+    // Messages still queued in the mailbox are dropped
+    void Unsubscribe(const std::shared_ptr<ElunaMailbox>& mailbox);
+
+    // Queues the message for the states of `mapId`, or only the one of `instanceId` if it is not 0.
+    // Returns the number of states the message was queued for. An unsubscribed mailbox may still get
+    // the message when it races with Unsubscribe, it is then dropped with the mailbox.
+    uint32 Publish(int32 mapId, uint32 instanceId, const ElunaMessage& message);
+
+private:
+    // Only guards the routing table, Publish pushes after releasing it and the mailboxes themselves are lock free
+    std::mutex lock;
+    std::unordered_map<int32, std::vector<std::shared_ptr<ElunaMailbox>>> mailboxes;
+};
+
+#define sElunaMessageBus ElunaMessageBus::instance()
+
+#endif
@@ -5,9 +5,12 @@
 */
 
 #include "ElunaMgr.h"
+#include "ElunaConfig.h"
+#include "ElunaLoader.h"
+#include "ElunaUtility.h"
 #include "LuaEngine.h"
 
-ElunaMgr::ElunaMgr()
+ElunaMgr::ElunaMgr() : _statePoolGeneration(0)
 {
 }
 
@@ -28,7 +31,163 @@ void ElunaMgr::Create(Map* map, ElunaInfo const& info)
     if (keyExists)
         return;
 
-    _elunaMap.emplace(info.key, std::make_unique<Eluna>(map));
+    if (!map || !map->Instanceable())
+    {
+        _elunaMap.emplace(info.key, std::make_unique<Eluna>(map));
+        return;
+    }
+
+    uint32 oldMSTime = ElunaUtil::GetCurrTime();
+    std::unique_ptr<Eluna> eluna = TakePooledState(map->GetId());
+    bool pooled = eluna != nullptr;
+
+    if (pooled)
+        eluna->BindMap(map);
+    else
+        eluna = std::make_unique<Eluna>(map);
+
+    _elunaMap.emplace(info.key, std::move(eluna));
+    ELUNA_LOG_DEBUG("[Eluna]: Created %s state for map: %u, instance: %u in %u ms", pooled ? "pooled" : "new", info.GetMapId(), info.GetInstanceId(), ElunaUtil::GetTimeDiff(oldMSTime));
+}
+
+std::unique_ptr<Eluna> ElunaMgr::TakePooledState(uint32 mapId)
+{
+    std::lock_guard<std::mutex> guard(_statePoolLock);
+    if (!sElunaConfig->GetStatePoolSize())
+        return nullptr;
+
+    // the map is warmed from now on, even when this instance has to build its own state
+    StatePool& pool = _statePools[mapId];
+    if (pool.ready.empty())
+        return nullptr;
+
+    std::unique_ptr<Eluna> eluna = std::move(pool.ready.back());
+    pool.ready.pop_back();
+    return eluna;
+}
+
+bool ElunaMgr::RecyclePooledState(uint32 mapId, std::unique_ptr<Eluna>& eluna)
+{
+    if (!HasPoolRoom(mapId))
+        return false;
+
+    // runs the close hooks of the scripts, which must not hold up the other threads using the pools
+    eluna->UnbindMap();
+
+    std::lock_guard<std::mutex> guard(_statePoolLock);
+    // the pool may have filled up or been cleared meanwhile, UpdateStatePools drops what does not fit
+    auto it = _statePools.find(mapId);
+    if (it == _statePools.end())
+        return false;
+
+    it->second.recycled.push_back(std::move(eluna));
+    return true;
+}
+
+bool ElunaMgr::HasPoolRoom(uint32 mapId)
+{
+    std::lock_guard<std::mutex> guard(_statePoolLock);
+    auto it = _statePools.find(mapId);
+    return it != _statePools.end() && it->second.ready.size() + it->second.recycled.size() < sElunaConfig->GetStatePoolSize();
+}
+
+void ElunaMgr::UpdateStatePools()
+{
+    uint32 poolSize = sElunaConfig->GetStatePoolSize();
+    // states dropped from the pools are closed after the lock is released
+    std::vector<std::unique_ptr<Eluna>> dropped;
+    {
+        std::lock_guard<std::mutex> guard(_statePoolLock);
+        for (auto& [id, pool] : _statePools)
+        {
+            while (pool.ready.size() + pool.recycled.size() > poolSize)
+            {
+                std::vector<std::unique_ptr<Eluna>>& states = !pool.recycled.empty() ? pool.recycled : pool.ready;
+                dropped.push_back(std::move(states.back()));
+                states.pop_back();
+            }
+        }
+
+        if (!poolSize)
+            _statePools.clear();
+    }
+    dropped.clear();
+
+    if (!poolSize || sElunaLoader->GetCacheState() != SCRIPT_CACHE_READY || !sElunaLoader->AcquirePoolRefill())
+        return;
+
+    std::unique_ptr<Eluna> eluna;
+    bool create = false;
+    uint32 mapId = 0;
+    uint32 generation = 0;
+    {
+        std::lock_guard<std::mutex> guard(_statePoolLock);
+        for (auto& [id, pool] : _statePools)
+        {
+            // rebuild closed states before creating new ones
+            if (!pool.recycled.empty())
+            {
+                eluna = std::move(pool.recycled.back());
+                pool.recycled.pop_back();
+                mapId = id;
+                break;
+            }
+
+            if (pool.ready.size() < poolSize)
+            {
+                create = true;
+                mapId = id;
+                break;
+            }
+        }
+
+        generation = _statePoolGeneration;
+    }
+
+    if (!eluna && !create)
+    {
+        sElunaLoader->ReleasePoolRefill(0);
+        return;
+    }
+
+    // running the scripts is the expensive part, it happens outside the lock so instances can be created meanwhile.
+    // a new state runs the scripts in its constructor, only recycled states have to be rebuilt
+    uint32 oldMSTime = ElunaUtil::GetCurrTime();
+    if (eluna)
+        eluna->RebuildPooledState();
+    else
+        eluna = std::make_unique<Eluna>(nullptr, int32(mapId));
+    // loading the scripts leaves garbage behind that a stopped collector would keep until the state is bound
+    eluna->CollectGarbage();
+    uint32 elapsed = ElunaUtil::GetTimeDiff(oldMSTime);
+    sElunaLoader->ReleasePoolRefill(elapsed);
+    ELUNA_LOG_DEBUG("[Eluna]: Built pooled state for map: %u in %u ms", mapId, elapsed);
+
+    std::lock_guard<std::mutex> guard(_statePoolLock);
+    auto it = _statePools.find(mapId);
+    if (it == _statePools.end())
+        return;
+
+    if (generation != _statePoolGeneration)
+        it->second.recycled.push_back(std::move(eluna));
+    else
+        it->second.ready.push_back(std::move(eluna));
+}
+
+void ElunaMgr::ReloadPooledStates(int mapId)
+{
+    std::lock_guard<std::mutex> guard(_statePoolLock);
+    ++_statePoolGeneration;
+
+    for (auto& [id, pool] : _statePools)
+    {
+        if (mapId != RELOAD_ALL_STATES && mapId != static_cast<int>(id))
+            continue;
+
+        for (std::unique_ptr<Eluna>& eluna : pool.ready)
+            pool.recycled.push_back(std::move(eluna));
+        pool.ready.clear();
+    }
 }
 
 Eluna* ElunaMgr::Get(ElunaInfoKey key) const
@@ -47,7 +206,15 @@ Eluna* ElunaMgr::Get(ElunaInfo const& info) const
 
 void ElunaMgr::Destroy(ElunaInfoKey key)
 {
-    _elunaMap.erase(key);
+    auto it = _elunaMap.find(key);
+    if (it == _elunaMap.end())
+        return;
+
+    // keep the state of a finished instance around to be rebuilt for the next one
+    if (!key.IsGlobal() && it->second->GetBoundMap() && it->second->GetBoundMap()->Instanceable())
+        RecyclePooledState(key.GetMapId(), it->second);
+
+    _elunaMap.erase(it);
 }
 
 void ElunaMgr::Destroy(ElunaInfo const& info)
@@ -11,7 +11,9 @@
 
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 class Eluna;
 class Map;
@@ -102,8 +104,32 @@ public:
     void Destroy(ElunaInfoKey key);
     void Destroy(ElunaInfo const& info);
 
+    // Builds at most one pooled state, called once per world tick. Only runs with reload budget to spare,
+    // see ElunaLoader::AcquirePoolRefill
+    void UpdateStatePools();
+    // Pooled states of `mapId` were built from a stale script cache, RELOAD_ALL_STATES marks all of them
+    void ReloadPooledStates(int mapId);
+
 private:
+    // Pre-built states of an instanced map, handed out when an instance of it is created
+    struct StatePool
+    {
+        std::vector<std::unique_ptr<Eluna>> ready;
+        // Closed states waiting to be rebuilt, their allocations are reused
+        std::vector<std::unique_ptr<Eluna>> recycled;
+    };
+
+    std::unique_ptr<Eluna> TakePooledState(uint32 mapId);
+    bool RecyclePooledState(uint32 mapId, std::unique_ptr<Eluna>& eluna);
+    bool HasPoolRoom(uint32 mapId);
+
     std::unordered_map<ElunaInfoKey, std::unique_ptr<Eluna>> _elunaMap;
+
+    // Map ID -> pool, maps are added when their first instance is created
+    std::unordered_map<uint32, StatePool> _statePools;
+    // Bumped on reloads, states built against an older cache go back to recycled
+    uint32 _statePoolGeneration;
+    std::mutex _statePoolLock;
 };
 
 #define sElunaMgr ElunaMgr::instance()
@@ -0,0 +1,134 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaProfiler.h"
+#include "ElunaAllocator.h"
+
+#include <algorithm>
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+// Same order as Hooks::RegisterTypes, followed by timed events
+static const char* const profilerRegTypeNames[] =
+{
+    "packet",
+    "server",
+    "player",
+    "guild",
+    "group",
+    "creature",
+    "creature_unique",
+    "vehicle",
+    "creature_gossip",
+    "gameobject",
+    "gameobject_gossip",
+    "spell",
+    "item",
+    "item_gossip",
+    "player_gossip",
+    "bg",
+    "map",
+    "instance",
+    "timed_event"
+};
+static_assert(CountOf(profilerRegTypeNames) == ElunaProfiler::REGTYPE_TIMED_EVENT + 1, "profilerRegTypeNames does not match Hooks::RegisterTypes");
+
+size_t ElunaProfiler::KeyHash::operator()(const Key& key) const
+{
+    size_t hash = std::hash<std::string>()(key.source);
+    hash ^= std::hash<uint64>()((uint64(key.regType) << 32) | key.eventId) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    hash ^= std::hash<uint64>()(key.entry) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+void ElunaProfiler::OnStateOpened(bool enable)
+{
+    ASSERT(contexts.empty());
+    enabled = enable;
+    stats.clear();
+}
+
+void ElunaProfiler::Reset()
+{
+    stats.clear();
+}
+
+int64 ElunaProfiler::GetMemoryUsage(lua_State* L)
+{
+    if (ElunaAllocator* allocator = ElunaAllocator::GetAllocator(L))
+        return int64(allocator->GetTotalAllocated());
+
+    return int64(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+ElunaProfiler::Sample ElunaProfiler::Begin(lua_State* L, int functionIndex, const Context& context)
+{
+    lua_Debug ar;
+    lua_pushvalue(L, functionIndex);
+    lua_getinfo(L, ">S", &ar);
+
+    Sample sample;
+    sample.source = std::string(ar.short_src) + ":" + std::to_string(ar.linedefined);
+    sample.context = context;
+    sample.memory = GetMemoryUsage(L);
+    sample.start = std::chrono::steady_clock::now();
+    return sample;
+}
+
+void ElunaProfiler::End(lua_State* L, const Sample& sample)
+{
+    uint64 elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sample.start).count();
+
+    Stats& entry = stats[{ sample.source, sample.context.regType, sample.context.eventId, sample.context.entry }];
+    ++entry.calls;
+    entry.totalTime += elapsed;
+    entry.maxTime = std::max(entry.maxTime, elapsed);
+    entry.memory += GetMemoryUsage(L) - sample.memory;
+}
+
+std::string ElunaProfiler::GetHookName(const Context& context)
+{
+    std::string name = profilerRegTypeNames[context.regType];
+    if (context.regType != REGTYPE_TIMED_EVENT)
+        name += ":" + std::to_string(context.eventId);
+    if (context.entry)
+        name += ":" + std::to_string(context.entry);
+    return name;
+}
+
+std::vector<ElunaProfileEntry> ElunaProfiler::GetReport() const
+{
+    std::vector<ElunaProfileEntry> report;
+    report.reserve(stats.size());
+
+    for (auto& [key, entry] : stats)
+        report.push_back({ GetHookName({ key.regType, key.eventId, key.entry }), key.source, entry.calls, entry.totalTime, entry.maxTime, entry.memory });
+
+    std::sort(report.begin(), report.end(), [](const ElunaProfileEntry& a, const ElunaProfileEntry& b)
+    {
+        return a.totalTime > b.totalTime;
+    });
+    return report;
+}
+
+void ElunaProfiler::PrintReport(uint32 limit) const
+{
+    std::vector<ElunaProfileEntry> report = GetReport();
+    if (limit && report.size() > limit)
+        report.resize(limit);
+
+    ELUNA_LOG_INFO("[Eluna]: Profile of %u handlers (total us, calls, avg us, max us, memory bytes, hook, source)", uint32(stats.size()));
+    for (const ElunaProfileEntry& entry : report)
+    {
+        ELUNA_LOG_INFO("[Eluna]: %12llu %8llu %10llu %10llu %10lld  %s  %s",
+            (unsigned long long)entry.totalTime, (unsigned long long)entry.calls, (unsigned long long)(entry.totalTime / entry.calls),
+            (unsigned long long)entry.maxTime, (long long)entry.memory, entry.hook.c_str(), entry.source.c_str());
+    }
+}
@@ -0,0 +1,119 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_PROFILER_H
+#define _ELUNA_PROFILER_H
+
+#include "ElunaUtility.h"
+#include "Hooks.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct lua_State;
+
+struct ElunaProfileEntry
+{
+    std::string hook;   // Register type, event ID and entry the handler was called for
+    std::string source; // Chunk name and line the handler function is defined at
+    uint64 calls;
+    uint64 totalTime;   // Microseconds, includes time spent in nested hooks
+    uint64 maxTime;     // Microseconds
+    int64 memory;       // Bytes allocated, see GetMemoryUsage
+};
+
+/*
+ * Accumulates the time spent in the Lua handlers of a single Lua state.
+ *
+ * Handlers are keyed by the hook they were called for and by where the function is defined,
+ * so a function bound to several hooks shows up once for every hook. Function addresses are not
+ * used as keys, another function may take the address of one that was collected.
+ * Hooks only call into the profiler when it is enabled, which is decided when the state is opened.
+ */
+class ElunaProfiler
+{
+public:
+    // Register type used for timed events, they are not bound to any hook
+    static constexpr uint8 REGTYPE_TIMED_EVENT = Hooks::REGTYPE_COUNT;
+
+    struct Context
+    {
+        uint8 regType;
+        uint32 eventId;
+        uint64 entry;
+    };
+
+    struct Sample
+    {
+        std::string source;
+        Context context;
+        std::chrono::steady_clock::time_point start;
+        int64 memory;
+    };
+
+    ElunaProfiler() : enabled(false) { }
+
+    bool IsEnabled() const { return enabled; }
+    // Forgets everything collected for the previous state, must not be called while a hook is running
+    void OnStateOpened(bool enable);
+    // Clears the collected timings
+    void Reset();
+
+    // Hooks push the key of the bindings they are about to call, see SetupStack and CleanUpStack
+    void PushContext(uint8 regType, uint32 eventId, uint64 entry) { contexts.push_back({ regType, eventId, entry }); }
+    void PopContext() { contexts.pop_back(); }
+    const Context& GetContext() const { return contexts.back(); }
+    bool HasContext() const { return !contexts.empty(); }
+
+    // "regtype:event:entry" as shown in reports
+    static std::string GetHookName(const Context& context);
+
+    // `functionIndex` is the stack index of the handler that is about to be called
+    Sample Begin(lua_State* L, int functionIndex, const Context& context);
+    void End(lua_State* L, const Sample& sample);
+
+    // Handlers sorted by total time spent, slowest first
+    std::vector<ElunaProfileEntry> GetReport() const;
+    // Logs the `limit` slowest handlers, 0 logs all of them
+    void PrintReport(uint32 limit) const;
+
+private:
+    struct Key
+    {
+        std::string source;
+        uint8 regType;
+        uint32 eventId;
+        uint64 entry;
+
+        bool operator==(const Key& other) const
+        {
+            return regType == other.regType && eventId == other.eventId && entry == other.entry && source == other.source;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const;
+    };
+
+    struct Stats
+    {
+        uint64 calls = 0;
+        uint64 totalTime = 0;
+        uint64 maxTime = 0;
+        int64 memory = 0;
+    };
+
+    // Total bytes allocated by the state's ElunaAllocator, falls back to the heap size for other allocators
+    static int64 GetMemoryUsage(lua_State* L);
+
+    bool enabled;
+    std::vector<Context> contexts;
+    std::unordered_map<Key, Stats, KeyHash> stats;
+};
+
+#endif
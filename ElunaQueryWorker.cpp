@@ -0,0 +1,220 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaQueryWorker.h"
+#include "ElunaConfig.h"
+
+#include <algorithm>
+#include <utility>
+
+bool ElunaAsyncQueries::Complete(ElunaAsyncQueryResult&& result)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    // checked under the lock, so nothing is added after Cancel cleared the results
+    if (IsCancelled())
+        return false;
+
+    completed.push_back(std::move(result));
+    hasCompleted.store(true, std::memory_order_release);
+    return true;
+}
+
+void ElunaAsyncQueries::Cancel()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    cancelled.store(true, std::memory_order_release);
+    completed.clear();
+    hasCompleted.store(false, std::memory_order_release);
+}
+
+std::vector<ElunaAsyncQueryResult> ElunaAsyncQueries::TakeCompleted()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    hasCompleted.store(false, std::memory_order_release);
+    return std::exchange(completed, {});
+}
+
+ElunaQueryWorker::ElunaQueryWorker() :
+    stopping(false),
+    queued(0),
+    rejected(0),
+    completed(0),
+    cancelled(0),
+    maxDepth(0),
+    totalWait(0),
+    totalRun(0)
+{
+}
+
+ElunaQueryWorker::~ElunaQueryWorker()
+{
+    // normally done on world shutdown already, the threads must not outlive the core's databases
+    Shutdown();
+}
+
+void ElunaQueryWorker::Shutdown()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        // queries still queued are dropped, nobody is going to handle their results
+        cancelled += jobs.size();
+        jobs.clear();
+    }
+    wake.notify_all();
+    wakeWriter.notify_all();
+
+    for (std::thread& thread : threads)
+        thread.join();
+    threads.clear();
+    if (writer.joinable())
+        writer.join();
+}
+
+ElunaQueryWorker* ElunaQueryWorker::instance()
+{
+    static ElunaQueryWorker instance;
+    return &instance;
+}
+
+bool ElunaQueryWorker::Enqueue(const std::shared_ptr<ElunaAsyncQueries>& owner, ElunaDatabase database, std::string sql, int funcRef, ElunaStatement statement)
+{
+    uint32 capacity = sElunaConfig->GetAsyncQueryQueueSize();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopping || jobs.size() >= capacity)
+        {
+            ++rejected;
+            return false;
+        }
+
+        if (threads.empty())
+        {
+            uint32 threadCount = std::max(1u, sElunaConfig->GetAsyncQueryThreads());
+            for (uint32 i = 0; i < threadCount; ++i)
+                threads.emplace_back(&ElunaQueryWorker::Run, this);
+        }
+
+        jobs.push_back({ owner, database, std::move(sql), funcRef, std::move(statement), std::chrono::steady_clock::now() });
+        ++queued;
+        maxDepth = std::max(maxDepth, uint32(jobs.size()));
+    }
+    wake.notify_one();
+    return true;
+}
+
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+bool ElunaQueryWorker::EnqueueTransaction(const std::shared_ptr<ElunaAsyncQueries>& owner, ElunaDatabase database, std::vector<std::string>&& statements, int funcRef, bool retryStatements)
+{
+    uint32 capacity = sElunaConfig->GetAsyncQueryQueueSize();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopping || transactions.size() >= capacity)
+            return false;
+
+        if (!writer.joinable())
+            writer = std::thread(&ElunaQueryWorker::RunWriter, this);
+
+        transactions.push_back({ owner, database, std::move(statements), funcRef, retryStatements, std::chrono::steady_clock::now() });
+    }
+    wakeWriter.notify_one();
+    return true;
+}
+#endif
+
+ElunaQueryWorkerStats ElunaQueryWorker::GetStats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    ElunaQueryWorkerStats stats;
+    stats.queued = queued;
+    stats.rejected = rejected;
+    stats.completed = completed;
+    stats.cancelled = cancelled;
+    stats.depth = uint32(jobs.size());
+    stats.maxDepth = maxDepth;
+    stats.averageWait = completed ? totalWait / completed : 0;
+    stats.averageRun = completed ? totalRun / completed : 0;
+    return stats;
+}
+
+void ElunaQueryWorker::Run()
+{
+    ElunaDB::ThreadStart();
+
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;)
+    {
+        wake.wait(guard, [this]() { return stopping || !jobs.empty(); });
+        if (stopping)
+            break;
+
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+
+        // the state reloaded or closed while the query was queued, don't bother running it
+        if (job.owner->IsCancelled())
+        {
+            ++cancelled;
+            continue;
+        }
+
+        guard.unlock();
+        auto start = std::chrono::steady_clock::now();
+        ElunaQuery result = ElunaDB::Query(job.database, job.sql);
+        auto end = std::chrono::steady_clock::now();
+        bool delivered = job.owner->Complete({ job.funcRef, std::move(result), std::move(job.statement), job.queued, false, false });
+        guard.lock();
+
+        if (!delivered)
+        {
+            ++cancelled;
+            continue;
+        }
+
+        ++completed;
+        totalWait += std::chrono::duration_cast<std::chrono::microseconds>(start - job.queued).count();
+        totalRun += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    }
+    guard.unlock();
+
+    ElunaDB::ThreadEnd();
+}
+
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+void ElunaQueryWorker::RunWriter()
+{
+    ElunaDB::ThreadStart();
+
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;)
+    {
+        wakeWriter.wait(guard, [this]() { return stopping || !transactions.empty(); });
+        // the queued writes are still committed when stopping
+        if (transactions.empty())
+            break;
+
+        TransactionJob job = std::move(transactions.front());
+        transactions.pop_front();
+        guard.unlock();
+
+        bool committed = ElunaDB::DirectCommitTransaction(job.database, job.statements);
+        if (!committed && job.retryStatements)
+        {
+            ELUNA_LOG_ERROR("[Eluna]: Transaction of %u statements was rolled back, executing them one by one", uint32(job.statements.size()));
+            for (auto& sql : job.statements)
+                ElunaDB::DirectExecute(job.database, sql);
+        }
+
+        // the callback is dropped if its state reloaded or closed meanwhile, the writes are not
+        if (job.owner)
+            job.owner->Complete({ job.funcRef, ElunaQuery(), nullptr, job.queued, true, committed });
+        guard.lock();
+    }
+    guard.unlock();
+
+    ElunaDB::ThreadEnd();
+}
+#endif
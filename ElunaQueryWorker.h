@@ -0,0 +1,154 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_QUERY_WORKER_H
+#define _ELUNA_QUERY_WORKER_H
+
+#include "ElunaStatement.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ElunaAsyncQueryResult
+{
+    int funcRef;
+    ElunaQuery result;
+    ElunaStatement statement;   // Null for raw SQL
+    std::chrono::steady_clock::time_point queued;
+    bool transaction;           // The callback of a commit, it gets `committed` instead of `result`
+    bool committed;
+};
+
+/*
+ * Async queries of a single Lua state, shared with the workers running them.
+ *
+ * Workers add finished queries, the state takes them on its update. Cancelling drops the finished
+ * queries and makes the workers skip the queued ones, the state starts over with a new instance.
+ */
+class ElunaAsyncQueries
+{
+public:
+    ElunaAsyncQueries() : cancelled(false), hasCompleted(false) { }
+
+    bool IsCancelled() const { return cancelled.load(std::memory_order_acquire); }
+    // Returns false and drops the result if the queries were cancelled
+    bool Complete(ElunaAsyncQueryResult&& result);
+
+    // Owner only
+    void Cancel();
+    bool HasCompleted() const { return hasCompleted.load(std::memory_order_acquire); }
+    std::vector<ElunaAsyncQueryResult> TakeCompleted();
+
+private:
+    std::atomic<bool> cancelled;
+    std::atomic<bool> hasCompleted;
+    std::mutex lock;
+    std::vector<ElunaAsyncQueryResult> completed;
+};
+
+struct ElunaQueryWorkerStats
+{
+    uint64 queued;
+    uint64 rejected;        // Queue was full
+    uint64 completed;
+    uint64 cancelled;       // Skipped or dropped because their state reloaded or closed
+    uint32 depth;
+    uint32 maxDepth;
+    uint64 averageWait;     // Microseconds in the queue
+    uint64 averageRun;      // Microseconds running the query
+};
+
+/*
+ * Runs the blocking queries of WorldDBQueryAsync and the like on a few threads of its own,
+ * for cores without async queries of their own.
+ *
+ * The queue is bounded by Eluna.AsyncQueryQueueSize, queries are rejected when it is full
+ * so a slow database does not buffer without limit. Threads are started on first use and stopped by Shutdown.
+ */
+class ElunaQueryWorker
+{
+private:
+    ElunaQueryWorker();
+    ~ElunaQueryWorker();
+    ElunaQueryWorker(ElunaQueryWorker const&) = delete;
+    ElunaQueryWorker& operator=(ElunaQueryWorker const&) = delete;
+
+public:
+    static ElunaQueryWorker* instance();
+
+    // Returns false if the queue is full or disabled, the caller still owns `funcRef` then
+    bool Enqueue(const std::shared_ptr<ElunaAsyncQueries>& owner, ElunaDatabase database, std::string sql, int funcRef, ElunaStatement statement = nullptr);
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+    // Commits the statements on a writer thread of their own, one transaction after the other in the order they were queued.
+    // `owner` gets the outcome for `funcRef`, it is null when nobody waits for it. With `retryStatements` the statements
+    // of a rolled back transaction are executed again one by one, so a single bad statement does not lose the others.
+    // Returns false if the queue is full or disabled, the caller still owns `funcRef` and `statements` then
+    bool EnqueueTransaction(const std::shared_ptr<ElunaAsyncQueries>& owner, ElunaDatabase database, std::vector<std::string>&& statements, int funcRef, bool retryStatements);
+#endif
+
+    ElunaQueryWorkerStats GetStats();
+
+    // Drops the queued queries, commits the queued transactions and joins the threads. Called on world shutdown,
+    // the threads use the core's databases and must be gone before those are closed. Nothing is queued afterwards
+    void Shutdown();
+
+private:
+    struct Job
+    {
+        std::shared_ptr<ElunaAsyncQueries> owner;
+        ElunaDatabase database;
+        std::string sql;
+        int funcRef;
+        ElunaStatement statement;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    struct TransactionJob
+    {
+        std::shared_ptr<ElunaAsyncQueries> owner;
+        ElunaDatabase database;
+        std::vector<std::string> statements;
+        int funcRef;
+        bool retryStatements;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    void Run();
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+    void RunWriter();
+#endif
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<Job> jobs;
+    std::vector<std::thread> threads;
+    bool stopping;
+
+    // Transactions are not cancelled with their state, the writer commits them all before it stops
+    std::condition_variable wakeWriter;
+    std::deque<TransactionJob> transactions;
+    std::thread writer;
+
+    // Guarded by lock
+    uint64 queued;
+    uint64 rejected;
+    uint64 completed;
+    uint64 cancelled;
+    uint32 maxDepth;
+    uint64 totalWait;
+    uint64 totalRun;
+};
+
+#define sElunaQueryWorker ElunaQueryWorker::instance()
+
+#endif
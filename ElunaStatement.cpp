@@ -0,0 +1,252 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaStatement.h"
+#include "ElunaIncludes.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+// Calls `f` with the connection pool of `database`, the pools are of different types on some cores
+template<typename F>
+static auto WithDatabase(ElunaDatabase database, F&& f)
+{
+    switch (database)
+    {
+        case ELUNA_DB_CHARACTER:
+            return f(CharacterDatabase);
+        case ELUNA_DB_AUTH:
+            return f(LoginDatabase);
+        default:
+            return f(WorldDatabase);
+    }
+}
+
+void ElunaDB::Escape(ElunaDatabase database, std::string& str)
+{
+    WithDatabase(database, [&str](auto& db)
+    {
+#if defined ELUNA_TRINITY || defined ELUNA_AZEROTHCORE
+        db.EscapeString(str);
+#else
+        db.escape_string(str);
+#endif
+    });
+}
+
+void ElunaDB::Execute(ElunaDatabase database, const std::string& sql)
+{
+    WithDatabase(database, [&sql](auto& db)
+    {
+        db.Execute(sql.c_str());
+    });
+}
+
+ElunaQuery ElunaDB::Query(ElunaDatabase database, const std::string& sql)
+{
+    return WithDatabase(database, [&sql](auto& db)
+    {
+#if defined ELUNA_TRINITY || defined ELUNA_AZEROTHCORE
+        return ElunaQuery(db.Query(sql.c_str()));
+#else
+        return ElunaQuery(db.QueryNamed(sql.c_str()));
+#endif
+    });
+}
+
+#if defined ELUNA_TRINITY || defined ELUNA_AZEROTHCORE
+QueryCallback ElunaDB::AsyncQuery(ElunaDatabase database, const std::string& sql)
+{
+    return WithDatabase(database, [&sql](auto& db)
+    {
+        return db.AsyncQuery(sql.c_str());
+    });
+}
+#endif
+
+void ElunaDB::ThreadStart()
+{
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+    WorldDatabase.ThreadStart();
+    CharacterDatabase.ThreadStart();
+    LoginDatabase.ThreadStart();
+#endif
+}
+
+void ElunaDB::ThreadEnd()
+{
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+    WorldDatabase.ThreadEnd();
+    CharacterDatabase.ThreadEnd();
+    LoginDatabase.ThreadEnd();
+#endif
+}
+
+void ElunaDB::CommitTransaction(ElunaDatabase database, const std::vector<std::string>& statements)
+{
+    WithDatabase(database, [&statements](auto& db)
+    {
+#if defined ELUNA_TRINITY || defined ELUNA_AZEROTHCORE
+        auto transaction = db.BeginTransaction();
+        for (auto& sql : statements)
+            transaction->Append(sql.c_str());
+        db.CommitTransaction(transaction);
+#else
+        // Executes of this thread go into the transaction until it is committed
+        db.BeginTransaction();
+        for (auto& sql : statements)
+            db.Execute(sql.c_str());
+        db.CommitTransaction();
+#endif
+    });
+}
+
+#if defined ELUNA_TRINITY
+TransactionCallback ElunaDB::AsyncCommitTransaction(ElunaDatabase database, const std::vector<std::string>& statements)
+{
+    return WithDatabase(database, [&statements](auto& db)
+    {
+        auto transaction = db.BeginTransaction();
+        for (auto& sql : statements)
+            transaction->Append(sql.c_str());
+        return db.AsyncCommitTransaction(transaction);
+    });
+}
+#endif
+
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+bool ElunaDB::DirectExecute(ElunaDatabase database, const std::string& sql)
+{
+    return WithDatabase(database, [&sql](auto& db)
+    {
+        return db.DirectExecute(sql.c_str());
+    });
+}
+
+bool ElunaDB::DirectCommitTransaction(ElunaDatabase database, const std::vector<std::string>& statements)
+{
+    return WithDatabase(database, [&statements](auto& db)
+    {
+        db.BeginTransaction();
+        for (auto& sql : statements)
+            db.Execute(sql.c_str());
+        return db.CommitTransactionDirect();
+    });
+}
+#endif
+
+ElunaPreparedStatement::ElunaPreparedStatement(ElunaDatabase database, const std::string& sql) :
+    database(database),
+    executions(0),
+    queries(0),
+    totalLatency(0),
+    maxLatency(0)
+{
+    // Split at every ? that is not inside a quoted string or identifier
+    std::string fragment;
+    char quote = 0;
+    for (size_t i = 0; i < sql.size(); ++i)
+    {
+        char c = sql[i];
+        if (quote)
+        {
+            fragment += c;
+            if (c == '\\' && i + 1 < sql.size())
+                fragment += sql[++i];
+            else if (c == quote)
+                quote = 0;
+        }
+        else if (c == '\'' || c == '"' || c == '`')
+        {
+            fragment += c;
+            quote = c;
+        }
+        else if (c == '?')
+        {
+            fragments.push_back(std::move(fragment));
+            fragment.clear();
+        }
+        else
+            fragment += c;
+    }
+    fragments.push_back(std::move(fragment));
+    parameters.resize(fragments.size() - 1);
+}
+
+void ElunaPreparedStatement::SetNull(uint32 index)
+{
+    parameters[index] = "NULL";
+}
+
+void ElunaPreparedStatement::SetBool(uint32 index, bool value)
+{
+    parameters[index] = value ? "1" : "0";
+}
+
+void ElunaPreparedStatement::SetInt(uint32 index, int64 value)
+{
+    parameters[index] = std::to_string(value);
+}
+
+void ElunaPreparedStatement::SetUInt(uint32 index, uint64 value)
+{
+    parameters[index] = std::to_string(value);
+}
+
+bool ElunaPreparedStatement::SetDouble(uint32 index, double value)
+{
+    if (!std::isfinite(value))
+        return false;
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.17g", value);
+    parameters[index] = buffer;
+    return true;
+}
+
+void ElunaPreparedStatement::SetString(uint32 index, std::string value)
+{
+    ElunaDB::Escape(database, value);
+    parameters[index] = "'" + value + "'";
+}
+
+void ElunaPreparedStatement::ClearParameters()
+{
+    for (auto& parameter : parameters)
+        parameter.clear();
+}
+
+bool ElunaPreparedStatement::Build(std::string& sql, uint32& unbound) const
+{
+    size_t size = 0;
+    for (auto& fragment : fragments)
+        size += fragment.size();
+    for (uint32 i = 0; i < parameters.size(); ++i)
+    {
+        if (parameters[i].empty())
+        {
+            unbound = i;
+            return false;
+        }
+        size += parameters[i].size();
+    }
+
+    sql.clear();
+    sql.reserve(size);
+    for (uint32 i = 0; i < parameters.size(); ++i)
+        sql.append(fragments[i]).append(parameters[i]);
+    sql.append(fragments.back());
+    return true;
+}
+
+void ElunaPreparedStatement::OnQueried(std::chrono::steady_clock::time_point start)
+{
+    uint64 latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    ++queries;
+    totalLatency += latency;
+    maxLatency = std::max(maxLatency, latency);
+}
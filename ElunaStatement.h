@@ -0,0 +1,138 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_STATEMENT_H
+#define _ELUNA_STATEMENT_H
+
+#include "ElunaUtility.h"
+#if defined ELUNA_TRINITY || defined ELUNA_AZEROTHCORE
+#include "QueryCallback.h"
+#endif
+#if defined ELUNA_TRINITY
+#include "AsyncCallbackProcessor.h"
+#include "Transaction.h"
+#endif
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum ElunaDatabase : uint8
+{
+    ELUNA_DB_WORLD,
+    ELUNA_DB_CHARACTER,
+    ELUNA_DB_AUTH
+};
+
+/*
+ * Runs SQL on the core's database connections, hiding the differences between the cores.
+ */
+namespace ElunaDB
+{
+    // Escapes `str` in place for use inside a quoted SQL string
+    void Escape(ElunaDatabase database, std::string& str);
+    void Execute(ElunaDatabase database, const std::string& sql);
+    // Blocks until the query has finished, null if no rows were found
+    ElunaQuery Query(ElunaDatabase database, const std::string& sql);
+#if defined ELUNA_TRINITY || defined ELUNA_AZEROTHCORE
+    QueryCallback AsyncQuery(ElunaDatabase database, const std::string& sql);
+#endif
+    // Sets up and tears down the database client for threads of Eluna's own that run queries
+    void ThreadStart();
+    void ThreadEnd();
+    // Sends all statements in one transaction, committed asynchronously by the core
+    void CommitTransaction(ElunaDatabase database, const std::vector<std::string>& statements);
+#if defined ELUNA_TRINITY
+    TransactionCallback AsyncCommitTransaction(ElunaDatabase database, const std::vector<std::string>& statements);
+#endif
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+    // Block until the database is done, return false if the SQL failed or the transaction was rolled back
+    bool DirectExecute(ElunaDatabase database, const std::string& sql);
+    bool DirectCommitTransaction(ElunaDatabase database, const std::vector<std::string>& statements);
+#endif
+}
+
+/*
+ * SQL statement with `?` placeholders, see WorldDBPrepare.
+ *
+ * The SQL is split at the placeholders once, when the statement is prepared. Parameters are rendered
+ * to SQL literals as they are bound, strings are escaped by the database they are sent to,
+ * so running the statement only joins the pieces. Bound values are kept between runs.
+ *
+ * The cores only prepare the statements they declare when connecting, so the SQL sent to
+ * the database is still plain text.
+ */
+class ElunaPreparedStatement
+{
+public:
+    ElunaPreparedStatement(ElunaDatabase database, const std::string& sql);
+
+    ElunaDatabase GetDatabase() const { return database; }
+    uint32 GetParameterCount() const { return uint32(parameters.size()); }
+
+    // `index` must be below GetParameterCount
+    void SetNull(uint32 index);
+    void SetBool(uint32 index, bool value);
+    void SetInt(uint32 index, int64 value);
+    void SetUInt(uint32 index, uint64 value);
+    // Returns false if the value is not finite
+    bool SetDouble(uint32 index, double value);
+    void SetString(uint32 index, std::string value);
+    void ClearParameters();
+
+    // Returns the SQL with the bound parameters, or false and the index of the first parameter that is not bound
+    bool Build(std::string& sql, uint32& unbound) const;
+
+    // Record a run of the statement, `start` is when the query was sent
+    void OnExecuted() { ++executions; }
+    void OnQueried(std::chrono::steady_clock::time_point start);
+
+    uint64 GetExecutions() const { return executions; }
+    uint64 GetQueries() const { return queries; }
+    // Microseconds from sending a query to its results
+    uint64 GetAverageLatency() const { return queries ? totalLatency / queries : 0; }
+    uint64 GetMaxLatency() const { return maxLatency; }
+
+private:
+    ElunaDatabase database;
+    // SQL between the placeholders, one more than there are parameters
+    std::vector<std::string> fragments;
+    // Rendered values, empty if not bound
+    std::vector<std::string> parameters;
+
+    uint64 executions;
+    uint64 queries;
+    uint64 totalLatency;
+    uint64 maxLatency;
+};
+
+typedef std::shared_ptr<ElunaPreparedStatement> ElunaStatement;
+
+/*
+ * Statements collected by a script to be committed together, see CharDBTransaction.
+ */
+class ElunaSQLTransaction
+{
+public:
+    explicit ElunaSQLTransaction(ElunaDatabase database) : database(database) { }
+
+    ElunaDatabase GetDatabase() const { return database; }
+    uint32 GetSize() const { return uint32(statements.size()); }
+
+    void Append(std::string sql) { statements.push_back(std::move(sql)); }
+    // Empties the transaction so it can be filled again
+    std::vector<std::string> Release() { return std::exchange(statements, {}); }
+
+private:
+    ElunaDatabase database;
+    std::vector<std::string> statements;
+};
+
+typedef std::shared_ptr<ElunaSQLTransaction> ElunaTransaction;
+
+#endif
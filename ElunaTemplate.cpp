@@ -10,6 +10,16 @@
 #include "ElunaTemplate.h"
 #include "ElunaUtility.h"
 
+#include <atomic>
+
+uint32 GetNextElunaTypeIndex()
+{
+    static std::atomic<uint32> nextTypeIndex(0);
+    return nextTypeIndex++;
+}
+
+std::atomic<bool> elunaMethodIndexesFrozen(false);
+
 #if defined TRACKABLE_PTR_NAMESPACE
 ElunaConstrainedObjectRef<Aura> GetWeakPtrFor(Aura const* obj)
 {
@@ -18,6 +18,14 @@ extern "C"
 #include "ElunaCompat.h"
 #include "ElunaConfig.h"
 #include "ElunaSpellWrapper.h"
+#include "ElunaStatement.h"
+
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #if !defined ELUNA_CMANGOS
 #include "SharedDefines.h"
 #else
@@ -29,10 +37,23 @@ extern "C"
 #include "UniqueTrackablePtr.h"
 #endif
 
+class Object;
+class WorldObject;
+
+// Base of T among the Eluna types, used for the ancestry masks of ElunaObject
+template<typename T> struct ElunaBaseClass { typedef void type; };
+template<> struct ElunaBaseClass<WorldObject> { typedef Object type; };
+template<> struct ElunaBaseClass<Item> { typedef Object type; };
+template<> struct ElunaBaseClass<Unit> { typedef WorldObject type; };
+template<> struct ElunaBaseClass<GameObject> { typedef WorldObject type; };
+template<> struct ElunaBaseClass<Corpse> { typedef WorldObject type; };
+template<> struct ElunaBaseClass<Player> { typedef Unit type; };
+template<> struct ElunaBaseClass<Creature> { typedef Unit type; };
+
 class ElunaObject
 {
 public:
-    ElunaObject(Eluna* E, char const* tname) : E(E), type_name(tname)
+    ElunaObject(Eluna* E, char const* tname, uint32 classId, uint64 ancestry) : E(E), type_name(tname), classId(classId), ancestry(ancestry)
     {
     }
 
@@ -42,8 +63,14 @@ public:
 
     // Get wrapped object pointer
     virtual void* GetObjIfValid() const = 0;
+    // Wrapped object pointer for read only use, unlike GetObjIfValid it does not copy borrowed objects
+    virtual void* GetViewIfValid() const { return GetObjIfValid(); }
     // Returns pointer to the wrapped object's type name
     const char* GetTypeName() const { return type_name; }
+    // Type index of the wrapped type, see ElunaTemplate<T>::GetTypeIndex
+    uint32 GetClassId() const { return classId; }
+    // True if the wrapped type is the type of `classBit` or derives from it, see ElunaTemplate<T>::GetClassBit
+    bool IsA(uint64 classBit) const { return (ancestry & classBit) != 0; }
 #if !defined TRACKABLE_PTR_NAMESPACE
     // Invalidates the pointer if it should be invalidated
     virtual void Invalidate() = 0;
@@ -52,6 +79,9 @@ public:
 protected:
     Eluna* E;
     const char* type_name;
+    uint32 classId;
+    // Class bits of the wrapped type and all of its bases
+    uint64 ancestry;
 };
 
 #if defined TRACKABLE_PTR_NAMESPACE
@@ -90,7 +120,7 @@ class ElunaObjectImpl : public ElunaObject
 {
 public:
 #if defined TRACKABLE_PTR_NAMESPACE
-    ElunaObjectImpl(Eluna* E, T const* obj, char const* tname) : ElunaObject(E, tname), _obj(GetWeakPtrFor(obj))
+    ElunaObjectImpl(Eluna* E, T const* obj, char const* tname, uint32 classId, uint64 ancestry) : ElunaObject(E, tname, classId, ancestry), _obj(GetWeakPtrFor(obj))
     {
     }
 
@@ -103,7 +133,7 @@ public:
         return nullptr;
     }
 #else
-    ElunaObjectImpl(Eluna* E, T* obj, char const* tname) : ElunaObject(E, tname), _obj(obj), callstackid(E->GetCallstackId())
+    ElunaObjectImpl(Eluna* E, T* obj, char const* tname, uint32 classId, uint64 ancestry) : ElunaObject(E, tname, classId, ancestry), _obj(obj), callstackid(E->GetCallstackId())
     {
     }
 
@@ -131,7 +161,7 @@ template <typename T>
 class ElunaObjectValueImpl : public ElunaObject
 {
 public:
-    ElunaObjectValueImpl(Eluna* E, T const* obj, char const* tname) : ElunaObject(E, tname), _obj(*obj /*always a copy, what gets passed here might be pointing to something not owned by us*/)
+    ElunaObjectValueImpl(Eluna* E, T const* obj, char const* tname, uint32 classId, uint64 ancestry) : ElunaObject(E, tname, classId, ancestry), _obj(*obj /*always a copy, what gets passed here might be pointing to something not owned by us*/)
     {
     }
 
@@ -156,10 +186,60 @@ public: \
 MAKE_ELUNA_OBJECT_VALUE_IMPL(long long);
 MAKE_ELUNA_OBJECT_VALUE_IMPL(unsigned long long);
 MAKE_ELUNA_OBJECT_VALUE_IMPL(ObjectGuid);
-MAKE_ELUNA_OBJECT_VALUE_IMPL(WorldPacket);
 MAKE_ELUNA_OBJECT_VALUE_IMPL(ElunaQuery);
+MAKE_ELUNA_OBJECT_VALUE_IMPL(ElunaStatement);
+MAKE_ELUNA_OBJECT_VALUE_IMPL(ElunaTransaction);
 MAKE_ELUNA_OBJECT_VALUE_IMPL(ElunaSpellInfo);
 
+/*
+ * Packets are copied like other values, except for the packets of packet hooks, see Eluna::HookPushPacket.
+ * Those borrow the hook's packet until the hook returns and copy it on the first access that may modify it,
+ * read only methods and the hook itself use the borrowed packet as it is.
+ */
+template <>
+class ElunaObjectImpl<WorldPacket> : public ElunaObject
+{
+public:
+    ElunaObjectImpl(Eluna* E, WorldPacket const* obj, char const* tname, uint32 classId, uint64 ancestry) : ElunaObject(E, tname, classId, ancestry), _view(nullptr), _copy(*obj)
+    {
+    }
+
+    ElunaObjectImpl(Eluna* E, WorldPacket const& view, char const* tname, uint32 classId, uint64 ancestry) : ElunaObject(E, tname, classId, ancestry), _view(&view)
+    {
+    }
+
+    void* GetObjIfValid() const override
+    {
+        // the caller may modify the packet, reading moves the read position too
+        if (_view)
+        {
+            _copy.emplace(*_view);
+            _view = nullptr;
+        }
+
+        return _copy ? &*_copy : nullptr;
+    }
+
+    void* GetViewIfValid() const override
+    {
+        if (_view)
+            return const_cast<WorldPacket*>(_view);
+
+        return _copy ? &*_copy : nullptr;
+    }
+
+    // The borrowed packet goes away with the hook, a packet that was not copied by then is invalidated
+    void ReleaseView() { _view = nullptr; }
+
+#if !defined TRACKABLE_PTR_NAMESPACE
+    void Invalidate() override { }
+#endif
+
+private:
+    mutable WorldPacket const* _view;
+    mutable std::optional<WorldPacket> _copy;
+};
+
 template<typename T = void>
 struct ElunaRegister
 {
@@ -181,12 +261,49 @@ struct ElunaRegister
         : name(name), mfunc(nullptr), regState(state), flags(static_cast<MethodFlags>(flags)) {}
 };
 
+// Hands out the indexes of ElunaTemplate<T>::GetTypeIndex, thread safe as states can be opened by map threads
+uint32 GetNextElunaTypeIndex();
+
+// Set once the first state registered its methods, the method indexes are then only read from, without taking their locks.
+// Only safe as long as every state, pooled and map states included, registers exactly the same method tables:
+// RegisterMethods must not pick tables by state, METHOD_REG_* decides per state what a method does instead.
+// Register asserts that later states bring no table the index is missing.
+extern std::atomic<bool> elunaMethodIndexesFrozen;
+
 template<typename T = void>
 class ElunaTemplate
 {
 public:
     static const char* tname;
 
+    // Index of the type's metatable ref in every Eluna, the same for all states
+    static uint32 GetTypeIndex()
+    {
+        static const uint32 typeIndex = GetNextElunaTypeIndex();
+        return typeIndex;
+    }
+
+    // Bit of the type in ancestry masks. Only the first 64 types get one, the Object hierarchy is registered first
+    static uint64 GetClassBit()
+    {
+        static const uint64 classBit = GetTypeIndex() < 64 ? uint64(1) << GetTypeIndex() : 0;
+        return classBit;
+    }
+
+    // Class bits of the type and its bases, an is-a check against any of them is a single mask test
+    static uint64 GetAncestry()
+    {
+        static const uint64 ancestry = []()
+        {
+            typedef typename ElunaBaseClass<T>::type Base;
+            if constexpr (std::is_void_v<Base>)
+                return GetClassBit();
+            else
+                return GetClassBit() | ElunaTemplate<Base>::GetAncestry();
+        }();
+        return ancestry;
+    }
+
     // name will be used as type name
     // If gc is true, lua will handle the memory management for object pushed
     // gc should be used if pushing for example WorldPacket,
@@ -216,11 +333,13 @@ public:
         lua_setglobal(L, tname);
 
         // tostring
-        lua_pushcfunction(L, ToString);
+        lua_pushlightuserdata(L, E);
+        lua_pushcclosure(L, ToString, 1);
         lua_setfield(L, metatable, "__tostring");
 
         // garbage collecting
-        lua_pushcfunction(L, CollectGarbage);
+        lua_pushlightuserdata(L, E);
+        lua_pushcclosure(L, CollectGarbage, 1);
         lua_setfield(L, metatable, "__gc");
 
         // TODO: Safe to remove this?
@@ -228,6 +347,13 @@ public:
         lua_pushvalue(L, metatable);
         lua_setfield(L, metatable, "__index");
 
+        // methods missing from the metatable are looked up in the method index and cached in the metatable
+        lua_newtable(L);
+        lua_pushlightuserdata(L, E);
+        lua_pushcclosure(L, Index, 1);
+        lua_setfield(L, -2, "__index");
+        lua_setmetatable(L, metatable);
+
         // make new indexes saved to methods
         lua_pushcfunction(L, Add);
         lua_setfield(L, metatable, "__add");
@@ -265,7 +391,8 @@ public:
         lua_setfield(L, metatable, "__len");
 
         // make new indexes saved to methods
-        lua_pushcfunction(L, Equal);
+        lua_pushlightuserdata(L, E);
+        lua_pushcclosure(L, Equal, 1);
         lua_setfield(L, metatable, "__eq");
 
         // make new indexes saved to methods
@@ -284,8 +411,8 @@ public:
         lua_pushcfunction(L, GetType);
         lua_setfield(L, metatable, "GetObjectType");
 
-        // pop metatable
-        lua_pop(L, 1);
+        // keep a ref so pushing an object does not need to look the metatable up by name, pops metatable
+        E->SetMetatableRef(GetTypeIndex(), luaL_ref(L, LUA_REGISTRYINDEX));
     }
 
     template<typename C, size_t N>
@@ -294,84 +421,117 @@ public:
         ASSERT(E);
         ASSERT(methodTable);
 
-        lua_State* L = E->L;
-
         // determine if the method table functions are global or non-global
         constexpr bool isGlobal = std::is_same_v<C, void>;
 
         if constexpr (isGlobal)
         {
+            lua_State* L = E->L;
             lua_pushglobaltable(L);
+
+            // load all core-specific methods
+            for (std::size_t i = 0; i < N; i++)
+            {
+                const auto& method = methodTable + i;
+
+                lua_pushstring(L, method->name);
+                PushMethod(E, method);
+                lua_rawset(L, -3);
+            }
+
+            lua_pop(L, 1);
         }
         else
         {
             ASSERT(tname);
 
-            // get metatable
-            lua_pushstring(L, tname);
-            lua_rawget(L, LUA_REGISTRYINDEX);
+            lua_State* L = E->L;
+
+            // metamethods are read from the metatable with rawget and can not be created lazily
+            E->PushMetatable(GetTypeIndex());
             ASSERT(lua_istable(L, -1));
+            for (std::size_t i = 0; i < N; i++)
+            {
+                if (!IsMetamethod(methodTable[i].name))
+                    continue;
+
+                lua_pushstring(L, methodTable[i].name);
+                PushMethod(E, reinterpret_cast<const ElunaRegister<T>*>(methodTable + i));
+                lua_rawset(L, -3);
+            }
+            lua_pop(L, 1);
+
+            // other class methods only go to the method index, Index creates their closures when they are first used
+            MethodIndex& index = GetMethodIndex();
+            if (elunaMethodIndexesFrozen.load(std::memory_order_acquire))
+            {
+                // nothing writes the frozen index, a table it is missing would never be found by Index
+                ASSERT(index.tables.count(methodTable));
+                return;
+            }
+
+            std::lock_guard<std::mutex> guard(index.lock);
+
+            // every state registers the same tables, only the first one fills the index
+            if (!index.tables.insert(methodTable).second)
+                return;
+
+            // tables registered later override methods of the same name, like Player methods override Unit methods
+            for (std::size_t i = 0; i < N; i++)
+                if (!IsMetamethod(methodTable[i].name))
+                    index.methods[methodTable[i].name] = reinterpret_cast<const ElunaRegister<T>*>(methodTable + i);
         }
+    }
 
-        // load all core-specific methods
-        for (std::size_t i = 0; i < N; i++)
+    // Pushes the closure Lua calls for `method`, or one that raises the reason the method can not be called
+    static void PushMethod(Eluna* E, const ElunaRegister<T>* method)
+    {
+        lua_State* L = E->L;
+
+        // if the method should not be registered, push a closure to error output function
+        if (method->regState == METHOD_REG_NONE)
         {
-            const auto& method = methodTable + i;
+            lua_pushstring(L, method->name);
+            lua_pushcclosure(L, MethodUnimpl, 1);
+            return;
+        }
 
-            // push the method name to the Lua stack
+        // if the method is considered unsafe, and unsafe methods have not been enabled, push a closure to error output function
+        if (method->flags & METHOD_FLAG_UNSAFE && !sElunaConfig->UnsafeMethodsEnabled())
+        {
             lua_pushstring(L, method->name);
+            lua_pushcclosure(L, MethodUnsafe, 1);
+            return;
+        }
 
-            // if the method should not be registered, push a closure to error output function
-            if (method->regState == METHOD_REG_NONE)
-            {
-                lua_pushstring(L, method->name);
-                lua_pushcclosure(L, MethodUnimpl, 1);
-                lua_rawset(L, -3);
-                continue;
-            }
+        // if the method is considered deprecated, and deprecated methods have not been enabled, push a closure to error output function
+        if (method->flags & METHOD_FLAG_DEPRECATED && !sElunaConfig->DeprecatedMethodsEnabled())
+        {
+            lua_pushstring(L, method->name);
+            lua_pushcclosure(L, MethodDeprecated, 1);
+            return;
+        }
 
-            // if the method is considered unsafe, and unsafe methods have not been enabled, push a closure to error output function
-            if (method->flags & METHOD_FLAG_UNSAFE && !sElunaConfig->UnsafeMethodsEnabled())
-            {
-                lua_pushstring(L, method->name);
-                lua_pushcclosure(L, MethodUnsafe, 1);
-                lua_rawset(L, -3);
-                continue;
-            }
+        // if we're in multistate mode, we need to check whether a method is flagged as a world or a map specific method
+        if (method->regState != METHOD_REG_ALL)
+        {
+            int32 mapId = E->GetBoundMapId();
 
-            // if the method is considered deprecated, and deprecated methods have not been enabled, push a closure to error output function
-            if (method->flags & METHOD_FLAG_DEPRECATED && !sElunaConfig->DeprecatedMethodsEnabled())
+            // if the method should not be registered, push a closure to error output function
+            if ((mapId == -1 && method->regState == METHOD_REG_MAP) ||
+                (mapId != -1 && method->regState == METHOD_REG_WORLD))
             {
                 lua_pushstring(L, method->name);
-                lua_pushcclosure(L, MethodDeprecated, 1);
-                lua_rawset(L, -3);
-                continue;
+                lua_pushinteger(L, mapId);
+                lua_pushcclosure(L, MethodWrongState, 2);
+                return;
             }
-
-            // if we're in multistate mode, we need to check whether a method is flagged as a world or a map specific method
-            if (method->regState != METHOD_REG_ALL)
-            {
-                int32 mapId = E->GetBoundMapId();
-
-                // if the method should not be registered, push a closure to error output function
-                if ((mapId == -1 && method->regState == METHOD_REG_MAP) ||
-                    (mapId != -1 && method->regState == METHOD_REG_WORLD))
-                {
-                    lua_pushstring(L, method->name);
-                    lua_pushinteger(L, mapId);
-                    lua_pushcclosure(L, MethodWrongState, 2);
-                    lua_rawset(L, -3);
-                    continue;
-                }
-            }
-
-            // push a closure to the thunk with the method pointer as light user data
-            lua_pushlightuserdata(L, (void*)method);
-            lua_pushcclosure(L, thunk, 1);
-            lua_rawset(L, -3);
         }
 
-        lua_pop(L, 1);
+        // push a closure to the thunk with the method pointer and the owning Eluna as light user data
+        lua_pushlightuserdata(L, (void*)method);
+        lua_pushlightuserdata(L, E);
+        lua_pushcclosure(L, method->regState == METHOD_REG_MAP ? mapThunk : thunk, 2);
     }
 
     static int Push(Eluna* E, T const* obj)
@@ -385,6 +545,14 @@ public:
 
         typedef ElunaObjectImpl<T> ElunaObjectType;
 
+        // Value types are copied into the userdata, only wrappers of objects owned by the core can be shared
+        constexpr bool cacheable = !std::is_base_of_v<ElunaObjectValueImpl<T>, ElunaObjectType> && !std::is_same_v<T, WorldPacket>;
+        if constexpr (cacheable)
+        {
+            if (E->IsObjectCacheEnabled() && E->PushCachedObject(obj, tname))
+                return 1;
+        }
+
         // Create new userdata
         ElunaObjectType* elunaObject = static_cast<ElunaObjectType*>(lua_newuserdata(L, sizeof(ElunaObjectType)));
         if (!elunaObject)
@@ -393,11 +561,11 @@ public:
             lua_pushnil(L);
             return 1;
         }
-        new (elunaObject) ElunaObjectType(E, const_cast<T*>(obj), tname);
+        new (elunaObject) ElunaObjectType(E, const_cast<T*>(obj), tname, GetTypeIndex(), GetAncestry());
 
         // Set metatable for it
-        lua_pushstring(L, tname);
-        lua_rawget(L, LUA_REGISTRYINDEX);
+        if (!E->PushMetatable(GetTypeIndex()))
+            lua_pushnil(L);
         if (!lua_istable(L, -1))
         {
             ELUNA_LOG_ERROR("%s missing metatable", tname);
@@ -406,10 +574,44 @@ public:
             return 1;
         }
         lua_setmetatable(L, -2);
+
+        if constexpr (cacheable)
+        {
+            if (E->IsObjectCacheEnabled())
+                E->CacheObject(obj);
+        }
         return 1;
     }
 
-    static T* Check(Eluna* E, int narg, bool error = true)
+    // Pushes a wrapper borrowing `obj` instead of a copy, only for types with a borrowing ElunaObjectImpl like WorldPacket
+    static ElunaObjectImpl<T>* PushView(Eluna* E, T const& obj)
+    {
+        lua_State* L = E->L;
+
+        ElunaObjectImpl<T>* elunaObject = static_cast<ElunaObjectImpl<T>*>(lua_newuserdata(L, sizeof(ElunaObjectImpl<T>)));
+        if (!elunaObject)
+        {
+            ELUNA_LOG_ERROR("%s could not create new userdata", tname);
+            lua_pushnil(L);
+            return nullptr;
+        }
+        new (elunaObject) ElunaObjectImpl<T>(E, obj, tname, GetTypeIndex(), GetAncestry());
+
+        if (!E->PushMetatable(GetTypeIndex()))
+            lua_pushnil(L);
+        if (!lua_istable(L, -1))
+        {
+            ELUNA_LOG_ERROR("%s missing metatable", tname);
+            lua_pop(L, 2);
+            lua_pushnil(L);
+            return nullptr;
+        }
+        lua_setmetatable(L, -2);
+        return elunaObject;
+    }
+
+    // `readOnly` checks do not copy borrowed objects, see ElunaObject::GetViewIfValid
+    static T* Check(Eluna* E, int narg, bool error = true, bool readOnly = false)
     {
         lua_State* L = E->L;
 
@@ -417,7 +619,7 @@ public:
         if (!elunaObj)
             return NULL;
 
-        void* obj = elunaObj->GetObjIfValid();
+        void* obj = readOnly ? elunaObj->GetViewIfValid() : elunaObj->GetObjIfValid();
         if (!obj)
         {
             char buff[256];
@@ -441,10 +643,18 @@ public:
         return 1;
     }
 
+    // Map state methods return nil until a map is bound, pooled states run their scripts before they get one
+    static int mapThunk(lua_State* L)
+    {
+        if (!GetUpvalueEluna(L, 2)->GetBoundMap())
+            return 0;
+        return thunk(L);
+    }
+
     static int thunk(lua_State* L)
     {
         ElunaRegister<T>* l = static_cast<ElunaRegister<T>*>(lua_touserdata(L, lua_upvalueindex(1)));
-        Eluna* E = Eluna::GetEluna(L);
+        Eluna* E = GetUpvalueEluna(L, 2);
 
         // determine if the method table functions are global or non-global
         constexpr bool isGlobal = std::is_same_v<T, void>;
@@ -453,18 +663,26 @@ public:
         T* obj;
         if constexpr (!isGlobal)
         {
-            obj = E->CHECKOBJ<T>(1);
+            // read only methods are only flagged on types without derived types, their check is exact
+            if (l->flags & METHOD_FLAG_READ_ONLY)
+                obj = Check(E, 1, true, true);
+            else
+                obj = E->CHECKOBJ<T>(1);
             if (!obj)
                 return 0;
         }
 
         int top = lua_gettop(L);
 
+        // the method may call into the core and trigger nested hooks, none of it may fail against the memory limit.
+        // an error raised by the method skips restoring, the limit is then lifted until the handler returns
+        bool enforced = E->SetMemoryLimitEnforced(false);
         int expected = 0;
         if constexpr (isGlobal)
             expected = l->mfunc(E);      // global method
         else
             expected = l->mfunc(E, obj); // non-global method
+        E->SetMemoryLimitEnforced(enforced);
 
         int args = lua_gettop(L) - top;
         if (args < 0 || args > expected)
@@ -476,12 +694,57 @@ public:
         return expected;
     }
 
+    // __index of the metatable's own metatable, called with the metatable and a key it does not have
+    static int Index(lua_State* L)
+    {
+        Eluna* E = GetUpvalueEluna(L, 1);
+
+        const ElunaRegister<T>* method = nullptr;
+        if (lua_type(L, 2) == LUA_TSTRING)
+        {
+            size_t length;
+            const char* name = lua_tolstring(L, 2, &length);
+
+            // misses are not cached and reach here on every access, so the lookup takes no lock
+            // once the index is complete. it is only locked while the first state is still filling it
+            MethodIndex& index = GetMethodIndex();
+            std::unique_lock<std::mutex> guard(index.lock, std::defer_lock);
+            if (!elunaMethodIndexesFrozen.load(std::memory_order_acquire))
+                guard.lock();
+
+            auto it = index.methods.find(std::string_view(name, length));
+            if (it != index.methods.end())
+                method = it->second;
+        }
+
+        if (!method)
+        {
+            lua_pushnil(L);
+            return 1;
+        }
+
+        // metatable[name] = closure, later calls find it without reaching here
+        PushMethod(E, method);
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, 1);
+        return 1;
+    }
+
+    // Returns the Eluna stored as light userdata upvalue when the closure was created in Register or SetMethods
+    static Eluna* GetUpvalueEluna(lua_State* L, int upvalue)
+    {
+        Eluna* E = static_cast<Eluna*>(lua_touserdata(L, lua_upvalueindex(upvalue)));
+        ASSERT(E);
+        return E;
+    }
+
     // Metamethods ("virtual")
 
     // Remember special cases like ElunaTemplate<Vehicle>::CollectGarbage
     static int CollectGarbage(lua_State* L)
     {
-        Eluna* E = Eluna::GetEluna(L);
+        Eluna* E = GetUpvalueEluna(L, 1);
 
         // Get object pointer (and check type, no error)
         ElunaObject* obj = E->CHECKOBJ<ElunaObject>(1, false);
@@ -491,7 +754,7 @@ public:
 
     static int ToString(lua_State* L)
     {
-        Eluna* E = Eluna::GetEluna(L);
+        Eluna* E = GetUpvalueEluna(L, 1);
 
         T* obj = E->CHECKOBJ<T>(1, true); // get self
         lua_pushfstring(L, "%s: %p", tname, obj);
@@ -509,11 +772,29 @@ public:
     static int UnaryMinus(lua_State* L) { return ArithmeticError(L); }
     static int Concat(lua_State* L) { return luaL_error(L, "attempt to concatenate a %s value", tname); }
     static int Length(lua_State* L) { return luaL_error(L, "attempt to get length of a %s value", tname); }
-    static int Equal(lua_State* L) { Eluna* E = Eluna::GetEluna(L); E->Push(E->CHECKOBJ<T>(1) == E->CHECKOBJ<T>(2)); return 1; }
+    static int Equal(lua_State* L) { Eluna* E = GetUpvalueEluna(L, 1); E->Push(E->CHECKOBJ<T>(1) == E->CHECKOBJ<T>(2)); return 1; }
     static int Less(lua_State* L) { return CompareError(L); }
     static int LessOrEqual(lua_State* L) { return CompareError(L); }
     static int Call(lua_State* L) { return luaL_error(L, "attempt to call a %s value", tname); }
 
+private:
+    // Methods of the type and its bases, shared by all states
+    struct MethodIndex
+    {
+        std::mutex lock;
+        std::unordered_set<const void*> tables;
+        std::unordered_map<std::string_view, const ElunaRegister<T>*> methods;
+    };
+
+    static MethodIndex& GetMethodIndex()
+    {
+        static MethodIndex index;
+        return index;
+    }
+
+    static bool IsMetamethod(const char* name) { return name[0] == '_' && name[1] == '_'; }
+
+public:
     static int MethodWrongState(lua_State* L) { luaL_error(L, "attempt to call method '%s' that does not exist for state: %d", lua_tostring(L, lua_upvalueindex(1)), lua_tointeger(L, lua_upvalueindex(2))); return 0; }
     static int MethodUnimpl(lua_State* L) { luaL_error(L, "attempt to call method '%s' that is not implemented for this emulator", lua_tostring(L, lua_upvalueindex(1))); return 0; }
     static int MethodUnsafe(lua_State* L) { luaL_error(L, "attempt to call method '%s' that is flagged as unsafe! to use this method, enable unsafe methods in the config file", lua_tostring(L, lua_upvalueindex(1))); return 0; }
@@ -0,0 +1,142 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaWatchdog.h"
+#include "LuaEngine.h"
+
+#include <algorithm>
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+ElunaWatchdog::ElunaWatchdog() :
+    softLimit(0),
+    hardLimit(0),
+    interval(0),
+    context({ 0, 0, 0 }),
+    hasContext(false),
+    reportedSlow(false),
+    reportedAbort(false),
+    slowCalls(0),
+    abortedCalls(0)
+{
+}
+
+void ElunaWatchdog::OnStateOpened(lua_State* L, uint32 softLimit, uint32 hardLimit, uint32 interval)
+{
+    this->softLimit = softLimit;
+    this->hardLimit = hardLimit;
+    this->interval = std::max<uint32>(interval, 1);
+    slowCalls = 0;
+    abortedCalls = 0;
+
+#if defined LUAJIT_VERSION
+    // Compiled traces never call the count hook, a hot loop could not be aborted.
+    // Turned off before any script ran, so there is no compiled code left over
+    if (hardLimit)
+        luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+#else
+    (void)L;
+#endif
+}
+
+bool ElunaWatchdog::Arm(lua_State* L, int handler, const ElunaProfiler::Context* context)
+{
+    // Leave hooks installed by scripts alone
+    if (lua_gethook(L))
+        return false;
+
+    // Recorded now, no Lua frame is left to look at once a slow C function returns
+    lua_Debug ar;
+    lua_pushvalue(L, handler);
+    lua_getinfo(L, ">S", &ar);
+    source.assign(ar.short_src);
+    source += ':';
+    source += std::to_string(ar.linedefined);
+
+    start = std::chrono::steady_clock::now();
+    hasContext = context != nullptr;
+    if (context)
+        this->context = *context;
+    reportedSlow = false;
+    reportedAbort = false;
+
+    lua_sethook(L, &ElunaWatchdog::Hook, LUA_MASKCOUNT, int(interval));
+    return true;
+}
+
+void ElunaWatchdog::Disarm(lua_State* L)
+{
+    lua_sethook(L, nullptr, 0, 0);
+
+    // The handler may have spent its time in C functions without reaching another check
+    if (!reportedSlow && !reportedAbort && softLimit)
+    {
+        uint64 elapsed = GetElapsed();
+        if (elapsed >= softLimit)
+        {
+            ++slowCalls;
+            Log(L, "Slow handler", elapsed, false);
+        }
+    }
+}
+
+uint64 ElunaWatchdog::GetElapsed() const
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void ElunaWatchdog::Hook(lua_State* L, lua_Debug* /*ar*/)
+{
+    Eluna::GetEluna(L)->GetWatchdog().Check(L);
+}
+
+void ElunaWatchdog::Check(lua_State* L)
+{
+    uint64 elapsed = GetElapsed();
+
+    if (hardLimit && elapsed >= hardLimit)
+    {
+        // Keep raising the error, the handler may catch it with pcall
+        if (!reportedAbort)
+        {
+            reportedAbort = true;
+            ++abortedCalls;
+            Log(L, "Aborted handler", elapsed, true);
+        }
+        luaL_error(L, "handler aborted after running for %u ms (Eluna.WatchdogHardLimit is %u ms)", uint32(elapsed), hardLimit);
+        return;
+    }
+
+    if (softLimit && !reportedSlow && elapsed >= softLimit)
+    {
+        reportedSlow = true;
+        ++slowCalls;
+        Log(L, "Slow handler", elapsed, true);
+    }
+}
+
+void ElunaWatchdog::Log(lua_State* L, const char* reason, uint64 elapsed, bool traceback) const
+{
+    std::string hook = hasContext ? ElunaProfiler::GetHookName(context) : "?";
+
+    if (!traceback)
+    {
+        ELUNA_LOG_ERROR("[Eluna]: %s: hook %s, function %s, ran for %llu ms", reason, hook.c_str(), source.c_str(), (unsigned long long)elapsed);
+        return;
+    }
+
+    // Hooks do not run while a hook runs, so this does not recurse
+    int top = lua_gettop(L);
+    lua_pushcfunction(L, &Eluna::StackTrace);
+    lua_pushstring(L, "");
+    const char* trace = lua_pcall(L, 1, 1, 0) == 0 ? lua_tostring(L, -1) : nullptr;
+    ELUNA_LOG_ERROR("[Eluna]: %s: hook %s, function %s, running for %llu ms%s", reason, hook.c_str(), source.c_str(), (unsigned long long)elapsed, trace ? trace : "");
+    lua_settop(L, top);
+}
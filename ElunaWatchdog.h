@@ -0,0 +1,74 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_WATCHDOG_H
+#define _ELUNA_WATCHDOG_H
+
+#include "ElunaUtility.h"
+#include "ElunaProfiler.h"
+
+#include <chrono>
+#include <string>
+
+struct lua_State;
+struct lua_Debug;
+
+/*
+ * Limits the time a single handler of a Lua state may run.
+ *
+ * While the outermost handler of an event runs, a count hook checks the elapsed time every few
+ * thousand instructions. Handlers over the soft limit are logged once with their hook, script and
+ * traceback, handlers over the hard limit are aborted with a Lua error.
+ * Nothing is installed when both limits are 0, so handlers run without a hook.
+ *
+ * Only Lua code is interrupted: time spent in C functions is counted, but the check runs on the next
+ * Lua instruction. Coroutines created before the handler started are not watched.
+ * LuaJIT does not call hooks in compiled code, so its JIT compiler is off in states with a hard limit.
+ */
+class ElunaWatchdog
+{
+public:
+    ElunaWatchdog();
+
+    // Limits are in milliseconds, `interval` is the number of instructions between checks.
+    // On LuaJIT a hard limit turns the JIT compiler of the state off, compiled code does not run hooks
+    void OnStateOpened(lua_State* L, uint32 softLimit, uint32 hardLimit, uint32 interval);
+
+    bool IsEnabled() const { return softLimit || hardLimit; }
+
+    // Installs the hook around the outermost lua_pcall of the function at stack index `handler`,
+    // `context` is the hook the handler was called for or null.
+    // Returns false if another hook, like a debugger, is installed and nothing was armed.
+    bool Arm(lua_State* L, int handler, const ElunaProfiler::Context* context);
+    // Removes the hook, logs the handler if it went over the soft limit outside of Lua code
+    void Disarm(lua_State* L);
+
+    uint32 GetSlowCalls() const { return slowCalls; }
+    uint32 GetAbortedCalls() const { return abortedCalls; }
+
+private:
+    static void Hook(lua_State* L, lua_Debug* ar);
+    void Check(lua_State* L);
+    void Log(lua_State* L, const char* reason, uint64 elapsed, bool traceback) const;
+    uint64 GetElapsed() const;
+
+    uint32 softLimit;
+    uint32 hardLimit;
+    uint32 interval;
+
+    // State of the call being watched
+    std::chrono::steady_clock::time_point start;
+    ElunaProfiler::Context context;
+    std::string source;     // Script and line of the handler
+    bool hasContext;
+    bool reportedSlow;
+    bool reportedAbort;
+
+    uint32 slowCalls;
+    uint32 abortedCalls;
+};
+
+#endif
@@ -12,10 +12,17 @@
 #include "ElunaEventMgr.h"
 #include "ElunaIncludes.h"
 #include "ElunaLoader.h"
+#include "ElunaMessageBus.h"
+#include "ElunaMgr.h"
+#include "ElunaQueryWorker.h"
 #include "ElunaTemplate.h"
 #include "ElunaUtility.h"
 #include "ElunaCreatureAI.h"
 #include "ElunaInstanceAI.h"
+#include "lmarshal.h"
+
+#include <array>
+#include <cstring>
 
 extern "C"
 {
@@ -29,6 +36,10 @@ extern "C"
 
 extern void RegisterMethods(Eluna* E);
 
+#if !ELUNA_STATE_EXTRASPACE
+char Eluna::stateKey = 0;
+#endif
+
 void Eluna::_ReloadEluna()
 {
     // Remove all timed events
@@ -37,7 +48,9 @@ void Eluna::_ReloadEluna()
 #if defined ELUNA_TRINITY
     // Cancel all pending async queries
     GetQueryProcessor().CancelAll();
+    GetTransactionProcessor().CancelAll();
 #endif
+    CancelAsyncQueries();
 
     // Close lua
     CloseLua();
@@ -51,10 +64,71 @@ void Eluna::_ReloadEluna()
     reload = false;
 }
 
-Eluna::Eluna(Map* map) :
+void Eluna::ReloadChangedScripts()
+{
+    for (auto& [filename, filepath] : sElunaLoader->GetChangedScripts(scriptGeneration))
+        ReloadScript(filename, filepath);
+}
+
+/*
+ * Replaces a single script without touching the rest of the state.
+ *
+ * Bindings and timed events belong to the script that registered them, see SetRefOwner.
+ *   Those are removed before the script is required again and registers them anew.
+ *   Handlers other scripts registered with functions of this one keep the old functions
+ *   until those scripts are reloaded as well.
+ */
+void Eluna::ReloadScript(const std::string& filename, const std::string& filepath)
+{
+    // the state only runs the first script with a name and the scripts for its map
+    const LuaScript* script = sElunaLoader->GetLuaScript(filename);
+    if (!script || script->filepath != filepath || (script->mapId != -1 && script->mapId != GetBoundMapId()))
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+
+    // compiled chunks are named after the file they were loaded from
+    std::string source = "@" + filepath;
+    auto registeredByScript = [this, &source](int functionRef)
+    {
+        auto owner = refOwners.find(functionRef);
+        return owner != refOwners.end() && owner->second == source;
+    };
+
+    uint32 bindings = 0;
+    for (auto& binding : bindingMaps)
+        if (binding)
+            bindings += binding->RemoveIf(registeredByScript);
+    uint32 events = eventMgr->RemoveEventsIf(registeredByScript);
+
+    // forget the module so require runs the new bytecode
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    lua_pushnil(L);
+    lua_setfield(L, -2, filename.c_str());
+    lua_pop(L, 2);
+
+    lua_getglobal(L, "require");
+    lua_pushstring(L, filename.c_str());
+    bool loaded = ExecuteCall(1, 0);
+
+    uint32 elapsed = uint32(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    if (loaded)
+        ELUNA_LOG_INFO("[Eluna]: Reloaded `%s` in %u us for map: %i, instance: %u (replaced %u bindings and %u timed events)", filepath.c_str(), elapsed, GetBoundMapId(), GetBoundInstanceId(), bindings, events);
+    else
+        ELUNA_LOG_ERROR("[Eluna]: Reloading `%s` failed for map: %i, instance: %u, its %u bindings and %u timed events were removed", filepath.c_str(), GetBoundMapId(), GetBoundInstanceId(), bindings, events);
+}
+
+Eluna::Eluna(Map* map) : Eluna(map, map ? int32(map->GetId()) : -1)
+{
+}
+
+Eluna::Eluna(Map* map, int32 mapId) :
 event_level(0),
 push_counter(0),
 boundMap(map),
+boundMapId(mapId),
+asyncQueries(std::make_shared<ElunaAsyncQueries>()),
 L(NULL)
 {
     OpenLua();
@@ -65,16 +139,176 @@ L(NULL)
         RunScripts();
     else
         reload = true;
+
+    SubscribeMessages();
 }
 
 Eluna::~Eluna()
 {
+    if (reloadQueued)
+        sElunaLoader->CancelStateReload(reloadPriority);
+
+    sElunaMessageBus->Unsubscribe(mailbox);
+    CancelAsyncQueries();
+    CloseLua();
+
+    if (scriptGenerationTracked)
+        sElunaLoader->LeaveScriptGeneration(scriptGeneration);
+}
+
+void Eluna::BindMap(Map* map)
+{
+    ASSERT(IsPooled() && int32(map->GetId()) == boundMapId);
+    boundMap = map;
+    SubscribeMessages();
+
+    // the scripts already ran while pooled, unless the cache was not ready back then
+    if (!reload)
+        OnLuaStateOpen();
+}
+
+void Eluna::UnbindMap()
+{
+    if (reloadQueued)
+    {
+        sElunaLoader->CancelStateReload(reloadPriority);
+        reloadQueued = false;
+    }
+
+    eventMgr->SetAllEventStates(LUAEVENT_STATE_ERASE);
+#if defined ELUNA_TRINITY
+    GetQueryProcessor().CancelAll();
+    GetTransactionProcessor().CancelAll();
+#endif
+    CancelAsyncQueries();
+
+    sElunaMessageBus->Unsubscribe(mailbox);
+    mailbox.reset();
+
     CloseLua();
+    boundMap = nullptr;
+    reload = true;
+}
+
+void Eluna::SubscribeMessages()
+{
+    // the mailbox is only allocated once the state can receive, pooled states wait for their map
+    if (mailbox || IsPooled() || !HasEventBindings(Hooks::REGTYPE_SERVER, Hooks::ELUNA_EVENT_ON_MESSAGE))
+        return;
+
+    mailbox = sElunaMessageBus->Subscribe(boundMapId, boundMap ? boundMap->GetInstanceId() : 0);
+}
+
+void Eluna::DeliverMessages()
+{
+    if (!mailbox || reload)
+        return;
+
+    // messages published by the handlers themselves wait for the next update
+    uint32 count = mailbox->GetDepth();
+    ElunaMessage message;
+    while (count-- > 0 && mailbox->Pop(message))
+    {
+        mailbox->OnDelivered(message);
+        OnMessage(message);
+    }
+}
+
+uint32 Eluna::PublishMessage(int32 mapId, uint32 instanceId, const char* topic, int payloadIndex)
+{
+    // Stack: [arguments]
+    lua_pushcfunction(L, mar_encode);
+    lua_pushvalue(L, payloadIndex);
+    // Stack: [arguments], mar_encode, payload
+
+    // values that can not be encoded raise the error in the publishing script,
+    // before any C++ object is created here or by the callers
+    lua_call(L, 1, 1);
+    // Stack: [arguments], data
+
+    ElunaMessage message;
+    size_t length;
+    const char* data = lua_tolstring(L, -1, &length);
+    message.payload.assign(data, length);
+    lua_pop(L, 1);
+    // Stack: [arguments]
+
+    message.topic = topic;
+    message.sourceMapId = boundMapId;
+    message.sourceInstanceId = boundMap ? boundMap->GetInstanceId() : 0;
+    message.sent = std::chrono::steady_clock::now();
+    return sElunaMessageBus->Publish(mapId, instanceId, message);
+}
+
+bool Eluna::QueueAsyncQuery(ElunaDatabase database, std::string sql, int funcRef, ElunaStatement statement)
+{
+    return sElunaQueryWorker->Enqueue(asyncQueries, database, std::move(sql), funcRef, std::move(statement));
+}
+
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+bool Eluna::QueueAsyncCommit(ElunaDatabase database, std::vector<std::string>&& statements, int funcRef)
+{
+    // nobody waits for the outcome of a commit without a callback
+    std::shared_ptr<ElunaAsyncQueries> owner = funcRef != LUA_NOREF ? asyncQueries : nullptr;
+    return sElunaQueryWorker->EnqueueTransaction(owner, database, std::move(statements), funcRef, false);
+}
+#endif
+
+void Eluna::DeliverAsyncQueries()
+{
+    if (!L || !asyncQueries->HasCompleted())
+        return;
+
+    for (ElunaAsyncQueryResult& query : asyncQueries->TakeCompleted())
+    {
+        if (query.statement)
+            query.statement->OnQueried(query.queued);
+
+        ElunaQuery* eq = query.result ? &query.result : nullptr;
+
+        // Get the Lua function from the registry
+        lua_rawgeti(L, LUA_REGISTRYINDEX, query.funcRef);
+
+        // Push the query results, or the outcome of a commit, as a parameter
+        if (query.transaction)
+            Push(query.committed);
+        else
+            Push(eq);
+
+        // Call the Lua function
+        ExecuteCall(1, 0);
+
+        // Unreference the Lua function
+        luaL_unref(L, LUA_REGISTRYINDEX, query.funcRef);
+    }
+}
+
+void Eluna::CancelAsyncQueries()
+{
+    // the registry refs of the callbacks go away with the Lua state
+    asyncQueries->Cancel();
+    asyncQueries = std::make_shared<ElunaAsyncQueries>();
+}
+
+void Eluna::RebuildPooledState()
+{
+    ASSERT(IsPooled());
+
+    CancelAsyncQueries();
+    CloseLua();
+    OpenLua();
+    RunScripts();
+    reload = false;
 }
 
 void Eluna::CloseLua()
 {
-    OnLuaStateClose();
+    // pooled states never saw OnLuaStateOpen
+    if (!IsPooled())
+        OnLuaStateClose();
+
+    // Writes of the closing state must not be lost
+    FlushWrites();
 
     DestroyBindStores();
 
@@ -84,7 +318,12 @@ void Eluna::CloseLua()
     L = NULL;
 
     instanceDataRefs.clear();
+    refOwners.clear();
     continentDataRefs.clear();
+    metatableRefs.clear();
+    objectCacheEnabled = false;
+    objectCacheDirty = false;
+    compactIntegers = false;
 }
 
 static int PrecompiledLoader(lua_State* L)
@@ -93,38 +332,74 @@ static int PrecompiledLoader(lua_State* L)
     if (modname == NULL)
         return 0;
 
-    const std::vector<LuaScript>& scripts = sElunaLoader->GetLuaScripts();
-
-    auto it = std::find_if(scripts.begin(), scripts.end(), [modname](const LuaScript& script) { return script.filename == modname; });
-    if (it == scripts.end()) {
+    const LuaScript* script = sElunaLoader->GetLuaScript(modname);
+    if (!script) {
         lua_pushfstring(L, "\n\tno precompiled script '%s' found", modname);
         return 1;
     }
-    if (luaL_loadbuffer(L, reinterpret_cast<const char*>(&it->bytecode[0]), it->bytecode.size(), it->filename.c_str()))
+
+    int status;
+    {
+        // the watcher may replace the bytecode meanwhile, the reference keeps this one alive while it loads.
+        // it is released before lua_error, which would skip its destructor
+        std::shared_ptr<const BytecodeBuffer> bytecode = std::atomic_load(&script->bytecode);
+        status = luaL_loadbuffer(L, reinterpret_cast<const char*>(bytecode->data()), bytecode->size(), script->filename.c_str());
+    }
+    if (status)
     {
         // Stack: modname, errmsg
         return lua_error(L);
     }
     // Stack: modname, filefunction
-    lua_pushstring(L, it->filepath.c_str());
+    lua_pushstring(L, script->filepath.c_str());
     // Stack: modname, filefunction, modpath
     return 2;
 }
 
 void Eluna::OpenLua()
 {
-    L = luaL_newstate();
+    allocator.SetLimit(sElunaConfig->GetStateMemoryLimit());
+    allocator.ResetPeak();
+    L = allocator.NewState();
 
+    // Kept for external C modules that look up the state by name
     lua_pushlightuserdata(L, this);
     lua_setfield(L, LUA_REGISTRYINDEX, ELUNA_STATE_PTR);
 
+#if ELUNA_STATE_EXTRASPACE
+    *static_cast<Eluna**>(lua_getextraspace(L)) = this;
+#else
+    lua_pushlightuserdata(L, &stateKey);
+    lua_pushlightuserdata(L, this);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+#endif
+
     CreateBindStores();
 
+    profiler.OnStateOpened(sElunaConfig->IsProfilerEnabled());
+    garbageCollector.OnStateOpened(L, sElunaConfig->GetGCStepBudget(), sElunaConfig->IsGenerationalGCEnabled(), sElunaConfig->GetGCErrorInterval(),
+        sElunaConfig->GetStateMemoryLimit());
+
     // open base lua libraries
     luaL_openlibs(L);
 
+    // after the libraries, opening LuaJIT's jit library turns its compiler on
+    watchdog.OnStateOpened(L, sElunaConfig->GetWatchdogSoftLimit(), sElunaConfig->GetWatchdogHardLimit(), sElunaConfig->GetWatchdogInterval());
+
+    if (sElunaConfig->IsObjectCacheEnabled())
+        CreateObjectCache();
+
+    compactIntegers = sElunaConfig->AreCompactIntegersEnabled();
+    coalesceWrites = sElunaConfig->AreWritesCoalesced();
+#if !ELUNA_NATIVE_INTEGERS
+    if (compactIntegers)
+        CreateIntegerCache();
+#endif
+
     // Register methods and functions
     RegisterMethods(this);
+    // the same tables for every state, see elunaMethodIndexesFrozen
+    elunaMethodIndexesFrozen.store(true, std::memory_order_release);
 
     // Register event ID lookup table
     RegisterHookGlobals(L);
@@ -189,6 +464,16 @@ void Eluna::DestroyBindStores()
         binding.reset();
 }
 
+uint8 Eluna::GetRegisterType(const BaseBindingMap* bindings) const
+{
+    for (uint8 i = 0; i < Hooks::REGTYPE_COUNT; ++i)
+        if (bindingMaps[i].get() == bindings)
+            return i;
+
+    ASSERT(false);
+    return Hooks::REGTYPE_COUNT;
+}
+
 void Eluna::RegisterHookGlobals(lua_State* _L)
 {
     lua_newtable(_L); 
@@ -211,7 +496,6 @@ void Eluna::RegisterHookGlobals(lua_State* _L)
 
 void Eluna::RunScripts()
 {
-    int32 const boundMapId = GetBoundMapId();
     uint32 const boundInstanceId = GetBoundInstanceId();
     ELUNA_LOG_DEBUG("[Eluna]: Running scripts for state: %i, instance: %u", boundMapId, boundInstanceId);
 
@@ -220,6 +504,12 @@ void Eluna::RunScripts()
 
     std::unordered_map<std::string, std::string> loaded; // filename, path
 
+    // the cache already contains every script recompiled so far
+    if (scriptGenerationTracked)
+        sElunaLoader->LeaveScriptGeneration(scriptGeneration);
+    sElunaLoader->EnterScriptGeneration(scriptGeneration);
+    scriptGenerationTracked = true;
+
     lua_getglobal(L, "require");
     // Stack: require
 
@@ -260,7 +550,8 @@ void Eluna::RunScripts()
     lua_pop(L, 1);
     ELUNA_LOG_INFO("[Eluna]: Executed %u Lua scripts in %u ms for map: %i, instance: %u", count, ElunaUtil::GetTimeDiff(oldMSTime), boundMapId, boundInstanceId);
 
-    OnLuaStateOpen();
+    if (!IsPooled())
+        OnLuaStateOpen();
 }
 
 #if !defined TRACKABLE_PTR_NAMESPACE
@@ -271,6 +562,178 @@ void Eluna::InvalidateObjects()
 }
 #endif
 
+void Eluna::SetMetatableRef(uint32 typeIndex, int ref)
+{
+    if (typeIndex >= metatableRefs.size())
+        metatableRefs.resize(typeIndex + 1, LUA_NOREF);
+    metatableRefs[typeIndex] = ref;
+}
+
+void Eluna::CreateObjectCache()
+{
+    lua_newtable(L);
+    // Stack: cache
+
+    // Weak values, the cache must not keep userdata alive that Lua is done with
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+
+    objectCacheRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    objectCacheEnabled = true;
+    objectCacheDirty = false;
+}
+
+void Eluna::ReleaseObjectCache()
+{
+    if (!objectCacheDirty)
+        return;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, objectCacheRef);
+    // Stack: cache
+
+    // Clearing fields while traversing is allowed, the table keeps its size for the next event stack
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+        // Stack: cache, key, value
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+        // Stack: cache, key
+    }
+    lua_pop(L, 1);
+
+    objectCacheDirty = false;
+}
+
+bool Eluna::PushCachedObject(const void* obj, const char* tname)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, objectCacheRef);
+    lua_pushlightuserdata(L, const_cast<void*>(obj));
+    lua_rawget(L, -2);
+    // Stack: cache, userdata or nil
+
+    // The userdata is reused only for the same type and while the wrapper would still resolve to the object,
+    // an invalidated or expired wrapper gets replaced by the push that follows
+    ElunaObject* elunaObject = static_cast<ElunaObject*>(lua_touserdata(L, -1));
+    if (elunaObject && elunaObject->GetTypeName() == tname && elunaObject->GetObjIfValid() == obj)
+    {
+        lua_remove(L, -2);
+        // Stack: userdata
+        return true;
+    }
+
+    lua_pop(L, 2);
+    return false;
+}
+
+void Eluna::CacheObject(const void* obj)
+{
+    // Stack: userdata
+    lua_rawgeti(L, LUA_REGISTRYINDEX, objectCacheRef);
+    lua_pushlightuserdata(L, const_cast<void*>(obj));
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    // Stack: userdata
+
+    objectCacheDirty = true;
+}
+
+void Eluna::CreateIntegerCache()
+{
+    lua_newtable(L);
+    // Stack: cache
+
+    // Weak values, values no script holds on to are still collected
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+
+    integerCacheRef = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+template<typename T>
+void Eluna::PushInterned(T const& value, uint64 raw)
+{
+    // The key is the type index followed by the raw value, pushing an existing string does not allocate
+    char key[1 + sizeof(uint64)];
+    key[0] = static_cast<char>(ElunaTemplate<T>::GetTypeIndex());
+    memcpy(key + 1, &raw, sizeof(raw));
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, integerCacheRef);
+    lua_pushlstring(L, key, sizeof(key));
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    // Stack: cache, key, userdata or nil
+
+    if (!lua_isnil(L, -1))
+    {
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+        // Stack: userdata
+        return;
+    }
+    lua_pop(L, 1);
+
+    // the values are copied into the userdata, sharing it between pushes is safe
+    ElunaTemplate<T>::Push(this, &value);
+    lua_pushvalue(L, -1);
+    lua_insert(L, -4);
+    // Stack: userdata, cache, key, userdata
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    // Stack: userdata
+}
+
+void Eluna::ExecuteSQL(ElunaDatabase database, std::string sql)
+{
+    if (coalesceWrites)
+        pendingWrites[database].push_back(std::move(sql));
+    else
+        ElunaDB::Execute(database, sql);
+}
+
+void Eluna::FlushWrites()
+{
+    for (uint8 database = 0; database < pendingWrites.size(); ++database)
+        FlushWrites(ElunaDatabase(database));
+}
+
+void Eluna::FlushWrites(ElunaDatabase database)
+{
+    auto& writes = pendingWrites[database];
+    if (writes.empty())
+        return;
+
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+    // Committed on the worker's writer like the transactions of the scripts, the core's queue runs on another thread
+    // and would reorder them, so it is only used when the writer does not take the writes.
+    // The writer executes the statements one by one if the transaction is rolled back
+    bool retryStatements = writes.size() > 1;
+    if (!sElunaQueryWorker->EnqueueTransaction(nullptr, database, std::move(writes), LUA_NOREF, retryStatements))
+    {
+        if (writes.size() == 1)
+            ElunaDB::Execute(database, writes.front());
+        else
+            ElunaDB::CommitTransaction(database, writes);
+    }
+#else
+    // A single write does not need a transaction
+    if (writes.size() == 1)
+        ElunaDB::Execute(database, writes.front());
+    // The cores do not report the outcome of their commits in order with the later ones, a retry of a rolled back
+    // batch would land after newer writes, or never run once the state is gone. The batch is lost instead
+    else
+        ElunaDB::CommitTransaction(database, writes);
+#endif
+    writes.clear();
+}
+
 void Eluna::Report(lua_State* _L)
 {
     const char* msg = lua_tostring(_L, -1);
@@ -334,7 +797,15 @@ bool Eluna::ExecuteCall(int params, int res)
 
     // Objects are invalidated when event_level hits 0
     ++event_level;
+    // Nested calls count towards the budget of the handler that triggered them
+    bool watched = event_level == 1 && watchdog.IsEnabled() && watchdog.Arm(L, usetrace ? base + 1 : base, profiler.HasContext() ? &profiler.GetContext() : nullptr);
+    // Only Lua code of the outermost handler runs against the memory limit, nested handlers are called from core code
+    // where an allocation error would unwind through C++ frames
+    bool enforced = allocator.SetLimitEnforced(event_level == 1);
     int result = lua_pcall(L, params, res, usetrace ? base : 0);
+    allocator.SetLimitEnforced(enforced);
+    if (watched)
+        watchdog.Disarm(L);
     --event_level;
 
     if (usetrace)
@@ -351,8 +822,8 @@ bool Eluna::ExecuteCall(int params, int res)
         // Stack: errmsg
         Report(L);
 
-        // Force garbage collect
-        lua_gc(L, LUA_GCCOLLECT, 0);
+        // Collect what the failed handler left behind, rate limited so an error storm does not stall the map
+        garbageCollector.OnError(L);
 
         // Push nils for expected amount of results
         for (int i = 0; i < res; ++i)
@@ -371,11 +842,32 @@ void Eluna::Push()
 }
 void Eluna::Push(const long long l)
 {
+    if (compactIntegers)
+    {
+#if ELUNA_NATIVE_INTEGERS
+        lua_pushinteger(L, static_cast<lua_Integer>(l));
+#else
+        PushInterned(l, static_cast<uint64>(l));
+#endif
+        return;
+    }
+
     // pushing pointer to local is fine, a copy of value will be stored, not pointer itself
     ElunaTemplate<long long>::Push(this, &l);
 }
 void Eluna::Push(const unsigned long long l)
 {
+    if (compactIntegers)
+    {
+#if ELUNA_NATIVE_INTEGERS
+        // values above the signed range wrap around, CHECKVAL converts them back
+        lua_pushinteger(L, static_cast<lua_Integer>(l));
+#else
+        PushInterned(l, static_cast<uint64>(l));
+#endif
+        return;
+    }
+
     // pushing pointer to local is fine, a copy of value will be stored, not pointer itself
     ElunaTemplate<unsigned long long>::Push(this, &l);
 }
@@ -494,6 +986,16 @@ void Eluna::Push(Object const* obj)
 }
 void Eluna::Push(ObjectGuid const guid)
 {
+    if (compactIntegers)
+    {
+#if ELUNA_NATIVE_INTEGERS
+        lua_pushinteger(L, static_cast<lua_Integer>(guid.GetRawValue()));
+#else
+        PushInterned(guid, guid.GetRawValue());
+#endif
+        return;
+    }
+
     // pushing pointer to local is fine, a copy of value will be stored, not pointer itself
     ElunaTemplate<ObjectGuid>::Push(this, &guid);
 }
@@ -581,12 +1083,20 @@ template<> std::string Eluna::CHECKVAL<std::string>(int narg)
 }
 template<> long long Eluna::CHECKVAL<long long>(int narg)
 {
+#if ELUNA_NATIVE_INTEGERS
+    if (compactIntegers && lua_isinteger(L, narg))
+        return static_cast<long long>(lua_tointeger(L, narg));
+#endif
     if (lua_isnumber(L, narg))
         return static_cast<long long>(CHECKVAL<double>(narg));
     return *(Eluna::CHECKOBJ<long long>(narg, true));
 }
 template<> unsigned long long Eluna::CHECKVAL<unsigned long long>(int narg)
 {
+#if ELUNA_NATIVE_INTEGERS
+    if (compactIntegers && lua_isinteger(L, narg))
+        return static_cast<unsigned long long>(lua_tointeger(L, narg));
+#endif
     if (lua_isnumber(L, narg))
         return static_cast<unsigned long long>(CHECKVAL<uint32>(narg));
     return *(Eluna::CHECKOBJ<unsigned long long>(narg, true));
@@ -601,38 +1111,94 @@ template<> unsigned long Eluna::CHECKVAL<unsigned long>(int narg)
 }
 template<> ObjectGuid Eluna::CHECKVAL<ObjectGuid>(int narg)
 {
+#if ELUNA_NATIVE_INTEGERS
+    if (compactIntegers && lua_isinteger(L, narg))
+        return ObjectGuid(static_cast<uint64>(lua_tointeger(L, narg)));
+#endif
     ObjectGuid* guid = CHECKOBJ<ObjectGuid>(narg, true);
     return guid ? *guid : ObjectGuid();
 }
 
-template<> Object* Eluna::CHECKOBJ<Object>(int narg, bool error)
+typedef Object* (*ElunaObjectCast)(void*);
+
+template<typename T>
+static Object* CastToObject(void* obj)
 {
-    Object* obj = CHECKOBJ<WorldObject>(narg, false);
-    if (!obj)
-        obj = CHECKOBJ<Item>(narg, false);
+    return static_cast<T*>(obj);
+}
+
+// Casts the wrapped pointer of an Object type to Object, NULL for other types
+static ElunaObjectCast GetObjectCast(uint32 classId)
+{
+    // indexed by type index, the same as the class bits
+    static const std::array<ElunaObjectCast, 64> casts = []()
+    {
+        std::array<ElunaObjectCast, 64> casts = {};
+        auto add = [&casts](uint32 classId, ElunaObjectCast cast)
+        {
+            if (classId < casts.size())
+                casts[classId] = cast;
+        };
+
+        add(ElunaTemplate<Object>::GetTypeIndex(), &CastToObject<Object>);
+        add(ElunaTemplate<WorldObject>::GetTypeIndex(), &CastToObject<WorldObject>);
+        add(ElunaTemplate<Item>::GetTypeIndex(), &CastToObject<Item>);
+        add(ElunaTemplate<Unit>::GetTypeIndex(), &CastToObject<Unit>);
+        add(ElunaTemplate<GameObject>::GetTypeIndex(), &CastToObject<GameObject>);
+        add(ElunaTemplate<Corpse>::GetTypeIndex(), &CastToObject<Corpse>);
+        add(ElunaTemplate<Player>::GetTypeIndex(), &CastToObject<Player>);
+        add(ElunaTemplate<Creature>::GetTypeIndex(), &CastToObject<Creature>);
+        return casts;
+    }();
+
+    return classId < casts.size() ? casts[classId] : NULL;
+}
+
+template<typename T>
+T* Eluna::CheckDerivedObject(int narg, bool error)
+{
+    const char* tname = ElunaTemplate<T>::tname;
+
+    ElunaObject* elunaObj = CHECKTYPE(narg, NULL, false);
+    ElunaObjectCast cast = elunaObj && elunaObj->IsA(ElunaTemplate<T>::GetClassBit()) ? GetObjectCast(elunaObj->GetClassId()) : NULL;
+    if (!cast)
+    {
+        if (error)
+        {
+            char buff[256];
+            snprintf(buff, 256, "bad argument : %s expected, got %s", tname, elunaObj ? elunaObj->GetTypeName() : luaL_typename(L, narg));
+            luaL_argerror(L, narg, buff);
+        }
+        return NULL;
+    }
+
+    void* obj = elunaObj->GetObjIfValid();
     if (!obj)
-        obj = ElunaTemplate<Object>::Check(this, narg, error);
-    return obj;
+    {
+        char buff[256];
+        snprintf(buff, 256, "%s expected, got pointer to nonexisting (invalidated) object (%s). Check your code.", tname, elunaObj->GetTypeName());
+        if (error)
+            luaL_argerror(L, narg, buff);
+        else
+            ELUNA_LOG_ERROR("%s", buff);
+        return NULL;
+    }
+
+    // the ancestry test guarantees the Object is a T
+    return static_cast<T*>(cast(obj));
+}
+
+template<> Object* Eluna::CHECKOBJ<Object>(int narg, bool error)
+{
+    return CheckDerivedObject<Object>(narg, error);
 }
 template<> WorldObject* Eluna::CHECKOBJ<WorldObject>(int narg, bool error)
 {
-    WorldObject* obj = CHECKOBJ<Unit>(narg, false);
-    if (!obj)
-        obj = CHECKOBJ<GameObject>(narg, false);
-    if (!obj)
-        obj = CHECKOBJ<Corpse>(narg, false);
-    if (!obj)
-        obj = ElunaTemplate<WorldObject>::Check(this, narg, error);
-    return obj;
+    return CheckDerivedObject<WorldObject>(narg, error);
 }
 template<> Unit* Eluna::CHECKOBJ<Unit>(int narg, bool error)
 {
-    Unit* obj = CHECKOBJ<Player>(narg, false);
-    if (!obj)
-        obj = CHECKOBJ<Creature>(narg, false);
-    if (!obj)
-        obj = ElunaTemplate<Unit>::Check(this, narg, error);
-    return obj;
+    return CheckDerivedObject<Unit>(narg, error);
 }
 
 template<> ElunaObject* Eluna::CHECKOBJ<ElunaObject>(int narg, bool error)
@@ -691,12 +1257,12 @@ static void createCancelCallback(Eluna* e, uint64 bindingID, BindingMap<K>* bind
 }
 
 template<typename K>
-int RegisterBasicBinding(Eluna* e, std::underlying_type_t<Hooks::RegisterTypes> regtype, uint32 event_id, int functionRef, uint32 shots)
+int RegisterBasicBinding(Eluna* e, std::underlying_type_t<Hooks::RegisterTypes> regtype, uint32 event_id, int functionRef, uint32 shots, std::shared_ptr<const BindingFilter> filter = nullptr)
 {
     typedef EventKey<K> Key;
     auto binding = e->GetBinding<Key>(regtype);
     auto key = Key(static_cast<K>(event_id));
-    uint64 bindingID = binding->Insert(key, functionRef, shots);
+    uint64 bindingID = binding->Insert(key, functionRef, shots, std::move(filter));
     createCancelCallback(e, bindingID, binding);
     return 1; // Stack: callback
 }
@@ -724,13 +1290,38 @@ int RegisterUniqueBinding(Eluna* e, std::underlying_type_t<Hooks::RegisterTypes>
 }
 
 // Saves the function reference ID given to the register type's store for given entry under the given event
-int Eluna::Register(std::underlying_type_t<Hooks::RegisterTypes> regtype, uint32 entry, ObjectGuid guid, uint32 instanceId, uint32 event_id, int functionRef, uint32 shots)
+void Eluna::SetRefOwner(int functionRef)
 {
+    // the innermost script running its top level code, or else the outermost handler that is running
+    std::string owner;
+    lua_Debug ar;
+    for (int level = 0; lua_getstack(L, level, &ar); ++level)
+    {
+        lua_getinfo(L, "S", &ar);
+        if (!ar.source || ar.source[0] != '@')
+            continue;
+
+        owner = ar.source;
+        if (strcmp(ar.what, "main") == 0)
+            break;
+    }
+    refOwners[functionRef] = std::move(owner);
+}
+
+int Eluna::Register(std::underlying_type_t<Hooks::RegisterTypes> regtype, uint32 entry, ObjectGuid guid, uint32 instanceId, uint32 event_id, int functionRef, uint32 shots, std::shared_ptr<const BindingFilter> filter)
+{
+    SetRefOwner(functionRef);
+
     switch (regtype)
     {
         case Hooks::REGTYPE_SERVER:
             if (event_id < Hooks::SERVER_EVENT_COUNT)
-                return RegisterBasicBinding<Hooks::ServerEvents>(this, regtype, event_id, functionRef, shots);
+            {
+                int ref = RegisterBasicBinding<Hooks::ServerEvents>(this, regtype, event_id, functionRef, shots, std::move(filter));
+                if (event_id == Hooks::ELUNA_EVENT_ON_MESSAGE)
+                    SubscribeMessages();
+                return ref;
+            }
             break;
 
         case Hooks::REGTYPE_PLAYER:
@@ -893,16 +1484,46 @@ int Eluna::Register(std::underlying_type_t<Hooks::RegisterTypes> regtype, uint32
 
 void Eluna::UpdateEluna(uint32 diff)
 {
+    if (!boundMap)
+    {
+        sElunaLoader->OnWorldUpdate();
+        sElunaMgr->UpdateStatePools();
+    }
+
+    if (reload && !reloadQueued)
+    {
+        reloadPriority = !boundMap || boundMap->HavePlayers();
+        sElunaLoader->QueueStateReload(reloadPriority);
+        reloadQueued = true;
+    }
+
     if (reload && sElunaLoader->GetCacheState() == SCRIPT_CACHE_READY)
 #if defined ELUNA_TRINITY
-        if (GetQueryProcessor().Empty())
+        if (GetQueryProcessor().Empty() && GetTransactionProcessor().Empty())
 #endif
-            _ReloadEluna();
+            if (sElunaLoader->AcquireStateReload(reloadPriority))
+            {
+                uint32 oldMSTime = ElunaUtil::GetCurrTime();
+                _ReloadEluna();
+                reloadQueued = false;
+                sElunaLoader->ReleaseStateReload(reloadPriority, ElunaUtil::GetTimeDiff(oldMSTime));
+            }
+
+    if (!reload && scriptGeneration != sElunaLoader->GetScriptGeneration() && sElunaLoader->GetCacheState() == SCRIPT_CACHE_READY)
+        ReloadChangedScripts();
 
+    DeliverMessages();
     eventMgr->UpdateProcessors(diff);
 #if defined ELUNA_TRINITY
     GetQueryProcessor().ProcessReadyCallbacks();
+    GetTransactionProcessor().ProcessReadyCallbacks();
 #endif
+    DeliverAsyncQueries();
+
+    FlushWrites();
+
+    if (L)
+        garbageCollector.Update(L);
 }
 
 /*
@@ -915,10 +1536,16 @@ void Eluna::CleanUpStack(int number_of_arguments)
     lua_pop(L, number_of_arguments + 1); // Add 1 because the caller doesn't know about `event_id`.
     // Stack: (empty)
 
-#if !defined TRACKABLE_PTR_NAMESPACE
+    if (IsTrackingContext())
+        profiler.PopContext();
+
     if (event_level == 0)
+    {
+#if !defined TRACKABLE_PTR_NAMESPACE
         InvalidateObjects();
 #endif
+        ReleaseObjectCache();
+    }
 }
 
 /*
@@ -944,7 +1571,14 @@ int Eluna::CallOneFunction(int number_of_functions, int number_of_arguments, int
     }
     // Stack: event_id, [arguments], [functions], event_id, [arguments]
 
-    ExecuteCall(number_of_arguments, number_of_results);
+    if (profiler.IsEnabled())
+    {
+        ElunaProfiler::Sample sample = profiler.Begin(L, functions_top, profiler.GetContext());
+        ExecuteCall(number_of_arguments, number_of_results);
+        profiler.End(L, sample);
+    }
+    else
+        ExecuteCall(number_of_arguments, number_of_results);
     --functions_top;
     // Stack: event_id, [arguments], [functions - 1], [results]
 
@@ -955,6 +1589,9 @@ CreatureAI* Eluna::GetAI(Creature* creature)
 {
     for (int i = 1; i < Hooks::CREATURE_EVENT_COUNT; ++i)
     {
+        if (!HasEventBindings(Hooks::REGTYPE_CREATURE, i) && !HasEventBindings(Hooks::REGTYPE_CREATURE_UNIQUE, i))
+            continue;
+
         Hooks::CreatureEvents event_id = (Hooks::CreatureEvents)i;
 
         typedef EntryKey<Hooks::CreatureEvents> EKey;
@@ -978,6 +1615,9 @@ InstanceData* Eluna::GetInstanceData(Map* map)
 {
     for (int i = 1; i < Hooks::INSTANCE_EVENT_COUNT; ++i)
     {
+        if (!HasEventBindings(Hooks::REGTYPE_MAP, i) && !HasEventBindings(Hooks::REGTYPE_INSTANCE, i))
+            continue;
+
         Hooks::InstanceEvents event_id = (Hooks::InstanceEvents)i;
 
         typedef EntryKey<Hooks::InstanceEvents> Key;
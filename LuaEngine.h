@@ -36,13 +36,23 @@
 #include "Entities/Player.h"
 #endif
 
+#include <array>
 #include <mutex>
 #include <memory>
+#include <optional>
 #include "ElunaSpellWrapper.h"
+#include "ElunaStatement.h"
+#include "ElunaAllocator.h"
+#include "ElunaGarbageCollector.h"
+#include "ElunaProfiler.h"
+#include "ElunaWatchdog.h"
 
 extern "C"
 {
 #include "lua.h"
+#if __has_include(<luajit.h>)
+#include <luajit.h>
+#endif
 };
 
 class AuctionHouseObject;
@@ -112,10 +122,15 @@ typedef VehicleInfo Vehicle;
 struct lua_State;
 class EventMgr;
 class ElunaObject;
+template<typename T> class ElunaObjectImpl;
 class BaseBindingMap;
 template<typename T> class ElunaTemplate;
 
 template<typename K> class BindingMap;
+class BindingFilter;
+class ElunaMailbox;
+class ElunaAsyncQueries;
+struct ElunaMessage;
 template<typename T> struct EventKey;
 template<typename T> struct EntryKey;
 template<typename T> struct UniqueObjectKey;
@@ -126,7 +141,8 @@ struct LuaScript
     std::string filename;
     std::string filepath;
     std::string modulepath;
-    BytecodeBuffer bytecode;
+    // Replaced as a whole when the script is recompiled, read it with std::atomic_load while states run
+    std::shared_ptr<const BytecodeBuffer> bytecode;
     int32 mapId;
 };
 
@@ -142,11 +158,26 @@ enum MethodFlags : uint32
 {
     METHOD_FLAG_NONE = 0x0,
     METHOD_FLAG_UNSAFE = 0x1,
-    METHOD_FLAG_DEPRECATED = 0x2
+    METHOD_FLAG_DEPRECATED = 0x2,
+    METHOD_FLAG_READ_ONLY = 0x4 // Does not modify the object, borrowed objects are not copied for it
 };
 
 #define ELUNA_STATE_PTR "Eluna State Ptr"
 
+// LuaJIT reports itself as 5.1, so only PUC Lua 5.3+ has lua_getextraspace
+#if LUA_VERSION_NUM >= 503 && !defined LUAJIT_VERSION
+#define ELUNA_STATE_EXTRASPACE 1
+#else
+#define ELUNA_STATE_EXTRASPACE 0
+#endif
+
+// Integers of PUC Lua 5.3+ are 64-bit, with Eluna.CompactIntegers 64-bit values and guids are pushed as integers
+#if LUA_VERSION_NUM >= 503 && !defined LUAJIT_VERSION
+#define ELUNA_NATIVE_INTEGERS 1
+#else
+#define ELUNA_NATIVE_INTEGERS 0
+#endif
+
 #if defined ELUNA_TRINITY
 #define ELUNA_GAME_API TC_GAME_API
 #define TRACKABLE_PTR_NAMESPACE ::Trinity::
@@ -170,6 +201,14 @@ private:
 
     // Indicates that the lua state should be reloaded
     bool reload = false;
+    // The reload is queued with the loader, see ElunaLoader::QueueStateReload
+    bool reloadQueued = false;
+    bool reloadPriority = false;
+
+#if !ELUNA_STATE_EXTRASPACE
+    // Address used as a registry key for the Eluna pointer, avoids hashing a string key on lookup
+    static char stateKey;
+#endif
 
 #if !defined TRACKABLE_PTR_NAMESPACE
     // A counter for lua event stacks that occur (see event_level).
@@ -186,7 +225,9 @@ private:
     //  this is used to keep track of how many arguments were pushed.
     uint8 push_counter;
 
-    Map* const boundMap;
+    Map* boundMap;
+    // Map ID of the state, also known for pooled states that are not bound to a map yet
+    int32 boundMapId;
 
     // Map from instance ID -> Lua table ref
     std::unordered_map<uint32, int> instanceDataRefs;
@@ -194,14 +235,51 @@ private:
     std::unordered_map<uint32, int> continentDataRefs;
 
     std::array<std::unique_ptr<BaseBindingMap>, Hooks::REGTYPE_COUNT> bindingMaps;
+    // Per register type bitsets of event IDs with any binding, kept up to date by the binding maps
+    std::array<Hooks::EventBindingMask, Hooks::REGTYPE_COUNT> eventBindingMasks;
 
     template<typename T>
     void CreateBinding(Hooks::RegisterTypes type)
     {
         auto index = static_cast<std::underlying_type_t<Hooks::RegisterTypes>>(type);
-        bindingMaps[index] = std::make_unique<BindingMap<T>>(L);
+        bindingMaps[index] = std::make_unique<BindingMap<T>>(L, eventBindingMasks[index]);
+    }
+
+    // Cheap check for hooks to bail out before building keys when no script registered the event at all
+    bool HasEventBindings(Hooks::RegisterTypes type, uint32 event_id) const
+    {
+        return eventBindingMasks[type][event_id];
     }
 
+    // Pool allocator of the Lua state, must outlive it
+    ElunaAllocator allocator;
+
+    // Handler timings, only collected when Eluna.Profiler is enabled
+    ElunaProfiler profiler;
+    ElunaGarbageCollector garbageCollector;
+    ElunaWatchdog watchdog;
+    // The profiler keeps the hook of the running handlers for both itself and the watchdog
+    bool IsTrackingContext() const { return profiler.IsEnabled() || watchdog.IsEnabled(); }
+    uint8 GetRegisterType(const BaseBindingMap* bindings) const;
+
+    // Registry refs of the metatables registered with ElunaTemplate, indexed by ElunaTemplate<T>::GetTypeIndex
+    std::vector<int> metatableRefs;
+
+    // Registry ref of a weak valued table of object pointer -> userdata pushed during the current event stack.
+    // Only created when Eluna.ObjectCache is enabled and emptied whenever the event stack ends.
+    bool objectCacheEnabled = false;
+    bool objectCacheDirty = false;
+    int objectCacheRef = 0;
+    void CreateObjectCache();
+    void ReleaseObjectCache();
+
+    // Eluna.CompactIntegers, see ELUNA_NATIVE_INTEGERS. Without native integers 64-bit values and guids
+    // are interned in a weak valued table of type and value -> userdata, so pushing the same value again allocates nothing
+    bool compactIntegers = false;
+    int integerCacheRef = 0;
+    void CreateIntegerCache();
+    template<typename T> void PushInterned(T const& value, uint64 raw);
+
     void OpenLua();
     void CloseLua();
     void DestroyBindStores();
@@ -215,9 +293,35 @@ private:
     // This is called on world update to reload eluna
     void _ReloadEluna();
 
+    // Generation of the script cache the state runs, see ElunaLoader::ReloadScriptFile
+    uint32 scriptGeneration = 0;
+    // Set once RunScripts reported scriptGeneration to the loader
+    bool scriptGenerationTracked = false;
+    // Reloads the scripts recompiled since scriptGeneration, called on world update like _ReloadEluna
+    void ReloadChangedScripts();
+    void ReloadScript(const std::string& filename, const std::string& filepath);
+    // Chunk name of the script that registered each binding and timed event function, by function ref.
+    // Refs are reused once released, registering them again overwrites the stale owner
+    std::unordered_map<int, std::string> refOwners;
+
+    // Messages published to this state by other states, null until the state registers a message handler,
+    // while pooled or when the bus is disabled
+    std::shared_ptr<ElunaMailbox> mailbox;
+    // Subscribes once the state is bound and has a message handler, no-op otherwise
+    void SubscribeMessages();
+    // Calls the message handlers for the messages queued before this update, called on update
+    void DeliverMessages();
+
+    // Queries of this state running on ElunaQueryWorker, replaced when they are cancelled
+    std::shared_ptr<ElunaAsyncQueries> asyncQueries;
+    // Calls the callbacks of the finished async queries, called on update
+    void DeliverAsyncQueries();
+    // Drops the queued and finished async queries, called before the Lua state closes
+    void CancelAsyncQueries();
+
     // Some helpers for hooks to call event handlers.
     // The bodies of the templates are in HookHelpers.h, so if you want to use them you need to #include "HookHelpers.h".
-    template<typename K1, typename K2> int SetupStack(BindingMap<K1>* bindings1, BindingMap<K2>* bindings2, const K1& key1, const K2& key2, int number_of_arguments);
+    template<typename K1, typename K2> int SetupStack(BindingMap<K1>* bindings1, BindingMap<K2>* bindings2, const K1& key1, const K2& key2, int number_of_arguments, std::optional<uint32> filterValue = std::nullopt);
                                        int CallOneFunction(int number_of_functions, int number_of_arguments, int number_of_results);
                                        void CleanUpStack(int number_of_arguments);
     template<typename T>               void ReplaceArgument(T value, int index);
@@ -229,9 +333,9 @@ private:
     template<typename K1, typename K2, typename T>
     void CallAllFunctionsTable(BindingMap<K1>* bindings1, BindingMap<K2>* bindings2, const K1& key1, const K2& key2, std::list<T*>& list);   // Same as above but for only one binding instead of two.
     // `key` is passed twice because there's no NULL for references, but it's not actually used if `bindings2` is NULL.
-    template<typename K> int SetupStack(BindingMap<K>* bindings, const K& key, int number_of_arguments)
+    template<typename K> int SetupStack(BindingMap<K>* bindings, const K& key, int number_of_arguments, std::optional<uint32> filterValue = std::nullopt)
     {
-        return SetupStack<K, K>(bindings, NULL, key, key, number_of_arguments);
+        return SetupStack<K, K>(bindings, NULL, key, key, number_of_arguments, filterValue);
     }
     template<typename K> void CallAllFunctions(BindingMap<K>* bindings, const K& key)
     {
@@ -271,10 +375,19 @@ private:
     void HookPush(ObjectGuid const value)           { Push(value); ++push_counter; }
     template<typename T>
     void HookPush(T const* ptr)                     { Push(ptr); ++push_counter; }
+    // Pushes a view of the hook's packet instead of a copy, ReleaseView must be called on it before CleanUpStack
+    ElunaObjectImpl<WorldPacket>* HookPushPacket(WorldPacket const& packet);
 
 #if defined ELUNA_TRINITY || defined ELUNA_AZEROTHCORE
     QueryCallbackProcessor queryProcessor;
 #endif
+#if defined ELUNA_TRINITY
+    AsyncCallbackProcessor<TransactionCallback> transactionProcessor;
+#endif
+
+    // Writes buffered until the end of the update when Eluna.CoalesceWrites is enabled, indexed by ElunaDatabase
+    std::array<std::vector<std::string>, ELUNA_DB_AUTH + 1> pendingWrites;
+    bool coalesceWrites = false;
 public:
 
     lua_State* L;
@@ -283,18 +396,59 @@ public:
 #if defined ELUNA_TRINITY || defined ELUNA_AZEROTHCORE
     QueryCallbackProcessor& GetQueryProcessor() { return queryProcessor; }
 #endif
+#if defined ELUNA_TRINITY
+    AsyncCallbackProcessor<TransactionCallback>& GetTransactionProcessor() { return transactionProcessor; }
+#endif
+
+    // Executes `sql` right away, or with the other writes of this update when coalescing
+    void ExecuteSQL(ElunaDatabase database, std::string sql);
+    // Commits the coalesced writes, one transaction per database. If it is rolled back the writes are
+    // executed one by one on the Mangos-family cores, on TrinityCore and AzerothCore they are lost
+    void FlushWrites();
+    // Commits the coalesced writes of `database` only, before a script's own transaction so they keep their order
+    void FlushWrites(ElunaDatabase database);
+    ElunaProfiler& GetProfiler() { return profiler; }
+    const ElunaGarbageCollector& GetGarbageCollector() const { return garbageCollector; }
+    // Pooled states are not updated, so their paced collector is run once they are built
+    void CollectGarbage() { if (L) garbageCollector.Collect(L); }
+    ElunaWatchdog& GetWatchdog() { return watchdog; }
+
+    // Used by ElunaTemplate<T>::Register and Push
+    void SetMetatableRef(uint32 typeIndex, int ref);
+    bool PushMetatable(uint32 typeIndex)
+    {
+        if (typeIndex >= metatableRefs.size())
+            return false;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, metatableRefs[typeIndex]);
+        return true;
+    }
+    bool IsObjectCacheEnabled() const { return objectCacheEnabled; }
+    // Pushes the userdata cached for `obj` if it is still valid and of the same type, otherwise pushes nothing and returns false
+    bool PushCachedObject(const void* obj, const char* tname);
+    // Caches the userdata on top of the stack for `obj`
+    void CacheObject(const void* obj);
+    const ElunaAllocator& GetAllocator() const { return allocator; }
+    // Returns the previous value, see ElunaAllocator::SetLimitEnforced
+    bool SetMemoryLimitEnforced(bool enforce) { return allocator.SetLimitEnforced(enforce); }
 
     static int StackTrace(lua_State* _L);
     static void Report(lua_State* _L);
 
     // Never returns nullptr
+    // Method thunks and metamethods get the owning Eluna as an upvalue (see ElunaTemplate),
+    // this is only the fallback for other C functions called from Lua.
     static Eluna* GetEluna(lua_State* L)
     {
-        lua_pushstring(L, ELUNA_STATE_PTR);
+#if ELUNA_STATE_EXTRASPACE
+        // Lua 5.3+ copies the main thread's extra space into every coroutine
+        Eluna* E = *static_cast<Eluna**>(lua_getextraspace(L));
+#else
+        lua_pushlightuserdata(L, &stateKey);
         lua_rawget(L, LUA_REGISTRYINDEX);
         ASSERT(lua_islightuserdata(L, -1));
         Eluna* E = static_cast<Eluna*>(lua_touserdata(L, -1));
         lua_pop(L, 1);
+#endif
         ASSERT(E);
         return E;
     }
@@ -353,7 +507,10 @@ public:
 #if !defined TRACKABLE_PTR_NAMESPACE
     uint64 GetCallstackId() const { return callstackid; }
 #endif
-    int Register(std::underlying_type_t<Hooks::RegisterTypes> regtype, uint32 entry, ObjectGuid guid, uint32 instanceId, uint32 event_id, int functionRef, uint32 shots);
+    // A `filter` is only used by server events, see BindingFilter
+    // Records the script registering `functionRef`, whose reload replaces the binding or timed event
+    void SetRefOwner(int functionRef);
+    int Register(std::underlying_type_t<Hooks::RegisterTypes> regtype, uint32 entry, ObjectGuid guid, uint32 instanceId, uint32 event_id, int functionRef, uint32 shots, std::shared_ptr<const BindingFilter> filter = nullptr);
     void UpdateEluna(uint32 diff);
 
     // Checks
@@ -367,6 +524,8 @@ public:
         return ElunaTemplate<T>::Check(this, narg, error);
     }
     ElunaObject* CHECKTYPE(int narg, const char* tname, bool error = true);
+    // CHECKOBJ for base types, accepts objects of T and of every type derived from it
+    template<typename T> T* CheckDerivedObject(int narg, bool error);
 
     CreatureAI* GetAI(Creature* creature);
     InstanceData* GetInstanceData(Map* map);
@@ -374,13 +533,7 @@ public:
 
     Map* GetBoundMap() const { return boundMap; }
 
-    int32 GetBoundMapId() const
-    {
-        if(const Map * map = GetBoundMap())
-            return map->GetId();
-
-        return -1;
-    }
+    int32 GetBoundMapId() const { return boundMapId; }
 
     uint32 GetBoundInstanceId() const
     {
@@ -410,8 +563,32 @@ public:
     }
 
     Eluna(Map * map);
+    // Creates a state for `mapId` that is bound to a map later, see ElunaMgr state pools
+    Eluna(Map* map, int32 mapId);
     ~Eluna();
 
+    // Pooled states run their scripts before a map exists, OnLuaStateOpen is deferred until they are bound
+    bool IsPooled() const { return !boundMap && boundMapId != -1; }
+    void BindMap(Map* map);
+    // Closes the Lua state of a pooled or unloading instance state so it can be rebuilt with RebuildPooledState
+    void UnbindMap();
+    void RebuildPooledState();
+
+    // Encodes the value at `payloadIndex` and queues it for the states of `mapId`, -1 being the world state, see ElunaMessageBus
+    // Raises a Lua error if the payload can not be encoded, callers must not hold C++ objects
+    uint32 PublishMessage(int32 mapId, uint32 instanceId, const char* topic, int payloadIndex);
+    const ElunaMailbox* GetMailbox() const { return mailbox.get(); }
+
+    // Runs `sql` on ElunaQueryWorker and calls the function of `funcRef` with the result on a later update.
+    // Returns false if the worker's queue is full, `funcRef` is not released then.
+    bool QueueAsyncQuery(ElunaDatabase database, std::string sql, int funcRef, ElunaStatement statement = nullptr);
+#if !defined ELUNA_TRINITY && !defined ELUNA_AZEROTHCORE
+    // Commits `statements` on ElunaQueryWorker, in order with the coalesced writes, and calls the function of `funcRef`
+    // with the outcome on a later update unless it is LUA_NOREF.
+    // Returns false if the worker's queue is full, `funcRef` and `statements` are not released then.
+    bool QueueAsyncCommit(ElunaDatabase database, std::vector<std::string>&& statements, int funcRef);
+#endif
+
     // Prevent copy
     Eluna(Eluna const&) = delete;
     Eluna& operator=(const Eluna&) = delete;
@@ -434,6 +611,7 @@ public:
     InventoryResult OnCanUseItem(const Player* pPlayer, uint32 itemEntry);
     void OnLuaStateClose();
     void OnLuaStateOpen();
+    void OnMessage(const ElunaMessage& message);
     bool OnAddonMessage(Player* sender, uint32 type, std::string& msg, Player* receiver, Guild* guild, Group* group, Channel* channel);
     bool OnTradeInit(Player* trader, Player* tradee);
     bool OnTradeAccept(Player* trader, Player* tradee);
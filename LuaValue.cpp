@@ -29,6 +29,9 @@
 
 #include "ElunaCompat.h"
 #include "LuaValue.h"
+#include <algorithm> // std::max
+#include <mutex> // std::unique_lock
+#include <shared_mutex> // std::shared_mutex, std::shared_lock
 #include <stdio.h> // snprintf
 
 extern "C"
@@ -38,6 +41,184 @@ extern "C"
 #include "lauxlib.h"
 }
 
+static std::shared_mutex& GetTableLock(const LuaValTable* table)
+{
+    static std::shared_mutex locks[64];
+    return locks[(reinterpret_cast<uintptr_t>(table) / sizeof(LuaValTable)) % 64];
+}
+
+static size_t HashSlot(LuaVal const& key)
+{
+    // Fibonacci hashing spreads sequential integer keys over the table
+    return static_cast<size_t>(static_cast<uint64_t>(LuaValHash(key)) * 0x9E3779B97F4A7C15ULL >> 16);
+}
+
+LuaValTable::LuaValTable(std::initializer_list<value_type> const& l) : count(0) {
+    for (value_type const& pair : l)
+        RawSet(pair.first, pair.second);
+}
+
+LuaValTable::LuaValTable(LuaValTable const& b) : count(0) {
+    std::shared_lock<std::shared_mutex> guard(GetTableLock(&b));
+    array = b.array;
+    slots = b.slots;
+    count = b.count;
+}
+
+LuaVal LuaValTable::Get(LuaVal const& key) const {
+    std::shared_lock<std::shared_mutex> guard(GetTableLock(this));
+    const LuaVal* value = RawFind(key);
+    return value ? *value : LuaVal();
+}
+
+void LuaValTable::Set(LuaVal const& key, LuaVal value) {
+    std::unique_lock<std::shared_mutex> guard(GetTableLock(this));
+    RawSet(key, std::move(value));
+}
+
+std::vector<std::pair<LuaVal, LuaVal>> LuaValTable::Entries() const {
+    std::shared_lock<std::shared_mutex> guard(GetTableLock(this));
+    std::vector<std::pair<LuaVal, LuaVal>> entries;
+    entries.reserve(array.size() + count);
+    for (size_t i = 0; i < array.size(); ++i)
+        if (!array[i].IsNil())
+            entries.emplace_back(LuaVal(static_cast<int64_t>(i + 1)), array[i]);
+    for (Slot const& slot : slots)
+        if (!slot.key.IsNil())
+            entries.emplace_back(slot.key, slot.value);
+    return entries;
+}
+
+size_t LuaValTable::FindSlot(LuaVal const& key) const {
+    size_t mask = slots.size() - 1;
+    size_t pos = HashSlot(key) & mask;
+    while (!slots[pos].key.IsNil() && !(slots[pos].key == key))
+        pos = (pos + 1) & mask;
+    return pos;
+}
+
+const LuaVal* LuaValTable::RawFind(LuaVal const& key) const {
+    if (const int64_t* index = std::get_if<int64_t>(&key.v))
+        if (*index >= 1 && static_cast<uint64_t>(*index) <= array.size())
+            return &array[*index - 1];
+
+    if (slots.empty())
+        return nullptr;
+
+    size_t pos = FindSlot(key);
+    return slots[pos].key.IsNil() ? nullptr : &slots[pos].value;
+}
+
+void LuaValTable::RawSet(LuaVal const& key, LuaVal value) {
+    // The hash part never holds keys 1..array.size() + 1, so the array part grows by appending
+    if (const int64_t* index = std::get_if<int64_t>(&key.v)) {
+        if (*index >= 1 && static_cast<uint64_t>(*index) <= array.size()) {
+            array[*index - 1] = std::move(value);
+            while (!array.empty() && array.back().IsNil())
+                array.pop_back();
+            return;
+        }
+
+        if (*index >= 1 && static_cast<uint64_t>(*index) == array.size() + 1 && !value.IsNil()) {
+            array.push_back(std::move(value));
+            // move the keys that now follow the array part out of the hash part
+            while (!slots.empty()) {
+                LuaVal next(static_cast<int64_t>(array.size() + 1));
+                size_t pos = FindSlot(next);
+                if (slots[pos].key.IsNil())
+                    break;
+                array.push_back(std::move(slots[pos].value));
+                HashErase(next);
+            }
+            return;
+        }
+    }
+
+    if (value.IsNil())
+        HashErase(key);
+    else
+        HashInsert(key, std::move(value));
+}
+
+void LuaValTable::HashInsert(LuaVal const& key, LuaVal value) {
+    if (!slots.empty()) {
+        size_t pos = FindSlot(key);
+        if (!slots[pos].key.IsNil()) {
+            slots[pos].value = std::move(value);
+            return;
+        }
+    }
+
+    // keep the load factor at or below 3/4
+    if ((count + 1) * 4 > slots.size() * 3)
+        Rehash(std::max(MIN_TABLE_SIZE, slots.size() * 2));
+
+    size_t pos = FindSlot(key);
+    slots[pos].key = key;
+    slots[pos].value = std::move(value);
+    ++count;
+}
+
+void LuaValTable::HashErase(LuaVal const& key) {
+    if (slots.empty())
+        return;
+
+    size_t pos = FindSlot(key);
+    if (slots[pos].key.IsNil())
+        return;
+
+    // backward shift deletion, no tombstones are needed
+    size_t mask = slots.size() - 1;
+    size_t hole = pos;
+    size_t next = (hole + 1) & mask;
+    while (!slots[next].key.IsNil()) {
+        size_t ideal = HashSlot(slots[next].key) & mask;
+        // move the entry into the hole if its ideal slot is not in (hole, next]
+        if (((next - ideal) & mask) >= ((next - hole) & mask)) {
+            slots[hole] = std::move(slots[next]);
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    slots[hole] = Slot();
+    --count;
+}
+
+void LuaValTable::Rehash(size_t newSize) {
+    std::vector<Slot> old(newSize);
+    old.swap(slots);
+    for (Slot& slot : old)
+        if (!slot.key.IsNil())
+            slots[FindSlot(slot.key)] = std::move(slot);
+}
+
+LuaVal::LuaVal(MapType const& t) : v(std::make_shared<MapType>(t)) {
+}
+
+LuaVal::LuaVal(std::initializer_list<std::pair<const LuaVal, LuaVal>> const& l) : v(std::make_shared<MapType>(l)) {
+}
+
+LuaVal LuaVal::clone() const {
+    if (WrappedMap const* p = std::get_if<WrappedMap>(&v)) {
+        LuaVal lv;
+        lv.v = std::make_shared<MapType>(**p);
+        return lv;
+    }
+    return *this;
+}
+
+bool LuaVal::operator<(LuaVal const& b) const {
+    if (IsString() && b.IsString())
+        return AsStringView() < b.AsStringView();
+    return v < b.v;
+}
+
+bool LuaVal::operator==(LuaVal const& b) const {
+    if (IsString() && b.IsString())
+        return AsStringView() == b.AsStringView();
+    return v == b.v;
+}
+
 LuaVal* LuaVal::GetLuaVal(lua_State* L, int index) {
     return static_cast<LuaVal*>(luaL_testudata(L, index, LUAVAL_MT_NAME));
 }
@@ -47,13 +228,42 @@ LuaVal* LuaVal::GetCheckLuaVal(lua_State* L, int index) {
 }
 
 int LuaVal::PushLuaVal(lua_State* L, LuaVal const& lv) {
+    WrappedMap const* table = std::get_if<WrappedMap>(&lv.v);
+    if (table) {
+        lua_getfield(L, LUA_REGISTRYINDEX, LUAVAL_CACHE_NAME);
+        lua_pushlightuserdata(L, table->get());
+        lua_rawget(L, -2);
+        // cache, userdata or nil
+        if (!lua_isnil(L, -1)) {
+            lua_remove(L, -2);
+            return 1;
+        }
+        lua_pop(L, 1);
+    }
+
     LuaVal* ud = static_cast<LuaVal*>(lua_newuserdata(L, sizeof(LuaVal)));
     new (ud) LuaVal(lv.reference());
     luaL_setmetatable(L, LUAVAL_MT_NAME);
+
+    if (table) {
+        // cache, userdata
+        lua_pushlightuserdata(L, table->get());
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+        lua_remove(L, -2);
+    }
     return 1;
 }
 
 void LuaVal::Register(lua_State* L) {
+    // table -> userdata, weak valued so the userdata can still be collected
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUAVAL_CACHE_NAME);
+
     luaL_newmetatable(L, LUAVAL_MT_NAME);
     // mt
 
@@ -82,25 +292,21 @@ int LuaVal::lua_get(lua_State* L) {
     WrappedMap const* p = std::get_if<WrappedMap>(&self->v);
     if (!p)
         luaL_argerror(L, 1, "trying to index a non-table LuaVal");
+    // nested tables are held by value, so a table removed meanwhile stays valid
+    WrappedMap map = *p;
     for (int i = 2; i <= arguments; ++i) {
-        auto& map = (*p);
-        auto klv = AsLuaVal(L, i);
-        if (std::holds_alternative<NIL>(klv.v))
+        auto klv = AsKey(L, i);
+        if (klv.IsNil())
             luaL_argerror(L, i, "trying to use nil as key");
-        auto it = map->find(klv);
-        if (it == map->end()) {
-            if (i < arguments) {
-                luaL_argerror(L, i, "trying to index a nil value within a LuaVal");
-            }
-            break;
-        }
-        else if (i == arguments) {
-            auto& val = it->second;
+        LuaVal val = map->Get(klv);
+        if (i == arguments)
             return val.asObject(L);
-        }
-        p = std::get_if<WrappedMap>(&it->second.v);
+        if (val.IsNil())
+            luaL_argerror(L, i, "trying to index a nil value within a LuaVal");
+        p = std::get_if<WrappedMap>(&val.v);
         if (!p)
             luaL_argerror(L, i, "trying to index a non-table LuaVal");
+        map = *p;
     }
     lua_pushnil(L);
     return 1;
@@ -112,40 +318,33 @@ int LuaVal::lua_set(lua_State* L) {
     WrappedMap const* p = std::get_if<WrappedMap>(&self->v);
     if (!p)
         luaL_argerror(L, 1, "trying to index a non-table LuaVal");
+    WrappedMap map = *p;
     for (int i = 2; i <= arguments - 2; ++i) {
-        auto& map = (*p);
-        auto klv = AsLuaVal(L, i);
-        if (std::holds_alternative<NIL>(klv.v))
+        auto klv = AsKey(L, i);
+        if (klv.IsNil())
             luaL_argerror(L, i, "trying to use nil as key");
-        auto it = map->find(klv);
-        if (it == map->end()) {
-            if (i < arguments) {
-                luaL_argerror(L, i, "trying to index a nil value within a LuaVal");
-            }
-            break;
-        }
-        p = std::get_if<WrappedMap>(&it->second.v);
+        LuaVal val = map->Get(klv);
+        if (val.IsNil())
+            luaL_argerror(L, i, "trying to index a nil value within a LuaVal");
+        p = std::get_if<WrappedMap>(&val.v);
         if (!p)
             luaL_argerror(L, i, "trying to index a non-table LuaVal");
+        map = *p;
     }
-    auto kk = AsLuaVal(L, arguments - 1);
+    auto kk = AsKey(L, arguments - 1);
     auto vv = AsLuaVal(L, arguments);
-    if (std::holds_alternative<NIL>(kk.v))
+    if (kk.IsNil())
         luaL_argerror(L, arguments - 1, "trying to use nil as key");
-    if (std::holds_alternative<NIL>(vv.v)) {
-        (**p).erase(kk);
-    }
-    else {
-        auto const& [it, _] = (**p).insert_or_assign(std::move(kk), std::move(vv));
-        return it->second.asObject(L);
-    }
-    return 0;
+    map->Set(kk, vv);
+    if (vv.IsNil())
+        return 0;
+    return vv.asObject(L);
 }
 
 std::string LuaVal::to_string_map(MapType const* ptr)
 {
     std::string out = "[\n";
-    for (std::pair<const LuaVal, LuaVal> const& pair : *ptr)
+    for (auto const& pair : ptr->Entries())
         out += "  { key: " + pair.first.to_string() + ", value: " + pair.second.to_string() + " },\n";
     out += ']';
     return out;
@@ -174,8 +373,9 @@ int LuaVal::asObject(lua_State* L) const
             lua_pushnil(L);
             return 1;
         }
-        else if constexpr (std::is_same_v<T, std::string>) {
-            lua_pushlstring(L, arg.c_str(), arg.size());
+        else if constexpr (std::is_same_v<T, LuaValSmallString> || std::is_same_v<T, SharedString>) {
+            std::string_view str = AsStringView();
+            lua_pushlstring(L, str.data(), str.size());
             return 1;
         }
         else if constexpr (std::is_same_v<T, WrappedMap>) {
@@ -185,6 +385,14 @@ int LuaVal::asObject(lua_State* L) const
             lua_pushboolean(L, arg);
             return 1;
         }
+        else if constexpr (std::is_same_v<T, int64_t>) {
+#if LUA_VERSION_NUM >= 503
+            lua_pushinteger(L, static_cast<lua_Integer>(arg));
+#else
+            lua_pushnumber(L, static_cast<lua_Number>(arg));
+#endif
+            return 1;
+        }
         else if constexpr (std::is_same_v<T, double>) {
             lua_pushnumber(L, arg);
             return 1;
@@ -200,8 +408,10 @@ int LuaVal::asLua(lua_State* L, unsigned int depth) const
     WrappedMap const* p = std::get_if<WrappedMap>(&v);
     if (p)
     {
-        lua_newtable(L);
-        for (auto& it : **p) {
+        // the entries are copied, so nested tables are not converted while this one is locked
+        auto entries = (*p)->Entries();
+        lua_createtable(L, 0, static_cast<int>(entries.size()));
+        for (auto& it : entries) {
             if (depth == 1) {
                 it.first.asObject(L);
                 it.second.asObject(L);
@@ -240,11 +450,15 @@ LuaVal LuaVal::AsLuaVal(lua_State* L, int index)
     case LUA_TNIL:
         return LuaVal();
     case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, index))
+            return LuaVal(static_cast<int64_t>(lua_tointeger(L, index)));
+#endif
         return LuaVal(lua_tonumber(L, index));
     case LUA_TSTRING: {
         size_t len;
         const char* str = lua_tolstring(L, index, &len);
-        return LuaVal(std::string(str, len));
+        return LuaVal(str, len);
     }
     case LUA_TTABLE:
         return FromTable(L, index);
@@ -257,6 +471,16 @@ LuaVal LuaVal::AsLuaVal(lua_State* L, int index)
     return LuaVal();
 }
 
+LuaVal LuaVal::AsKey(lua_State* L, int index)
+{
+    LuaVal key = AsLuaVal(L, index);
+    // 2 and 2.0 are the same key, like in Lua tables
+    if (double const* d = std::get_if<double>(&key.v))
+        if (*d >= -9223372036854775808.0 && *d < 9223372036854775808.0 && static_cast<double>(static_cast<int64_t>(*d)) == *d)
+            return LuaVal(static_cast<int64_t>(*d));
+    return key;
+}
+
 int LuaVal::lua_AsLuaVal(lua_State* L)
 {
     return PushLuaVal(L, AsLuaVal(L, 1));
@@ -265,18 +489,29 @@ int LuaVal::lua_AsLuaVal(lua_State* L)
 LuaVal LuaVal::FromTable(lua_State* L, int index)
 {
     // Assumed we know index is a table already
-    LuaVal m({});
-    auto& t = std::get<WrappedMap>(m.v);
+    auto t = std::make_shared<MapType>();
+    index = lua_absindex(L, index);
     int top = lua_gettop(L);
     lua_pushnil(L);
     while (lua_next(L, index) != 0) {
-        t->emplace(AsLuaVal(L, top + 1), AsLuaVal(L, top + 2));
+        // the table is not shared yet, no need to lock it
+        t->RawSet(AsKey(L, top + 1), AsLuaVal(L, top + 2));
         lua_pop(L, 1);
     }
+    LuaVal m;
+    m.v = std::move(t);
     return m;
 }
 
 size_t LuaValHash(LuaVal const& k)
 {
-    return std::hash<LuaVal::LuaValVariant>{}(k.v);
+    return std::visit([&](auto&& arg) -> size_t {
+        using T = std::decay_t<decltype(arg)>;
+        if constexpr (std::is_same_v<T, LuaVal::NIL>)
+            return 0;
+        else if constexpr (std::is_same_v<T, LuaValSmallString> || std::is_same_v<T, LuaVal::SharedString>)
+            return std::hash<std::string_view>()(k.AsStringView());
+        else
+            return std::hash<T>()(arg);
+        }, k.v);
 }
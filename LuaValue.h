@@ -29,16 +29,22 @@
 
 #pragma once
 
-#include <unordered_map> // std::unordered_map
+#include <cstdint> // int64_t, uint8_t
+#include <cstring> // std::memcpy
 #include <string> // std::to_string, std::string
+#include <string_view> // std::string_view
 #include <variant> // std::monostate, std::variant, std::visit
+#include <vector> // std::vector
 #include <memory> // std::unique_ptr, std::shared_ptr
 #include <type_traits> // std::decay_t, std::is_same_v, std::false_type
 #include <initializer_list> // std::initializer_list
 #include <utility> // std::pair, std::make_pair, std::move
 
 constexpr const char* LUAVAL_MT_NAME = "LuaVal";
+// Registry field of the weak table that maps a table to the userdata pushed for it
+constexpr const char* LUAVAL_CACHE_NAME = "LuaValCache";
 class LuaVal;
+class LuaValTable;
 struct lua_State;
 
 size_t LuaValHash(LuaVal const& k);
@@ -55,14 +61,29 @@ namespace std {
     };
 }
 
+// Strings short enough to be stored in the value itself, no allocation needed
+struct LuaValSmallString
+{
+    static constexpr size_t CAPACITY = 15;
+
+    char data[CAPACITY];
+    uint8_t size;
+
+    std::string_view view() const { return std::string_view(data, size); }
+    bool operator==(LuaValSmallString const& b) const { return view() == b.view(); }
+    bool operator<(LuaValSmallString const& b) const { return view() < b.view(); }
+};
+
 class LuaVal
 {
 public:
-    typedef std::unordered_map<LuaVal, LuaVal> MapType;
+    typedef LuaValTable MapType;
     typedef std::monostate NIL;
     template<class T> struct always_false : std::false_type {};
     typedef std::shared_ptr<MapType> WrappedMap;
-    typedef std::variant<NIL, std::string, WrappedMap, bool, double> LuaValVariant;
+    // Longer strings are immutable and shared between copies
+    typedef std::shared_ptr<const std::string> SharedString;
+    typedef std::variant<NIL, bool, int64_t, double, LuaValSmallString, SharedString, WrappedMap> LuaValVariant;
 
     static int lua_get(lua_State* L);
     static int lua_set(lua_State* L);
@@ -71,6 +92,8 @@ public:
     int asObject(lua_State* L) const;
     int asLua(lua_State* L, unsigned int depth) const;
     static LuaVal AsLuaVal(lua_State* L, int index);
+    // Same as AsLuaVal, but numbers with an integer value become integers like Lua table keys do
+    static LuaVal AsKey(lua_State* L, int index);
     static LuaVal FromTable(lua_State* L, int index);
     static int lua_asLua(lua_State* L);
     static int lua_AsLuaVal(lua_State* L);
@@ -79,32 +102,36 @@ public:
 
     static LuaVal* GetLuaVal(lua_State* L, int index);
     static LuaVal* GetCheckLuaVal(lua_State* L, int index);
+    // Tables are pushed as the same userdata while it is alive
     static int PushLuaVal(lua_State* L, LuaVal const& lv);
     static void Register(lua_State* L);
 
-    bool operator<(LuaVal const& b) const
-    {
-        return v < b.v;
-    }
+    bool operator<(LuaVal const& b) const;
+    bool operator==(LuaVal const& b) const;
 
-    bool operator==(LuaVal const& b) const
+    bool IsNil() const { return std::holds_alternative<NIL>(v); }
+    bool IsString() const { return std::holds_alternative<LuaValSmallString>(v) || std::holds_alternative<SharedString>(v); }
+    // Only valid for strings
+    std::string_view AsStringView() const
     {
-        return v == b.v;
+        if (auto small = std::get_if<LuaValSmallString>(&v))
+            return small->view();
+        return *std::get<SharedString>(v);
     }
 
     std::string to_string() const
     {
-        return std::visit([](auto&& arg) -> std::string {
+        return std::visit([&](auto&& arg) -> std::string {
             using T = std::decay_t<decltype(arg)>;
             if constexpr (std::is_same_v<T, NIL>)
                 return "nil";
-            else if constexpr (std::is_same_v<T, std::string>)
-                return arg;
+            else if constexpr (std::is_same_v<T, LuaValSmallString> || std::is_same_v<T, SharedString>)
+                return std::string(AsStringView());
             else if constexpr (std::is_same_v<T, WrappedMap>)
                 return LuaVal::to_string_map(arg.get());
             else if constexpr (std::is_same_v<T, bool>)
                 return arg ? "true" : "false";
-            else if constexpr (std::is_same_v<T, double>)
+            else if constexpr (std::is_same_v<T, int64_t> || std::is_same_v<T, double>)
                 return std::to_string(arg);
             else
                 static_assert(always_false<T>::value, "non-exhaustive visitor!");
@@ -112,11 +139,24 @@ public:
     }
 
     LuaVal() : v() {}
-    LuaVal(std::string const& s) : v(s) {}
+    LuaVal(std::string const& s) : LuaVal(s.data(), s.size()) {}
+    LuaVal(const char* s, size_t len)
+    {
+        if (len <= LuaValSmallString::CAPACITY)
+        {
+            LuaValSmallString small;
+            std::memcpy(small.data, s, len);
+            small.size = static_cast<uint8_t>(len);
+            v = small;
+        }
+        else
+            v = std::make_shared<const std::string>(s, len);
+    }
     LuaVal(bool b) : v(b) {}
+    LuaVal(int64_t i) : v(i) {}
     LuaVal(double d) : v(d) {}
-    LuaVal(MapType const& t) : v(std::make_shared<MapType>(t)) {}
-    LuaVal(std::initializer_list<std::pair<const LuaVal, LuaVal> /* MapType::value_type */> const& l) : v(std::make_shared<MapType>(l)) {}
+    LuaVal(MapType const& t);
+    LuaVal(std::initializer_list<std::pair<const LuaVal, LuaVal> /* MapType::value_type */> const& l);
 
     LuaVal(LuaVal&& b) noexcept : v(std::move(b.v)) {
     }
@@ -133,21 +173,59 @@ public:
         v = b.v;
         return *this;
     }
-    LuaVal clone() const {
-        LuaVal lv;
-        lv.v = std::visit([&](auto&& arg) -> LuaValVariant
-        {
-            using T = std::decay_t<decltype(arg)>;
-            if constexpr (std::is_same_v<T, WrappedMap>)
-                return std::make_shared<MapType>(*arg);
-            else
-                return arg;
-        }, v);
-        return lv;
-    }
+    LuaVal clone() const;
     LuaVal reference() const {
         return *this;
     }
 
     LuaValVariant v;
 };
+
+/*
+ * Table of a LuaVal, shared by every LuaVal and userdata that references it.
+ *
+ * Keys 1..n are stored in an array part, other keys in a flat open addressing (linear probing) table.
+ * Objects and maps are updated by different map threads, so every access locks the table.
+ * The locks are sharded by table address and at most one of them is held at a time,
+ * nested tables are locked one after another.
+ */
+class LuaValTable
+{
+public:
+    typedef std::pair<const LuaVal, LuaVal> value_type;
+
+    LuaValTable() : count(0) {}
+    LuaValTable(std::initializer_list<value_type> const& l);
+    LuaValTable(LuaValTable const& b);
+    LuaValTable& operator=(LuaValTable const&) = delete;
+
+    // Returns nil for missing keys
+    LuaVal Get(LuaVal const& key) const;
+    // Setting a key to nil removes it
+    void Set(LuaVal const& key, LuaVal value);
+    // A copy of the key-value pairs, so the table is not locked while they are used
+    std::vector<std::pair<LuaVal, LuaVal>> Entries() const;
+
+private:
+    friend class LuaVal;
+
+    struct Slot
+    {
+        LuaVal key; // nil for an empty slot
+        LuaVal value;
+    };
+
+    static constexpr size_t MIN_TABLE_SIZE = 8;
+
+    // Callers hold the lock of the table, or own a table no one else can reach yet
+    const LuaVal* RawFind(LuaVal const& key) const;
+    void RawSet(LuaVal const& key, LuaVal value);
+    size_t FindSlot(LuaVal const& key) const;
+    void HashInsert(LuaVal const& key, LuaVal value);
+    void HashErase(LuaVal const& key);
+    void Rehash(size_t newSize);
+
+    std::vector<LuaVal> array; // values of keys 1..array.size(), may contain nils
+    std::vector<Slot> slots;
+    size_t count; // used slots
+};
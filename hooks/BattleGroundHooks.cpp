@@ -13,10 +13,10 @@
 using namespace Hooks;
 
 #define START_HOOK(EVENT) \
+    if (!HasEventBindings(REGTYPE_BG, EVENT))\
+        return;\
     auto binding = GetBinding<EventKey<BGEvents>>(REGTYPE_BG);\
-    auto key = EventKey<BGEvents>(EVENT);\
-    if (!binding->HasBindingsFor(key))\
-        return;
+    auto key = EventKey<BGEvents>(EVENT)
 
 void Eluna::OnBGStart(BattleGround* bg, BattleGroundTypeId bgId, uint32 instanceId)
 {
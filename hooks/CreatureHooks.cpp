@@ -14,6 +14,8 @@
 using namespace Hooks;
 
 #define START_HOOK(EVENT, CREATURE) \
+    if (!HasEventBindings(REGTYPE_CREATURE, EVENT) && !HasEventBindings(REGTYPE_CREATURE_UNIQUE, EVENT))\
+        return;\
     auto CreatureEventBindings = GetBinding<EntryKey<CreatureEvents>>(REGTYPE_CREATURE);\
     auto CreatureUniqueBindings = GetBinding<UniqueObjectKey<CreatureEvents>>(REGTYPE_CREATURE_UNIQUE);\
     auto entry_key = EntryKey<CreatureEvents>(EVENT, CREATURE->GetEntry());\
@@ -23,6 +25,8 @@ using namespace Hooks;
             return;
 
 #define START_HOOK_WITH_RETVAL(EVENT, CREATURE, RETVAL) \
+    if (!HasEventBindings(REGTYPE_CREATURE, EVENT) && !HasEventBindings(REGTYPE_CREATURE_UNIQUE, EVENT))\
+        return RETVAL;\
     auto CreatureEventBindings = GetBinding<EntryKey<CreatureEvents>>(REGTYPE_CREATURE);\
     auto CreatureUniqueBindings = GetBinding<UniqueObjectKey<CreatureEvents>>(REGTYPE_CREATURE_UNIQUE);\
     auto entry_key = EntryKey<CreatureEvents>(EVENT, CREATURE->GetEntry());\
@@ -15,12 +15,16 @@
 using namespace Hooks;
 
 #define START_HOOK(EVENT, ENTRY) \
+    if (!HasEventBindings(REGTYPE_GAMEOBJECT, EVENT))\
+        return;\
     auto binding = GetBinding<EntryKey<GameObjectEvents>>(REGTYPE_GAMEOBJECT);\
     auto key = EntryKey<GameObjectEvents>(EVENT, ENTRY);\
     if (!binding->HasBindingsFor(key))\
         return;
 
 #define START_HOOK_WITH_RETVAL(EVENT, ENTRY, RETVAL) \
+    if (!HasEventBindings(REGTYPE_GAMEOBJECT, EVENT))\
+        return RETVAL;\
     auto binding = GetBinding<EntryKey<GameObjectEvents>>(REGTYPE_GAMEOBJECT);\
     auto key = EntryKey<GameObjectEvents>(EVENT, ENTRY);\
     if (!binding->HasBindingsFor(key))\
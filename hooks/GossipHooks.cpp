@@ -14,12 +14,16 @@
 using namespace Hooks;
 
 #define START_HOOK(REGTYPE, EVENT, ENTRY) \
+    if (!HasEventBindings(REGTYPE, EVENT))\
+        return;\
     auto binding = GetBinding<EntryKey<GossipEvents>>(REGTYPE);\
     auto key = EntryKey<GossipEvents>(EVENT, ENTRY);\
     if (!binding->HasBindingsFor(key))\
         return;
 
 #define START_HOOK_WITH_RETVAL(REGTYPE, EVENT, ENTRY, RETVAL) \
+    if (!HasEventBindings(REGTYPE, EVENT))\
+        return RETVAL;\
     auto binding = GetBinding<EntryKey<GossipEvents>>(REGTYPE);\
     auto key = EntryKey<GossipEvents>(EVENT, ENTRY);\
     if (!binding->HasBindingsFor(key))\
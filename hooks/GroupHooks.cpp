@@ -13,16 +13,16 @@
 using namespace Hooks;
 
 #define START_HOOK(EVENT) \
+    if (!HasEventBindings(REGTYPE_GROUP, EVENT))\
+        return;\
     auto binding = GetBinding<EventKey<GroupEvents>>(REGTYPE_GROUP);\
-    auto key = EventKey<GroupEvents>(EVENT);\
-    if (!binding->HasBindingsFor(key))\
-        return;
+    auto key = EventKey<GroupEvents>(EVENT)
 
 #define START_HOOK_WITH_RETVAL(EVENT, RETVAL) \
+    if (!HasEventBindings(REGTYPE_GROUP, EVENT))\
+        return RETVAL;\
     auto binding = GetBinding<EventKey<GroupEvents>>(REGTYPE_GROUP);\
-    auto key = EventKey<GroupEvents>(EVENT);\
-    if (!binding->HasBindingsFor(key))\
-        return RETVAL;
+    auto key = EventKey<GroupEvents>(EVENT)
 
 void Eluna::OnAddMember(Group* group, ObjectGuid guid)
 {
@@ -13,10 +13,10 @@
 using namespace Hooks;
 
 #define START_HOOK(EVENT) \
+    if (!HasEventBindings(REGTYPE_GUILD, EVENT))\
+        return;\
     auto binding = GetBinding<EventKey<GuildEvents>>(REGTYPE_GUILD);\
-    auto key = EventKey<GuildEvents>(EVENT);\
-    if (!binding->HasBindingsFor(key))\
-        return;
+    auto key = EventKey<GuildEvents>(EVENT)
 
 void Eluna::OnAddMember(Guild* guild, Player* player, uint32 plRank)
 {
@@ -59,18 +59,33 @@ struct LuaRet<std::string>
     }
 };
 
+// Entry the profiler files handlers under, see ElunaProfiler
+template<typename T>
+uint64 GetProfileEntry(const EventKey<T>& /*key*/) { return 0; }
+
+template<typename T>
+uint64 GetProfileEntry(const EntryKey<T>& key) { return key.entry; }
+
+template<typename T>
+uint64 GetProfileEntry(const UniqueObjectKey<T>& key) { return key.guid.GetRawValue(); }
+
 /*
  * Sets up the stack so that event handlers can be called.
  *
+ * If `filterValue` is given, only handlers whose BindingFilter contains it are pushed.
+ *
  * Returns the number of functions that were pushed onto the stack.
  */
 template<typename K1, typename K2>
-int Eluna::SetupStack(BindingMap<K1>* bindings1, BindingMap<K2>* bindings2, const K1& key1, const K2& key2, int number_of_arguments)
+int Eluna::SetupStack(BindingMap<K1>* bindings1, BindingMap<K2>* bindings2, const K1& key1, const K2& key2, int number_of_arguments, std::optional<uint32> filterValue)
 {
     ASSERT(number_of_arguments == this->push_counter);
     ASSERT(key1.event_id == key2.event_id);
     // Stack: [arguments]
 
+    if (IsTrackingContext())
+        profiler.PushContext(GetRegisterType(bindings1), key1.event_id, GetProfileEntry(key1));
+
     HookPush(key1.event_id);
     this->push_counter = 0;
     ++number_of_arguments;
@@ -83,9 +98,9 @@ int Eluna::SetupStack(BindingMap<K1>* bindings1, BindingMap<K2>* bindings2, cons
     lua_insert(L, first_argument_index);
     // Stack: event_id, [arguments]
 
-    bindings1->PushRefsFor(key1);
+    bindings1->PushRefsFor(key1, filterValue);
     if (bindings2)
-        bindings2->PushRefsFor(key2);
+        bindings2->PushRefsFor(key2, filterValue);
     // Stack: event_id, [arguments], [functions]
 
     int number_of_functions = lua_gettop(L) - arguments_top;
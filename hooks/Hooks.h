@@ -10,6 +10,7 @@
 #if defined ELUNA_CMANGOS
 #include "Platform/Define.h"
 #endif
+#include <bitset>
 #include <utility>
 
 struct EventEntry
@@ -30,6 +31,9 @@ constexpr size_t CountOf(const T(&)[N]) { return N; }
 
 namespace Hooks
 {
+    // Event IDs are stored as uint8 (see EventEntry), so one bit per possible ID covers every event of a register type
+    typedef std::bitset<256> EventBindingMask;
+
     enum RegisterTypes : uint8
     {
         REGTYPE_PACKET,
@@ -119,7 +123,9 @@ namespace Hooks
         X(ELUNA_EVENT_ON_LUA_STATE_OPEN,          33, "on_lua_state_open")        \
         /* Game events */ \
         X(GAME_EVENT_START,                       34, "on_game_start")            \
-        X(GAME_EVENT_STOP,                        35, "on_game_stop")
+        X(GAME_EVENT_STOP,                        35, "on_game_stop")           \
+        /* Eluna */ \
+        X(ELUNA_EVENT_ON_MESSAGE,                 36, "on_lua_message")
 
     enum ServerEvents
     {
@@ -15,6 +15,8 @@
 using namespace Hooks;
 
 #define START_HOOK(EVENT, AI) \
+    if (!HasEventBindings(REGTYPE_MAP, EVENT) && !HasEventBindings(REGTYPE_INSTANCE, EVENT))\
+        return;\
     auto MapEventBindings = GetBinding<EntryKey<InstanceEvents>>(REGTYPE_MAP);\
     auto InstanceEventBindings = GetBinding<EntryKey<InstanceEvents>>(REGTYPE_INSTANCE);\
     auto mapKey = EntryKey<InstanceEvents>(EVENT, AI->instance->GetId());\
@@ -25,6 +27,8 @@ using namespace Hooks;
     HookPush<Map>(AI->instance)
 
 #define START_HOOK_WITH_RETVAL(EVENT, AI, RETVAL) \
+    if (!HasEventBindings(REGTYPE_MAP, EVENT) && !HasEventBindings(REGTYPE_INSTANCE, EVENT))\
+        return RETVAL;\
     auto MapEventBindings = GetBinding<EntryKey<InstanceEvents>>(REGTYPE_MAP);\
     auto InstanceEventBindings = GetBinding<EntryKey<InstanceEvents>>(REGTYPE_INSTANCE);\
     auto mapKey = EntryKey<InstanceEvents>(EVENT, AI->instance->GetId());\
@@ -14,12 +14,16 @@
 using namespace Hooks;
 
 #define START_HOOK(EVENT, ENTRY) \
+    if (!HasEventBindings(REGTYPE_ITEM, EVENT))\
+        return;\
     auto binding = GetBinding<EntryKey<ItemEvents>>(REGTYPE_ITEM);\
     auto key = EntryKey<ItemEvents>(EVENT, ENTRY);\
     if (!binding->HasBindingsFor(key))\
         return;
 
 #define START_HOOK_WITH_RETVAL(EVENT, ENTRY, RETVAL) \
+    if (!HasEventBindings(REGTYPE_ITEM, EVENT))\
+        return RETVAL;\
     auto binding = GetBinding<EntryKey<ItemEvents>>(REGTYPE_ITEM);\
     auto key = EntryKey<ItemEvents>(EVENT, ENTRY);\
     if (!binding->HasBindingsFor(key))\
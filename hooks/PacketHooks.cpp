@@ -14,17 +14,32 @@
 using namespace Hooks;
 
 #define START_HOOK_SERVER(EVENT) \
+    if (!HasEventBindings(REGTYPE_SERVER, EVENT))\
+        return;\
     auto binding = GetBinding<EventKey<ServerEvents>>(REGTYPE_SERVER);\
-    auto key = EventKey<ServerEvents>(EVENT);\
-    if (!binding->HasBindingsFor(key))\
+    auto key = EventKey<ServerEvents>(EVENT)
+
+// Handlers registered with RegisterServerPacketEvent only want some opcodes, the packet is not pushed if none wants it
+#define START_HOOK_SERVER_PACKET(EVENT, OPCODE) \
+    START_HOOK_SERVER(EVENT);\
+    if (!binding->HasBindingsFor(key, OPCODE))\
         return;
 
 #define START_HOOK_PACKET(EVENT, OPCODE) \
+    if (!HasEventBindings(REGTYPE_PACKET, EVENT))\
+        return;\
     auto binding = GetBinding<EntryKey<PacketEvents>>(REGTYPE_PACKET);\
     auto key = EntryKey<PacketEvents>(EVENT, OPCODE);\
     if (!binding->HasBindingsFor(key))\
         return;
 
+ElunaObjectImpl<WorldPacket>* Eluna::HookPushPacket(WorldPacket const& packet)
+{
+    ElunaObjectImpl<WorldPacket>* view = ElunaTemplate<WorldPacket>::PushView(this, packet);
+    ++push_counter;
+    return view;
+}
+
 bool Eluna::OnPacketSend(WorldSession* session, const WorldPacket& packet)
 {
     bool result = true;
@@ -37,10 +52,11 @@ bool Eluna::OnPacketSend(WorldSession* session, const WorldPacket& packet)
 }
 void Eluna::OnPacketSendAny(Player* player, const WorldPacket& packet, bool& result)
 {
-    START_HOOK_SERVER(SERVER_EVENT_ON_PACKET_SEND);
-    HookPush(&packet); // pushing pointer to local is fine, a copy of value will be stored, not pointer itself
+    uint32 opcode = packet.GetOpcode();
+    START_HOOK_SERVER_PACKET(SERVER_EVENT_ON_PACKET_SEND, opcode);
+    ElunaObjectImpl<WorldPacket>* view = HookPushPacket(packet);
     HookPush(player);
-    int n = SetupStack(binding, key, 2);
+    int n = SetupStack(binding, key, 2, opcode);
 
     while (n > 0)
     {
@@ -52,13 +68,15 @@ void Eluna::OnPacketSendAny(Player* player, const WorldPacket& packet, bool& res
         lua_pop(L, 1);
     }
 
+    if (view)
+        view->ReleaseView();
     CleanUpStack(2);
 }
 
 void Eluna::OnPacketSendOne(Player* player, const WorldPacket& packet, bool& result)
 {
     START_HOOK_PACKET(PACKET_EVENT_ON_PACKET_SEND, packet.GetOpcode());
-    HookPush(&packet); // pushing pointer to local is fine, a copy of value will be stored, not pointer itself
+    ElunaObjectImpl<WorldPacket>* view = HookPushPacket(packet);
     HookPush(player);
     int n = SetupStack(binding, key, 2);
 
@@ -72,6 +90,8 @@ void Eluna::OnPacketSendOne(Player* player, const WorldPacket& packet, bool& res
         lua_pop(L, 1);
     }
 
+    if (view)
+        view->ReleaseView();
     CleanUpStack(2);
 }
 
@@ -88,10 +108,11 @@ bool Eluna::OnPacketReceive(WorldSession* session, WorldPacket& packet)
 
 void Eluna::OnPacketReceiveAny(Player* player, WorldPacket& packet, bool& result)
 {
-    START_HOOK_SERVER(SERVER_EVENT_ON_PACKET_RECEIVE);
-    HookPush(&packet); // pushing pointer to local is fine, a copy of value will be stored, not pointer itself
+    uint32 opcode = packet.GetOpcode();
+    START_HOOK_SERVER_PACKET(SERVER_EVENT_ON_PACKET_RECEIVE, opcode);
+    ElunaObjectImpl<WorldPacket>* view = HookPushPacket(packet);
     HookPush(player);
-    int n = SetupStack(binding, key, 2);
+    int n = SetupStack(binding, key, 2, opcode);
 
     while (n > 0)
     {
@@ -100,26 +121,30 @@ void Eluna::OnPacketReceiveAny(Player* player, WorldPacket& packet, bool& result
         if (lua_isboolean(L, r + 0) && !lua_toboolean(L, r + 0))
             result = false;
 
+        // an unmodified view of the packet itself is left as it is
         if (lua_isuserdata(L, r + 1))
-            if (WorldPacket* data = CHECKOBJ<WorldPacket>(r + 1, false))
-            {
+            if (WorldPacket* data = ElunaTemplate<WorldPacket>::Check(this, r + 1, false, true))
+                if (data != &packet)
+                {
 #if defined ELUNA_TRINITY || defined ELUNA_VMANGOS
-                packet = std::move(*data);
+                    packet = std::move(*data);
 #else
-                packet = *data;
+                    packet = *data;
 #endif
-            }
+                }
 
         lua_pop(L, 2);
     }
 
+    if (view)
+        view->ReleaseView();
     CleanUpStack(2);
 }
 
 void Eluna::OnPacketReceiveOne(Player* player, WorldPacket& packet, bool& result)
 {
     START_HOOK_PACKET(PACKET_EVENT_ON_PACKET_RECEIVE, packet.GetOpcode());
-    HookPush(&packet); // pushing pointer to local is fine, a copy of value will be stored, not pointer itself
+    ElunaObjectImpl<WorldPacket>* view = HookPushPacket(packet);
     HookPush(player);
     int n = SetupStack(binding, key, 2);
 
@@ -130,18 +155,22 @@ void Eluna::OnPacketReceiveOne(Player* player, WorldPacket& packet, bool& result
         if (lua_isboolean(L, r + 0) && !lua_toboolean(L, r + 0))
             result = false;
 
+        // an unmodified view of the packet itself is left as it is
         if (lua_isuserdata(L, r + 1))
-            if (WorldPacket* data = CHECKOBJ<WorldPacket>(r + 1, false))
-            {
+            if (WorldPacket* data = ElunaTemplate<WorldPacket>::Check(this, r + 1, false, true))
+                if (data != &packet)
+                {
 #if defined ELUNA_TRINITY || defined ELUNA_VMANGOS
-                packet = std::move(*data);
+                    packet = std::move(*data);
 #else
-                packet = *data;
+                    packet = *data;
 #endif
-            }
+                }
 
         lua_pop(L, 2);
     }
 
+    if (view)
+        view->ReleaseView();
     CleanUpStack(2);
 }
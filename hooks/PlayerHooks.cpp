@@ -17,16 +17,16 @@
 using namespace Hooks;
 
 #define START_HOOK(EVENT) \
+    if (!HasEventBindings(REGTYPE_PLAYER, EVENT))\
+        return;\
     auto binding = GetBinding<EventKey<PlayerEvents>>(REGTYPE_PLAYER);\
-    auto key = EventKey<PlayerEvents>(EVENT);\
-    if (!binding->HasBindingsFor(key))\
-        return;
+    auto key = EventKey<PlayerEvents>(EVENT)
 
 #define START_HOOK_WITH_RETVAL(EVENT, RETVAL) \
+    if (!HasEventBindings(REGTYPE_PLAYER, EVENT))\
+        return RETVAL;\
     auto binding = GetBinding<EventKey<PlayerEvents>>(REGTYPE_PLAYER);\
-    auto key = EventKey<PlayerEvents>(EVENT);\
-    if (!binding->HasBindingsFor(key))\
-        return RETVAL;
+    auto key = EventKey<PlayerEvents>(EVENT)
 
 void Eluna::OnLearnTalents(Player* pPlayer, uint32 talentId, uint32 talentRank, uint32 spellid)
 {
@@ -10,21 +10,24 @@
 #include "BindingMap.h"
 #include "ElunaEventMgr.h"
 #include "ElunaIncludes.h"
+#include "ElunaMessageBus.h"
+#include "ElunaQueryWorker.h"
 #include "ElunaTemplate.h"
+#include "lmarshal.h"
 
 using namespace Hooks;
 
 #define START_HOOK(EVENT) \
+    if (!HasEventBindings(REGTYPE_SERVER, EVENT))\
+        return;\
     auto binding = GetBinding<EventKey<ServerEvents>>(REGTYPE_SERVER);\
-    auto key = EventKey<ServerEvents>(EVENT);\
-    if (!binding->HasBindingsFor(key))\
-        return;
+    auto key = EventKey<ServerEvents>(EVENT)
 
 #define START_HOOK_WITH_RETVAL(EVENT, RETVAL) \
+    if (!HasEventBindings(REGTYPE_SERVER, EVENT))\
+        return RETVAL;\
     auto binding = GetBinding<EventKey<ServerEvents>>(REGTYPE_SERVER);\
-    auto key = EventKey<ServerEvents>(EVENT);\
-    if (!binding->HasBindingsFor(key))\
-        return RETVAL;
+    auto key = EventKey<ServerEvents>(EVENT)
 
 bool Eluna::OnAddonMessage(Player* sender, uint32 type, std::string& msg, Player* receiver, Guild* guild, Group* group, Channel* channel)
 {
@@ -74,12 +77,25 @@ void Eluna::OnTimedEvent(int funcRef, uint32 delay, uint32 calls, WorldObject* o
     Push(obj);
 
     // Call function
-    ExecuteCall(4, 0);
+    bool tracking = IsTrackingContext();
+    if (tracking)
+        profiler.PushContext(ElunaProfiler::REGTYPE_TIMED_EVENT, 0, 0);
+    if (profiler.IsEnabled())
+    {
+        ElunaProfiler::Sample sample = profiler.Begin(L, lua_gettop(L) - 4, profiler.GetContext());
+        ExecuteCall(4, 0);
+        profiler.End(L, sample);
+    }
+    else
+        ExecuteCall(4, 0);
+    if (tracking)
+        profiler.PopContext();
 
     ASSERT(!event_level);
 #if !defined TRACKABLE_PTR_NAMESPACE
     InvalidateObjects();
 #endif
+    ReleaseObjectCache();
 }
 
 void Eluna::OnGameEventStart(uint32 eventid)
@@ -108,6 +124,26 @@ void Eluna::OnLuaStateOpen()
     CallAllFunctions(binding, key);
 }
 
+void Eluna::OnMessage(const ElunaMessage& message)
+{
+    START_HOOK(ELUNA_EVENT_ON_MESSAGE);
+    HookPush(message.topic);
+
+    lua_pushcfunction(L, mar_decode);
+    lua_pushlstring(L, message.payload.data(), message.payload.size());
+    if (lua_pcall(L, 1, 1, 0) != 0)
+    {
+        ELUNA_LOG_ERROR("[Eluna]: Could not decode the payload of message `%s`: %s", message.topic.c_str(), lua_tostring(L, -1));
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    ++push_counter;
+
+    HookPush(message.sourceMapId);
+    HookPush(message.sourceInstanceId);
+    CallAllFunctions(binding, key);
+}
+
 // AreaTrigger
 bool Eluna::OnAreaTrigger(Player* pPlayer, AreaTriggerEntry const* pTrigger)
 {
@@ -303,8 +339,20 @@ void Eluna::OnStartup()
 
 void Eluna::OnShutdown()
 {
-    START_HOOK(WORLD_EVENT_ON_SHUTDOWN);
-    CallAllFunctions(binding, key);
+    if (HasEventBindings(REGTYPE_SERVER, WORLD_EVENT_ON_SHUTDOWN))
+    {
+        auto binding = GetBinding<EventKey<ServerEvents>>(REGTYPE_SERVER);
+        auto key = EventKey<ServerEvents>(WORLD_EVENT_ON_SHUTDOWN);
+        CallAllFunctions(binding, key);
+    }
+
+    // the core closes its databases after this, so the writes of the handlers are sent
+    // and the worker threads using the databases are stopped while those are still open
+    if (boundMapId == -1)
+    {
+        FlushWrites();
+        sElunaQueryWorker->Shutdown();
+    }
 }
 
 /* Map */
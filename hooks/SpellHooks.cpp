@@ -15,12 +15,16 @@
 using namespace Hooks;
 
 #define START_HOOK(EVENT, SPELL) \
+    if (!HasEventBindings(REGTYPE_SPELL, EVENT))\
+        return;\
     auto binding = GetBinding<EntryKey<SpellEvents>>(REGTYPE_SPELL);\
     auto key = EntryKey<SpellEvents>(EVENT, SPELL->GetSpellInfo()->Id);\
     if (!binding->HasBindingsFor(key))\
         return;
 
 #define START_HOOK_WITH_RETVAL(EVENT, SPELL, RETVAL) \
+    if (!HasEventBindings(REGTYPE_SPELL, EVENT))\
+        return RETVAL;\
     auto binding = GetBinding<EntryKey<SpellEvents>>(REGTYPE_SPELL);\
     auto key = EntryKey<SpellEvents>(EVENT, SPELL->GetSpellInfo()->Id);\
     if (!binding->HasBindingsFor(key))\
@@ -15,10 +15,10 @@
 using namespace Hooks;
 
 #define START_HOOK(EVENT) \
+    if (!HasEventBindings(REGTYPE_VEHICLE, EVENT))\
+        return;\
     auto binding = GetBinding<EventKey<VehicleEvents>>(REGTYPE_VEHICLE);\
-    auto key = EventKey<VehicleEvents>(EVENT);\
-    if (!binding->HasBindingsFor(key))\
-        return;
+    auto key = EventKey<VehicleEvents>(EVENT)
 
 void Eluna::OnInstall(Vehicle* vehicle)
 {
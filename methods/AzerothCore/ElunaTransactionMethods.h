@@ -0,0 +1,106 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef TRANSACTIONMETHODS_H
+#define TRANSACTIONMETHODS_H
+
+#define TRANSACTION  (*transaction)
+
+/***
+ * A batch of SQL statements for one database, committed together in a single transaction.
+ *
+ * Committing many writes at once saves a round trip and a commit for each of them.
+ *
+ *     local trans = CharDBTransaction()
+ *     trans:Append("DELETE FROM my_table WHERE guid = " .. guid)
+ *     trans:Append(insertStatement)
+ *     trans:Commit()
+ *
+ * E.g. the return value of [Global:CharDBTransaction].
+ *
+ * Inherits all methods from: none
+ */
+namespace LuaTransaction
+{
+    /**
+     * Returns the number of statements appended since the last commit.
+     *
+     * @return uint32 size
+     */
+    int GetSize(Eluna* E, ElunaTransaction* transaction)
+    {
+        E->Push(TRANSACTION->GetSize());
+        return 1;
+    }
+
+    /**
+     * Appends a statement to the transaction.
+     *
+     * An [ElunaStatement] is added with its currently bound parameters, it has to be prepared for the same database.
+     *
+     * @proto (sql)
+     * @proto (statement)
+     * @param string sql : query to execute
+     * @param [ElunaStatement] statement : prepared statement to execute
+     */
+    int Append(Eluna* E, ElunaTransaction* transaction)
+    {
+        if (lua_type(E->L, 2) == LUA_TSTRING)
+        {
+            TRANSACTION->Append(E->CHECKVAL<std::string>(2));
+            return 0;
+        }
+
+        ElunaStatement* statement = E->CHECKOBJ<ElunaStatement>(2);
+        if ((*statement)->GetDatabase() != TRANSACTION->GetDatabase())
+            luaL_argerror(E->L, 2, "statement is prepared for a different database");
+
+        std::string sql;
+        LuaStatement::BuildSQL(E, statement, sql);
+        TRANSACTION->Append(std::move(sql));
+        (*statement)->OnExecuted();
+        return 0;
+    }
+
+    /**
+     * Commits the appended statements asynchronously in one transaction and empties the transaction.
+     *
+     * Writes held back by `Eluna.CoalesceWrites` for the same database are sent before the transaction.
+     *
+     * Nothing is sent if the transaction is empty. The core does not report the outcome of its commits,
+     * so passing a callback raises an error.
+     */
+    int Commit(Eluna* E, ElunaTransaction* transaction)
+    {
+        if (!lua_isnoneornil(E->L, 2))
+        {
+            luaL_argerror(E->L, 2, "commit callbacks are not supported on this core");
+            return 0;
+        }
+
+        if (!TRANSACTION->GetSize())
+            return 0;
+
+        ElunaDatabase database = TRANSACTION->GetDatabase();
+        // writes coalesced before the commit are sent first, so they reach the database in the order they were made
+        E->FlushWrites(database);
+        ElunaDB::CommitTransaction(database, TRANSACTION->Release());
+        return 0;
+    }
+
+    ElunaRegister<ElunaTransaction> TransactionMethods[] =
+    {
+        // Getters
+        { "GetSize", &LuaTransaction::GetSize },
+
+        // Other
+        { "Append", &LuaTransaction::Append },
+        { "Commit", &LuaTransaction::Commit }
+    };
+};
+#undef TRANSACTION
+
+#endif
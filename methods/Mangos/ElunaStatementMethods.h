@@ -0,0 +1,304 @@
+/*
+* Copyright (C) 2010 - 2024 Eluna Lua Engine <https://elunaluaengine.github.io/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef STATEMENTMETHODS_H
+#define STATEMENTMETHODS_H
+
+#define STATEMENT  (*statement)
+
+/***
+ * An SQL statement with `?` placeholders for parameters, prepared once and run many times.
+ *
+ * Parameters are numbered from 0 in the order they appear in the SQL. Bound values are
+ * rendered and escaped for the statement's database, and are kept until they are bound again.
+ *
+ *     local stmt = CharDBPrepare("REPLACE INTO my_table (guid, name, score) VALUES (?, ?, ?)")
+ *     stmt:SetUInt32(0, player:GetGUIDLow())
+ *     stmt:SetString(1, player:GetName())
+ *     stmt:SetDouble(2, score)
+ *     stmt:Execute()
+ *
+ * E.g. the return value of [Global:WorldDBPrepare].
+ *
+ * Inherits all methods from: none
+ */
+namespace LuaStatement
+{
+    static uint32 CheckParameter(Eluna* E, ElunaStatement* statement)
+    {
+        uint32 index = E->CHECKVAL<uint32>(2);
+        uint32 count = STATEMENT->GetParameterCount();
+        if (index >= count)
+        {
+            char arr[256];
+            sprintf(arr, "trying to bind invalid parameter index %u. There are %u parameters and the indexes start from 0", index, count);
+            luaL_argerror(E->L, 2, arr);
+        }
+        return index;
+    }
+
+    // `sql` is left empty when raising the error, so nothing leaks when the error skips its destructor
+    static void BuildSQL(Eluna* E, ElunaStatement* statement, std::string& sql)
+    {
+        uint32 unbound = 0;
+        if (!STATEMENT->Build(sql, unbound))
+            luaL_error(E->L, "parameter %u of the statement is not bound", unbound);
+    }
+
+    /**
+     * Returns the number of `?` placeholders in the statement.
+     *
+     * @return uint32 parameterCount
+     */
+    int GetParameterCount(Eluna* E, ElunaStatement* statement)
+    {
+        E->Push(STATEMENT->GetParameterCount());
+        return 1;
+    }
+
+    /**
+     * Returns how often the statement was run and how long its queries took.
+     *
+     * Latency is measured from sending a query until its results are available to the script.
+     *
+     * @return uint64 executions : number of [ElunaStatement:Execute] calls
+     * @return uint64 queries : number of finished [ElunaStatement:Query] and [ElunaStatement:QueryAsync] calls
+     * @return uint64 averageLatency : in microseconds
+     * @return uint64 maxLatency : in microseconds
+     */
+    int GetStats(Eluna* E, ElunaStatement* statement)
+    {
+        E->Push(STATEMENT->GetExecutions());
+        E->Push(STATEMENT->GetQueries());
+        E->Push(STATEMENT->GetAverageLatency());
+        E->Push(STATEMENT->GetMaxLatency());
+        return 4;
+    }
+
+    /**
+     * Binds SQL `NULL` to the parameter.
+     *
+     * @param uint32 index
+     */
+    int SetNull(Eluna* E, ElunaStatement* statement)
+    {
+        STATEMENT->SetNull(CheckParameter(E, statement));
+        return 0;
+    }
+
+    /**
+     * Binds a boolean to the parameter, sent as 1 or 0.
+     *
+     * @param uint32 index
+     * @param bool value
+     */
+    int SetBool(Eluna* E, ElunaStatement* statement)
+    {
+        uint32 index = CheckParameter(E, statement);
+        STATEMENT->SetBool(index, E->CHECKVAL<bool>(3));
+        return 0;
+    }
+
+    /**
+     * Binds an unsigned 32 bit integer to the parameter.
+     *
+     * @param uint32 index
+     * @param uint32 value
+     */
+    int SetUInt32(Eluna* E, ElunaStatement* statement)
+    {
+        uint32 index = CheckParameter(E, statement);
+        STATEMENT->SetUInt(index, E->CHECKVAL<uint32>(3));
+        return 0;
+    }
+
+    /**
+     * Binds a signed 32 bit integer to the parameter.
+     *
+     * @param uint32 index
+     * @param int32 value
+     */
+    int SetInt32(Eluna* E, ElunaStatement* statement)
+    {
+        uint32 index = CheckParameter(E, statement);
+        STATEMENT->SetInt(index, E->CHECKVAL<int32>(3));
+        return 0;
+    }
+
+    /**
+     * Binds an unsigned 64 bit integer to the parameter.
+     *
+     * @param uint32 index
+     * @param uint64 value
+     */
+    int SetUInt64(Eluna* E, ElunaStatement* statement)
+    {
+        uint32 index = CheckParameter(E, statement);
+        STATEMENT->SetUInt(index, E->CHECKVAL<uint64>(3));
+        return 0;
+    }
+
+    /**
+     * Binds a signed 64 bit integer to the parameter.
+     *
+     * @param uint32 index
+     * @param int64 value
+     */
+    int SetInt64(Eluna* E, ElunaStatement* statement)
+    {
+        uint32 index = CheckParameter(E, statement);
+        STATEMENT->SetInt(index, E->CHECKVAL<int64>(3));
+        return 0;
+    }
+
+    /**
+     * Binds a single precision number to the parameter.
+     *
+     * @param uint32 index
+     * @param float value : must be finite
+     */
+    int SetFloat(Eluna* E, ElunaStatement* statement)
+    {
+        uint32 index = CheckParameter(E, statement);
+        if (!STATEMENT->SetDouble(index, E->CHECKVAL<float>(3)))
+            luaL_argerror(E->L, 3, "value must be finite");
+        return 0;
+    }
+
+    /**
+     * Binds a double precision number to the parameter.
+     *
+     * @param uint32 index
+     * @param double value : must be finite
+     */
+    int SetDouble(Eluna* E, ElunaStatement* statement)
+    {
+        uint32 index = CheckParameter(E, statement);
+        if (!STATEMENT->SetDouble(index, E->CHECKVAL<double>(3)))
+            luaL_argerror(E->L, 3, "value must be finite");
+        return 0;
+    }
+
+    /**
+     * Binds a string to the parameter. The string is quoted and escaped, don't quote the placeholder.
+     *
+     * @param uint32 index
+     * @param string value
+     */
+    int SetString(Eluna* E, ElunaStatement* statement)
+    {
+        uint32 index = CheckParameter(E, statement);
+        STATEMENT->SetString(index, E->CHECKVAL<std::string>(3));
+        return 0;
+    }
+
+    /**
+     * Unbinds all parameters, they have to be bound again before the statement can run.
+     */
+    int ClearParameters(Eluna* /*E*/, ElunaStatement* statement)
+    {
+        STATEMENT->ClearParameters();
+        return 0;
+    }
+
+    /**
+     * Runs the statement with the bound parameters, see [Global:WorldDBExecute].
+     *
+     * Any results produced are ignored. Writes are coalesced like those of [Global:WorldDBExecute].
+     */
+    int Execute(Eluna* E, ElunaStatement* statement)
+    {
+        std::string sql;
+        BuildSQL(E, statement, sql);
+        E->ExecuteSQL(STATEMENT->GetDatabase(), std::move(sql));
+        STATEMENT->OnExecuted();
+        return 0;
+    }
+
+    /**
+     * Runs the statement with the bound parameters and returns an [ElunaQuery], see [Global:WorldDBQuery].
+     *
+     * The query is always executed synchronously.
+     *
+     * @return [ElunaQuery] results or nil if no rows found
+     */
+    int Query(Eluna* E, ElunaStatement* statement)
+    {
+        std::string sql;
+        BuildSQL(E, statement, sql);
+        auto start = std::chrono::steady_clock::now();
+        ElunaQuery result = ElunaDB::Query(STATEMENT->GetDatabase(), sql);
+        STATEMENT->OnQueried(start);
+
+        if (result)
+            E->Push(&result);
+        else
+            E->Push();
+        return 1;
+    }
+
+    /**
+     * Runs the statement with the bound parameters asynchronously, see [Global:WorldDBQueryAsync].
+     *
+     * The parameters are read when this is called, they can be bound again right away.
+     * The callback function parameter is the query result (an [ElunaQuery] or nil if no rows found).
+     *
+     * @param function callback : the callback function to be called with the query results
+     * @return bool queued : false if the query was rejected because the queue is full
+     */
+    int QueryAsync(Eluna* E, ElunaStatement* statement)
+    {
+        luaL_checktype(E->L, 2, LUA_TFUNCTION);
+        std::string sql;
+        BuildSQL(E, statement, sql);
+
+        // Push the Lua function onto the stack and create a reference
+        lua_pushvalue(E->L, 2);
+        int funcRef = luaL_ref(E->L, LUA_REGISTRYINDEX);
+
+        // Validate the function reference
+        if (funcRef == LUA_REFNIL || funcRef == LUA_NOREF)
+        {
+            luaL_argerror(E->L, 2, "unable to make a ref to function");
+            return 0;
+        }
+
+        // The query keeps the statement alive for its stats
+        bool queued = E->QueueAsyncQuery(STATEMENT->GetDatabase(), std::move(sql), funcRef, STATEMENT);
+        if (!queued)
+            luaL_unref(E->L, LUA_REGISTRYINDEX, funcRef);
+
+        E->Push(queued);
+        return 1;
+    }
+
+    ElunaRegister<ElunaStatement> StatementMethods[] =
+    {
+        // Getters
+        { "GetParameterCount", &LuaStatement::GetParameterCount },
+        { "GetStats", &LuaStatement::GetStats },
+
+        // Setters
+        { "SetNull", &LuaStatement::SetNull },
+        { "SetBool", &LuaStatement::SetBool },
+        { "SetUInt32", &LuaStatement::SetUInt32 },
+        { "SetInt32", &LuaStatement::SetInt32 },
+        { "SetUInt64", &LuaStatement::SetUInt64 },
+        { "SetInt64", &LuaStatement::SetInt64 },
+        { "SetFloat", &LuaStatement::SetFloat },
+        { "SetDouble", &LuaStatement::SetDouble },
+        { "SetString", &LuaStatement::SetString },
+        { "ClearParameters", &LuaStatement::ClearParameters },
+
+        // Other
+        { "Execute", &LuaStatement::Execute },
+        { "Query", &LuaStatement::Query },
+        { "QueryAsync", &LuaStatement::QueryAsync }
+    };
+};
+#undef STATEMENT
+
+#endif
@@ -22,6 +22,8 @@
 #include "GuildMethods.h"
 #include "GameObjectMethods.h"
 #include "ElunaQueryMethods.h"
+#include "ElunaStatementMethods.h"
+#include "ElunaTransactionMethods.h"
 #include "AuraMethods.h"
 #include "AuraEffectMethods.h"
 #include "ElunaProcInfoMethods.h"
@@ -120,6 +122,12 @@ void RegisterMethods(Eluna* E)
     ElunaTemplate<ElunaQuery>::Register(E, "ElunaQuery");
     ElunaTemplate<ElunaQuery>::SetMethods(E, LuaQuery::QueryMethods);
 
+    ElunaTemplate<ElunaStatement>::Register(E, "ElunaStatement");
+    ElunaTemplate<ElunaStatement>::SetMethods(E, LuaStatement::StatementMethods);
+
+    ElunaTemplate<ElunaTransaction>::Register(E, "ElunaTransaction");
+    ElunaTemplate<ElunaTransaction>::SetMethods(E, LuaTransaction::TransactionMethods);
+
     ElunaTemplate<long long>::Register(E, "long long");
     ElunaTemplate<long long>::SetMethods(E, LuaBigInt::LongLongMethods);
 
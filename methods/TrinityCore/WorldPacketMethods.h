@@ -16,6 +16,9 @@
  *
  * The packet can contain further data, the format of which depends on the opcode.
  *
+ * The packet passed to packet events is only valid until the event returns.
+ * Reading or modifying it copies it first, that copy can be kept.
+ *
  * Inherits all methods from: none
  */
 namespace LuaPacket
@@ -310,8 +313,8 @@ namespace LuaPacket
     ElunaRegister<WorldPacket> PacketMethods[] =
     {
         // Getters
-        { "GetOpcode", &LuaPacket::GetOpcode },
-        { "GetSize", &LuaPacket::GetSize },
+        { "GetOpcode", &LuaPacket::GetOpcode, METHOD_REG_ALL, METHOD_FLAG_READ_ONLY },
+        { "GetSize", &LuaPacket::GetSize, METHOD_REG_ALL, METHOD_FLAG_READ_ONLY },
 
         // Setters
         { "SetOpcode", &LuaPacket::SetOpcode },
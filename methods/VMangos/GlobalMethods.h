@@ -8,6 +8,8 @@
 #define GLOBALMETHODS_H
 
 #include "BindingMap.h"
+#include "ElunaMessageBus.h"
+#include "ElunaQueryWorker.h"
 
 /***
  * These functions can be used anywhere at any time, including at start-up.
@@ -592,6 +594,9 @@ namespace LuaGlobalFunctions
      *
      *         GAME_EVENT_START                        =     34,       // (event, gameeventid)
      *         GAME_EVENT_STOP                         =     35,       // (event, gameeventid)
+     *
+     *         // Eluna
+     *         ELUNA_EVENT_ON_MESSAGE                  =     36,       // (event, topic, payload, mapId, instanceId) - message sent with PublishToMap or PublishToWorld, mapId is -1 for the world state
      *     };
      *
      * @proto cancel = (event, function)
@@ -813,6 +818,227 @@ namespace LuaGlobalFunctions
         return RegisterEntryHelper(E, Hooks::REGTYPE_PACKET);
     }
 
+    // Reads the opcode at `index`, false if it is not a number below NUM_MSG_TYPES
+    static bool GetOpcode(Eluna* E, int index, uint32& opcode)
+    {
+        if (!lua_isnumber(E->L, index))
+            return false;
+
+        // converting a negative, NaN or too large double is undefined, those fail the check
+        double value = lua_tonumber(E->L, index);
+        if (!(value >= 0 && value < NUM_MSG_TYPES))
+            return false;
+
+        opcode = static_cast<uint32>(value);
+        return true;
+    }
+
+    // Reads the opcode range of the table entry at the top of the stack, false if it is not one
+    static bool GetOpcodeRange(Eluna* E, uint32& first, uint32& last)
+    {
+        if (lua_istable(E->L, -1))
+        {
+            lua_rawgeti(E->L, -1, 1);
+            lua_rawgeti(E->L, -2, 2);
+            bool isRange = GetOpcode(E, -2, first) && GetOpcode(E, -1, last);
+            lua_pop(E->L, 2);
+            return isRange && first <= last;
+        }
+
+        if (!GetOpcode(E, -1, first))
+            return false;
+
+        last = first;
+        return true;
+    }
+
+    /**
+     * Registers a server packet event handler that is only called for packets with the given opcodes.
+     *
+     * Works like [Global:RegisterServerEvent] for the packet events, but packets with other opcodes are not passed to Lua at all.
+     * The opcodes are given as a table of opcodes and `{ first, last }` ranges, for example `{ 0x0A9, { 0x100, 0x10F } }`.
+     *
+     * @table
+     * @columns [Event, State, Parameters, Comment]
+     * @values [SERVER_EVENT_ON_PACKET_RECEIVE, "WORLD", <event: number, packet: WorldPacket, player: Player>, "Player only if accessible. Can return false, newPacket"]
+     * @values [SERVER_EVENT_ON_PACKET_SEND, "WORLD", <event: number, packet: WorldPacket, player: Player>, "Player only if accessible. Can return false"]
+     *
+     * @proto cancel = (event, opcodes, function)
+     * @proto cancel = (event, opcodes, function, shots)
+     *
+     * @param uint32 event : server event ID, refer to table above
+     * @param table opcodes : opcodes and opcode ranges the function is called for
+     * @param function function : function that will be called when the event occurs
+     * @param uint32 shots = 0 : the number of times the function will be called, 0 means "always call this function"
+     *
+     * @return function cancel : a function that cancels the binding when called
+     */
+    int RegisterServerPacketEvent(Eluna* E)
+    {
+        uint32 ev = E->CHECKVAL<uint32>(1);
+        luaL_checktype(E->L, 2, LUA_TTABLE);
+        luaL_checktype(E->L, 3, LUA_TFUNCTION);
+        uint32 shots = E->CHECKVAL<uint32>(4, 0);
+
+        if (ev != Hooks::SERVER_EVENT_ON_PACKET_RECEIVE && ev != Hooks::SERVER_EVENT_ON_PACKET_SEND)
+            return luaL_argerror(E->L, 1, "packet event expected");
+
+        // Lua errors skip destructors, so every opcode is checked before the filter is created
+        uint32 first = 0;
+        uint32 last = 0;
+        lua_pushnil(E->L);
+        while (lua_next(E->L, 2) != 0)
+        {
+            if (!GetOpcodeRange(E, first, last))
+                return luaL_argerror(E->L, 2, "valid opcode or opcode range expected");
+            lua_pop(E->L, 1);
+        }
+
+        lua_pushvalue(E->L, 3);
+        int functionRef = luaL_ref(E->L, LUA_REGISTRYINDEX);
+        if (functionRef < 0)
+            return luaL_argerror(E->L, 3, "unable to make a ref to function");
+
+        auto filter = std::make_shared<BindingFilter>();
+        lua_pushnil(E->L);
+        while (lua_next(E->L, 2) != 0)
+        {
+            GetOpcodeRange(E, first, last);
+            filter->AddRange(first, last);
+            lua_pop(E->L, 1);
+        }
+
+        return E->Register(Hooks::REGTYPE_SERVER, 0, ObjectGuid(), 0, ev, functionRef, shots, std::move(filter));
+    }
+
+    /**
+     * Sends a message to the Lua states of a map, where it triggers ELUNA_EVENT_ON_MESSAGE.
+     *
+     * The message is queued and handled on the receiving state's next update, on the thread that updates it.
+     * The payload is copied, it can be nil, a boolean, a number, a string or a table of those.
+     * Only states that registered an ELUNA_EVENT_ON_MESSAGE handler receive messages.
+     * Messages sent to a full queue are dropped, see [Global:GetMessageStats].
+     *
+     * @proto queued = (mapId, topic, payload)
+     * @proto queued = (mapId, topic, payload, instanceId)
+     *
+     * @param uint32 mapId : map whose states receive the message
+     * @param string topic : passed to the handlers as is
+     * @param any payload : value sent with the message
+     * @param uint32 instanceId = 0 : only the state of this instance receives the message, 0 sends it to all instances
+     *
+     * @return uint32 queued : the number of states the message was queued for
+     */
+    int PublishToMap(Eluna* E)
+    {
+        uint32 mapId = E->CHECKVAL<uint32>(1);
+        // no C++ objects, encoding the payload can raise a Lua error
+        const char* topic = E->CHECKVAL<const char*>(2);
+        luaL_checkany(E->L, 3);
+        uint32 instanceId = E->CHECKVAL<uint32>(4, 0);
+
+        E->Push(E->PublishMessage(int32(mapId), instanceId, topic, 3));
+        return 1;
+    }
+
+    /**
+     * Sends a message to the world state, where it triggers ELUNA_EVENT_ON_MESSAGE.
+     *
+     * See [Global:PublishToMap] for how messages are delivered.
+     *
+     * @param string topic : passed to the handlers as is
+     * @param any payload : value sent with the message
+     *
+     * @return uint32 queued : 1 if the message was queued, 0 if it was dropped
+     */
+    int PublishToWorld(Eluna* E)
+    {
+        // no C++ objects, encoding the payload can raise a Lua error
+        const char* topic = E->CHECKVAL<const char*>(1);
+        luaL_checkany(E->L, 2);
+
+        E->Push(E->PublishMessage(-1, 0, topic, 2));
+        return 1;
+    }
+
+    /**
+     * Returns statistics of the message queue of the current Lua state.
+     *
+     * All values are 0 when Eluna.MessageQueueSize is 0 or before the state registered an ELUNA_EVENT_ON_MESSAGE handler.
+     *
+     * @return uint32 depth : messages waiting to be handled
+     * @return uint64 delivered : messages handled so far
+     * @return uint64 dropped : messages dropped because the queue was full
+     * @return uint64 averageLatency : average time a message waited in the queue, in microseconds
+     * @return uint64 maxLatency : longest time a message waited in the queue, in microseconds
+     */
+    int GetMessageStats(Eluna* E)
+    {
+        const ElunaMailbox* mailbox = E->GetMailbox();
+        E->Push(mailbox ? mailbox->GetDepth() : 0);
+        E->Push(mailbox ? mailbox->GetDelivered() : 0);
+        E->Push(mailbox ? mailbox->GetDropped() : 0);
+        E->Push(mailbox ? mailbox->GetAverageLatency() : 0);
+        E->Push(mailbox ? mailbox->GetMaxLatency() : 0);
+        return 5;
+    }
+
+    /**
+     * Returns garbage collection statistics of the current Lua state.
+     *
+     * Pauses are the time spent collecting at the end of a state update, see Eluna.GCStepBudget,
+     * or collecting everything after a script error.
+     *
+     * @return int64 heapSize : bytes currently used by the Lua heap
+     * @return uint64 lastPause : duration of the last pause, in microseconds
+     * @return uint64 maxPause : longest pause, in microseconds
+     * @return uint64 totalPause : time spent in all pauses, in microseconds
+     * @return uint32 cycles : collection cycles finished at the end of updates
+     * @return uint32 errorCollects : full collections done after script errors
+     * @return bool generational : true if the state uses generational collection
+     */
+    int GetGCStats(Eluna* E)
+    {
+        const ElunaGarbageCollector& collector = E->GetGarbageCollector();
+        E->Push(ElunaGarbageCollector::GetHeapSize(E->L));
+        E->Push(collector.GetLastPause());
+        E->Push(collector.GetMaxPause());
+        E->Push(collector.GetTotalPause());
+        E->Push(collector.GetCycles());
+        E->Push(collector.GetErrorCollects());
+        E->Push(collector.IsGenerational());
+        return 7;
+    }
+
+    /**
+     * Returns statistics of the worker running [Global:WorldDBQueryAsync] and the like, shared by all Lua states.
+     *
+     * Rejected queries were refused because `Eluna.AsyncQueryQueueSize` queries were already waiting.
+     * A growing queue or many rejections mean the database can't keep up, see `Eluna.AsyncQueryThreads`.
+     *
+     * @return uint64 queued : queries accepted
+     * @return uint64 rejected : queries refused because the queue was full
+     * @return uint64 completed : queries delivered to their state
+     * @return uint64 cancelled : queries skipped or dropped because their state reloaded or closed
+     * @return uint32 depth : queries currently waiting for a thread
+     * @return uint32 maxDepth : most queries waiting at once
+     * @return uint64 averageWait : time spent waiting for a thread, in microseconds
+     * @return uint64 averageRun : time spent running the query, in microseconds
+     */
+    int GetAsyncQueryStats(Eluna* E)
+    {
+        ElunaQueryWorkerStats stats = sElunaQueryWorker->GetStats();
+        E->Push(stats.queued);
+        E->Push(stats.rejected);
+        E->Push(stats.completed);
+        E->Push(stats.cancelled);
+        E->Push(stats.depth);
+        E->Push(stats.maxDepth);
+        E->Push(stats.averageWait);
+        E->Push(stats.averageRun);
+        return 8;
+    }
+
     /**
      * Registers a [Creature] gossip event handler.
      *
@@ -1172,6 +1398,97 @@ namespace LuaGlobalFunctions
         return RegisterEntryHelper(E, Hooks::REGTYPE_GAMEOBJECT);
     }
 
+    /**
+     * Returns the handler timings collected by the profiler of the Lua state, slowest first.
+     *
+     * The profiler only runs when `Eluna.Profiler` is enabled in the configuration file and starts over on reload.
+     * Every entry is a table with the keys `hook`, `source`, `calls`, `time`, `maxTime` and `memory`.
+     * `hook` is "regtype:event[:entry]" or "timed_event", times are in microseconds and include nested hooks,
+     * `memory` is the amount of bytes the handler allocated.
+     *
+     * @param bool reset = false : clears the collected timings after reading them
+     * @return table profile
+     */
+    int GetElunaProfile(Eluna* E)
+    {
+        bool reset = E->CHECKVAL<bool>(1, false);
+
+        std::vector<ElunaProfileEntry> report = E->GetProfiler().GetReport();
+        if (reset)
+            E->GetProfiler().Reset();
+
+        lua_createtable(E->L, static_cast<int>(report.size()), 0);
+        int tbl = lua_gettop(E->L);
+        uint32 counter = 1;
+
+        for (const ElunaProfileEntry& entry : report)
+        {
+            lua_createtable(E->L, 0, 6);
+            E->Push(entry.hook);
+            lua_setfield(E->L, -2, "hook");
+            E->Push(entry.source);
+            lua_setfield(E->L, -2, "source");
+            E->Push(static_cast<double>(entry.calls));
+            lua_setfield(E->L, -2, "calls");
+            E->Push(static_cast<double>(entry.totalTime));
+            lua_setfield(E->L, -2, "time");
+            E->Push(static_cast<double>(entry.maxTime));
+            lua_setfield(E->L, -2, "maxTime");
+            E->Push(static_cast<double>(entry.memory));
+            lua_setfield(E->L, -2, "memory");
+
+            lua_rawseti(E->L, tbl, counter);
+            counter++;
+        }
+
+        lua_settop(E->L, tbl);
+        return 1;
+    }
+
+    /**
+     * Prints the profiler report of the Lua state to the server log, slowest handlers first.
+     *
+     * See [Global:GetElunaProfile] for what is collected.
+     *
+     * @param uint32 limit = 20 : amount of handlers to print, 0 prints all of them
+     */
+    int PrintElunaProfile(Eluna* E)
+    {
+        uint32 limit = E->CHECKVAL<uint32>(1, 20);
+
+        E->GetProfiler().PrintReport(limit);
+        return 0;
+    }
+
+    /**
+     * Returns the memory statistics of the Lua state.
+     *
+     * The table has the keys `used` and `peak` for the bytes currently and at most allocated by the state since it was opened,
+     * `limit` for `Eluna.StateMemoryLimit` in bytes (0 when unlimited), `pooled` for the bytes reserved by the pool allocator,
+     * `allocated` for all bytes ever allocated and `limitHits` for the amount of allocations refused because of the limit.
+     *
+     * @return table stats
+     */
+    int GetStateMemoryStats(Eluna* E)
+    {
+        ElunaAllocator::Stats stats = E->GetAllocator().GetStats();
+
+        lua_createtable(E->L, 0, 6);
+        E->Push(static_cast<double>(stats.used));
+        lua_setfield(E->L, -2, "used");
+        E->Push(static_cast<double>(stats.peak));
+        lua_setfield(E->L, -2, "peak");
+        E->Push(static_cast<double>(stats.limit));
+        lua_setfield(E->L, -2, "limit");
+        E->Push(static_cast<double>(stats.pooled));
+        lua_setfield(E->L, -2, "pooled");
+        E->Push(static_cast<double>(stats.allocated));
+        lua_setfield(E->L, -2, "allocated");
+        E->Push(stats.limitHits);
+        lua_setfield(E->L, -2, "limitHits");
+        return 1;
+    }
+
     /**
      * Reloads the Lua engine.
      */
@@ -1246,6 +1563,12 @@ namespace LuaGlobalFunctions
      * Any results produced are ignored.
      * If you need results from the query, use [Global:WorldDBQuery] instead.
      *
+     * With `Eluna.CoalesceWrites` enabled, the query is sent at the end of the update
+     * together with the other writes to the same database, in one transaction.
+     * Until then [Global:WorldDBQuery] and [Global:WorldDBQueryAsync] do not see its changes.
+     * If one of the writes fails, the writes of every script of the state are rolled back with it
+     * and executed again one by one.
+     *
      *     WorldDBExecute("DELETE FROM my_table")
      *
      * @param string sql : query to execute
@@ -1253,10 +1576,62 @@ namespace LuaGlobalFunctions
     int WorldDBExecute(Eluna* E)
     {
         const char* query = E->CHECKVAL<const char*>(1);
-        WorldDatabase.Execute(query);
+        E->ExecuteSQL(ELUNA_DB_WORLD, query);
         return 0;
     }
 
+    static int DBQueryAsyncHelper(Eluna* E, ElunaDatabase database)
+    {
+        const char* query = E->CHECKVAL<const char*>(1);
+        luaL_checktype(E->L, 2, LUA_TFUNCTION);
+
+        // Push the Lua function onto the stack and create a reference
+        lua_pushvalue(E->L, 2);
+        int funcRef = luaL_ref(E->L, LUA_REGISTRYINDEX);
+
+        // Validate the function reference
+        if (funcRef == LUA_REFNIL || funcRef == LUA_NOREF)
+        {
+            luaL_argerror(E->L, 2, "unable to make a ref to function");
+            return 0;
+        }
+
+        // Run the query on Eluna's query worker, the callback is called on a later update
+        bool queued = E->QueueAsyncQuery(database, query, funcRef);
+        if (!queued)
+            luaL_unref(E->L, LUA_REGISTRYINDEX, funcRef);
+
+        E->Push(queued);
+        return 1;
+    }
+
+    /**
+     * Initiates an asynchronous SQL query on the world database with a callback function.
+     *
+     * The query is executed asynchronously, and the provided Lua function is called when the query completes.
+     * The callback function parameter is the query result (an [ElunaQuery] or nil if no rows found).
+     *
+     * Queries run on `Eluna.AsyncQueryThreads` threads of Eluna's own. At most `Eluna.AsyncQueryQueueSize`
+     * queries wait for a thread, more are rejected. Queries of a reloaded Lua state are cancelled.
+     *
+     *     WorldDBQueryAsync("SELECT entry, name FROM creature_template LIMIT 10", function(results)
+     *        if results then
+     *            repeat
+     *                local entry, name = results:GetUInt32(0), results:GetString(1)
+     *                print(entry, name)
+     *            until not results:NextRow()
+     *        end
+     *     end)
+     *
+     * @param string sql : query to execute asynchronously
+     * @param function callback : the callback function to be called with the query results
+     * @return bool queued : false if the query was rejected because the queue is full
+     */
+    int WorldDBQueryAsync(Eluna* E)
+    {
+        return DBQueryAsyncHelper(E, ELUNA_DB_WORLD);
+    }
+
     /**
      * Executes a SQL query on the character database and returns an [ElunaQuery].
      *
@@ -1291,6 +1666,12 @@ namespace LuaGlobalFunctions
      * Any results produced are ignored.
      * If you need results from the query, use [Global:CharDBQuery] instead.
      *
+     * With `Eluna.CoalesceWrites` enabled, the query is sent at the end of the update
+     * together with the other writes to the same database, in one transaction.
+     * Until then [Global:CharDBQuery] and [Global:CharDBQueryAsync] do not see its changes.
+     * If one of the writes fails, the writes of every script of the state are rolled back with it
+     * and executed again one by one.
+     *
      *     CharDBExecute("DELETE FROM my_table")
      *
      * @param string sql : query to execute
@@ -1298,10 +1679,27 @@ namespace LuaGlobalFunctions
     int CharDBExecute(Eluna* E)
     {
         const char* query = E->CHECKVAL<const char*>(1);
-        CharacterDatabase.Execute(query);
+        E->ExecuteSQL(ELUNA_DB_CHARACTER, query);
         return 0;
     }
 
+    /**
+     * Initiates an asynchronous SQL query on the character database with a callback function.
+     *
+     * The query is executed asynchronously, and the provided Lua function is called when the query completes.
+     * The callback function parameter is the query result (an [ElunaQuery] or nil if no rows found).
+     *
+     * For an example see [Global:WorldDBQueryAsync].
+     *
+     * @param string sql : query to execute asynchronously
+     * @param function callback : the callback function to be called with the query results
+     * @return bool queued : false if the query was rejected because the queue is full
+     */
+    int CharDBQueryAsync(Eluna* E)
+    {
+        return DBQueryAsyncHelper(E, ELUNA_DB_CHARACTER);
+    }
+
     /**
      * Executes a SQL query on the login database and returns an [ElunaQuery].
      *
@@ -1336,6 +1734,12 @@ namespace LuaGlobalFunctions
      * Any results produced are ignored.
      * If you need results from the query, use [Global:AuthDBQuery] instead.
      *
+     * With `Eluna.CoalesceWrites` enabled, the query is sent at the end of the update
+     * together with the other writes to the same database, in one transaction.
+     * Until then [Global:AuthDBQuery] and [Global:AuthDBQueryAsync] do not see its changes.
+     * If one of the writes fails, the writes of every script of the state are rolled back with it
+     * and executed again one by one.
+     *
      *     AuthDBExecute("DELETE FROM my_table")
      *
      * @param string sql : query to execute
@@ -1343,10 +1747,129 @@ namespace LuaGlobalFunctions
     int AuthDBExecute(Eluna* E)
     {
         const char* query = E->CHECKVAL<const char*>(1);
-        LoginDatabase.Execute(query);
+        E->ExecuteSQL(ELUNA_DB_AUTH, query);
         return 0;
     }
 
+    /**
+     * Initiates an asynchronous SQL query on the login database with a callback function.
+     *
+     * The query is executed asynchronously, and the provided Lua function is called when the query completes.
+     * The callback function parameter is the query result (an [ElunaQuery] or nil if no rows found).
+     *
+     * For an example see [Global:WorldDBQueryAsync].
+     *
+     * @param string sql : query to execute asynchronously
+     * @param function callback : the callback function to be called with the query results
+     * @return bool queued : false if the query was rejected because the queue is full
+     */
+    int AuthDBQueryAsync(Eluna* E)
+    {
+        return DBQueryAsyncHelper(E, ELUNA_DB_AUTH);
+    }
+
+    /**
+     * Prepares a SQL statement for the world database and returns an [ElunaStatement].
+     *
+     * Use `?` in place of values, bind them with the setters of the statement and run it as often as needed.
+     * Values are escaped as they are bound, so they don't have to be escaped or formatted into the SQL.
+     *
+     *     local stmt = WorldDBPrepare("SELECT name FROM creature_template WHERE entry = ?")
+     *     stmt:SetUInt32(0, 6)
+     *     local Q = stmt:Query()
+     *
+     * @param string sql : statement with `?` placeholders
+     * @return [ElunaStatement] statement
+     */
+    int WorldDBPrepare(Eluna* E)
+    {
+        std::string sql = E->CHECKVAL<std::string>(1);
+        ElunaStatement statement = std::make_shared<ElunaPreparedStatement>(ELUNA_DB_WORLD, sql);
+        E->Push(&statement);
+        return 1;
+    }
+
+    /**
+     * Prepares a SQL statement for the character database and returns an [ElunaStatement].
+     *
+     * For an example see [Global:WorldDBPrepare].
+     *
+     * @param string sql : statement with `?` placeholders
+     * @return [ElunaStatement] statement
+     */
+    int CharDBPrepare(Eluna* E)
+    {
+        std::string sql = E->CHECKVAL<std::string>(1);
+        ElunaStatement statement = std::make_shared<ElunaPreparedStatement>(ELUNA_DB_CHARACTER, sql);
+        E->Push(&statement);
+        return 1;
+    }
+
+    /**
+     * Prepares a SQL statement for the login database and returns an [ElunaStatement].
+     *
+     * For an example see [Global:WorldDBPrepare].
+     *
+     * @param string sql : statement with `?` placeholders
+     * @return [ElunaStatement] statement
+     */
+    int AuthDBPrepare(Eluna* E)
+    {
+        std::string sql = E->CHECKVAL<std::string>(1);
+        ElunaStatement statement = std::make_shared<ElunaPreparedStatement>(ELUNA_DB_AUTH, sql);
+        E->Push(&statement);
+        return 1;
+    }
+
+    /**
+     * Begins a transaction on the world database and returns an [ElunaTransaction].
+     *
+     * Append statements to it and commit them together, see [Global:CharDBTransaction].
+     *
+     * @return [ElunaTransaction] transaction
+     */
+    int WorldDBTransaction(Eluna* E)
+    {
+        ElunaTransaction transaction = std::make_shared<ElunaSQLTransaction>(ELUNA_DB_WORLD);
+        E->Push(&transaction);
+        return 1;
+    }
+
+    /**
+     * Begins a transaction on the character database and returns an [ElunaTransaction].
+     *
+     * Statements appended to it are sent together on commit, instead of as one query each.
+     *
+     *     local trans = CharDBTransaction()
+     *     for _, item in ipairs(items) do
+     *         saveStatement:SetUInt32(0, item:GetGUIDLow())
+     *         trans:Append(saveStatement)
+     *     end
+     *     trans:Commit()
+     *
+     * @return [ElunaTransaction] transaction
+     */
+    int CharDBTransaction(Eluna* E)
+    {
+        ElunaTransaction transaction = std::make_shared<ElunaSQLTransaction>(ELUNA_DB_CHARACTER);
+        E->Push(&transaction);
+        return 1;
+    }
+
+    /**
+     * Begins a transaction on the login database and returns an [ElunaTransaction].
+     *
+     * Append statements to it and commit them together, see [Global:CharDBTransaction].
+     *
+     * @return [ElunaTransaction] transaction
+     */
+    int AuthDBTransaction(Eluna* E)
+    {
+        ElunaTransaction transaction = std::make_shared<ElunaSQLTransaction>(ELUNA_DB_AUTH);
+        E->Push(&transaction);
+        return 1;
+    }
+
     /**
      * Registers a global timed event.
      *
@@ -2905,6 +3428,7 @@ namespace LuaGlobalFunctions
     {
         // Hooks
         { "RegisterPacketEvent", &LuaGlobalFunctions::RegisterPacketEvent },
+        { "RegisterServerPacketEvent", &LuaGlobalFunctions::RegisterServerPacketEvent },
         { "RegisterServerEvent", &LuaGlobalFunctions::RegisterServerEvent },
         { "RegisterPlayerEvent", &LuaGlobalFunctions::RegisterPlayerEvent },
         { "RegisterGuildEvent", &LuaGlobalFunctions::RegisterGuildEvent },
@@ -2974,7 +3498,10 @@ namespace LuaGlobalFunctions
         { "PrintInfo", &LuaGlobalFunctions::PrintInfo },
         { "PrintError", &LuaGlobalFunctions::PrintError },
         { "PrintDebug", &LuaGlobalFunctions::PrintDebug },
+        { "PrintElunaProfile", &LuaGlobalFunctions::PrintElunaProfile },
         { "GetActiveGameEvents", &LuaGlobalFunctions::GetActiveGameEvents },
+        { "GetElunaProfile", &LuaGlobalFunctions::GetElunaProfile },
+        { "GetStateMemoryStats", &LuaGlobalFunctions::GetStateMemoryStats },
 
         // Boolean
         { "IsInventoryPos", &LuaGlobalFunctions::IsInventoryPos },
@@ -2989,15 +3516,29 @@ namespace LuaGlobalFunctions
         { "SendWorldMessage", &LuaGlobalFunctions::SendWorldMessage },
         { "WorldDBQuery", &LuaGlobalFunctions::WorldDBQuery, METHOD_REG_ALL, METHOD_FLAG_UNSAFE },
         { "WorldDBExecute", &LuaGlobalFunctions::WorldDBExecute },
+        { "WorldDBQueryAsync", &LuaGlobalFunctions::WorldDBQueryAsync },
         { "CharDBQuery", &LuaGlobalFunctions::CharDBQuery, METHOD_REG_ALL, METHOD_FLAG_UNSAFE },
         { "CharDBExecute", &LuaGlobalFunctions::CharDBExecute },
+        { "CharDBQueryAsync", &LuaGlobalFunctions::CharDBQueryAsync },
         { "AuthDBQuery", &LuaGlobalFunctions::AuthDBQuery, METHOD_REG_ALL, METHOD_FLAG_UNSAFE },
         { "AuthDBExecute", &LuaGlobalFunctions::AuthDBExecute },
+        { "AuthDBQueryAsync", &LuaGlobalFunctions::AuthDBQueryAsync },
+        { "WorldDBPrepare", &LuaGlobalFunctions::WorldDBPrepare },
+        { "CharDBPrepare", &LuaGlobalFunctions::CharDBPrepare },
+        { "AuthDBPrepare", &LuaGlobalFunctions::AuthDBPrepare },
+        { "WorldDBTransaction", &LuaGlobalFunctions::WorldDBTransaction },
+        { "CharDBTransaction", &LuaGlobalFunctions::CharDBTransaction },
+        { "AuthDBTransaction", &LuaGlobalFunctions::AuthDBTransaction },
         { "CreateLuaEvent", &LuaGlobalFunctions::CreateLuaEvent },
         { "RemoveEventById", &LuaGlobalFunctions::RemoveEventById },
         { "RemoveEvents", &LuaGlobalFunctions::RemoveEvents },
         { "PerformIngameSpawn", &LuaGlobalFunctions::PerformIngameSpawn },
         { "CreatePacket", &LuaGlobalFunctions::CreatePacket },
+        { "PublishToMap", &LuaGlobalFunctions::PublishToMap },
+        { "PublishToWorld", &LuaGlobalFunctions::PublishToWorld },
+        { "GetMessageStats", &LuaGlobalFunctions::GetMessageStats },
+        { "GetGCStats", &LuaGlobalFunctions::GetGCStats },
+        { "GetAsyncQueryStats", &LuaGlobalFunctions::GetAsyncQueryStats },
         { "AddVendorItem", &LuaGlobalFunctions::AddVendorItem },
         { "VendorRemoveItem", &LuaGlobalFunctions::VendorRemoveItem },
         { "VendorRemoveAllItems", &LuaGlobalFunctions::VendorRemoveAllItems },